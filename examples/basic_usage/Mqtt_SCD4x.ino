@@ -20,12 +20,11 @@
 
 SensirionI2CScd4x scd4x;
 char SCD4xSID[13];
-unsigned long nextMeasurement;
 const unsigned long measurementInterval = 5*60*1000;  //5min
 
 WifiMqttUtility wifiMqttUtil = WifiMqttUtility();
 
-void recordMeasurement() {
+void recordMeasurement(void* arg) {
   uint16_t error;
   char errorMessage[256];
   
@@ -113,25 +112,19 @@ void setup() {
     Serial.println(errorMessage);
   }
   delay(5000); //wait 5sek for first measurement
-  
-  nextMeasurement = millis();
 
   ///////////////add parameters for metadata region, location, and sensor ID. May be set in the config portal
   wifiMqttUtil.addParameter("reg", "Region", 20, "indoor");
   wifiMqttUtil.addParameter("loc", "Location", 20);
   wifiMqttUtil.addParameter("sid", "Sensor ID", 10, SCD4xSID);
   wifiMqttUtil.begin(); //starts WiFi and MQTT services, config portal may be first called here
+
+  recordMeasurement(NULL);
+  wifiMqttUtil.addTimer(measurementInterval, recordMeasurement);  //called periodically from wifiMqttUtil.loop()
 }
 
 void loop() {
-  unsigned long currentMillis = millis();
-  bool overflowIntermediate = (currentMillis + measurementInterval) < currentMillis;
-  if(currentMillis >= nextMeasurement && (! overflowIntermediate)) {
-    recordMeasurement();
-    nextMeasurement = currentMillis + measurementInterval;
-  }
-  
-  wifiMqttUtil.loop(); //checks trigger pin and checks/re-estabilshes connections
+  wifiMqttUtil.loop(); //runs due timers, checks trigger pin and checks/re-estabilshes connections
 }
 
 /*
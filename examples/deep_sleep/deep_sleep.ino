@@ -0,0 +1,23 @@
+#include "WifiUtility.h"
+
+//Battery node: wake, publish one sample, sleep. ESP8266 needs GPIO16 connected to RST for the timer wake up.
+//The first wake (and any wake after a failed connect) runs the full start, all following wakes connect from RTC memory.
+//Use a fixed MQTT client ID, the broker keeps the session (subscriptions, QoS1 messages) while the node sleeps.
+#define SLEEP_MS 60000
+
+WifiMqttUtility wifiMqttUtil = WifiMqttUtility();
+
+void setup() {
+  if(wifiMqttUtil.beginSleepCycle())
+  {
+    const WU_SleepStats &stats = wifiMqttUtil.getSleepStats();
+    String sample = String(F("{\"value\":")) + analogRead(A0) + F(",\"wake\":") + stats.wakeCount + F(",\"connectMs\":") + stats.wakeToConnectMs + F(",\"lastCycleMs\":") + stats.lastWakeToSleepMs + "}";
+    wifiMqttUtil.publish("test/sleep", sample);
+    wifiMqttUtil.loop(); //delivers messages queued by the broker while asleep
+  }
+  wifiMqttUtil.sleep(SLEEP_MS);
+}
+
+void loop() {
+  //not reached
+}
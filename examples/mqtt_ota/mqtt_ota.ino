@@ -0,0 +1,37 @@
+#include "WifiUtility.h"
+
+//Firmware update over MQTT. The MQTT message buffer limits the chunk size (chunk + topic + a few header bytes).
+//Only signed images are accepted: sig is the HMAC-SHA256 of "<size>:<sha256>" keyed with OTA_SIGNING_KEY below.
+//The key is compiled in on purpose. The MQTT password is known to the broker operator and can be changed over remote
+//config, so it must not be used. Keep the key out of version control, anyone who has it can flash their own firmware.
+//Sender side with the mosquitto and openssl tools, waiting for each ack on test/ota/ack (a window of a few chunks works as well):
+//  KEY=<OTA_SIGNING_KEY>; size=$(stat -c%s fw.bin); sha=$(sha256sum fw.bin | cut -c1-64)
+//  sig=$(printf "%s:%s" $size $sha | openssl dgst -sha256 -hmac "$KEY" | sed 's/^.* //')
+//  mosquitto_pub -t test/ota/begin -m "{\"size\":$size,\"md5\":\"$(md5sum fw.bin | cut -c1-32)\",\"sha256\":\"$sha\",\"sig\":\"$sig\"}"
+//  split -b 1024 -d -a 4 fw.bin chunk_
+//  n=0; for f in chunk_*; do mosquitto_pub -t test/ota/chunk/$n -f $f; n=$((n+1)); done
+//  mosquitto_pub -t test/ota/end -n
+//After a lost connection send the same begin message again, the ack holds the chunk to continue with.
+//On ESP8266 a failed write or hash check restarts the node after the error ack because its updater cannot be reset.
+//Start over with begin once it is back.
+#define CHUNK_SIZE 1024
+#define OTA_SIGNING_KEY "change-me-to-a-long-random-key"	//16 to 64 characters
+
+WifiMqttUtility wifiMqttUtil = WifiMqttUtility(CHUNK_SIZE + 128);
+
+void setup() {
+  wifiMqttUtil.begin();
+  wifiMqttUtil.enableOTA("test/ota", OTA_SIGNING_KEY);
+}
+
+void loop() {
+  static bool wasActive = false;
+  const WU_OtaStatus &status = wifiMqttUtil.getOtaStatus();
+  if(status.active != wasActive)
+  {
+    Serial.printf("Update %s, %u of %u bytes\n", status.active ? "running" : "stopped", status.written, status.size);
+    wasActive = status.active;
+  }
+
+  wifiMqttUtil.loop();
+}
@@ -0,0 +1,35 @@
+#include "WifiUtility.h"
+
+//Test against a local TLS broker, e.g. mosquitto with
+//  listener 8883
+//  cafile   ca.crt
+//  certfile server.crt
+//  keyfile  server.key
+//and the server certificate issued for the host name entered as MQTT server in the config portal (port 8883).
+//Paste ca.crt below, or pass NULL to configTLS() to skip verification while testing.
+static const char caCert[] PROGMEM = R"EOF(
+-----BEGIN CERTIFICATE-----
+...
+-----END CERTIFICATE-----
+)EOF";
+
+WifiMqttUtility wifiMqttUtil = WifiMqttUtility();
+
+void setup() {
+  wifiMqttUtil.configTLS(caCert); //before begin(), the certificate has to stay valid
+  wifiMqttUtil.begin();
+}
+
+void loop() {
+  static ulong lastReport = 0;
+  if(millis() - lastReport > 60000)
+  {
+    //handshake time and resumed sessions (ESP8266 only) after reconnects
+    const MQTT_TransportStats &stats = wifiMqttUtil.getTransportStats();
+    Serial.printf("TLS connects %u, resumed %u, last %lums, max %lums\n", stats.connects, stats.resumed, stats.lastConnectMs, stats.maxConnectMs);
+    wifiMqttUtil.publish("test/tls", String(stats.lastConnectMs));
+    lastReport = millis();
+  }
+
+  wifiMqttUtil.loop();
+}
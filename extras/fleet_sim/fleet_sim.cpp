@@ -0,0 +1,897 @@
+/*	MQTT protocol load generator for brokers: thousands of simulated nodes in one process against a real broker.
+
+	This is NOT a test of the library. It does not run WifiUtility.cpp, it re-implements the connection pattern of a
+	node with the default configuration to load a broker: boot, WiFi association (simulated, with the cached DHCP
+	lease fast path after the first connect), TCP connect, MQTT CONNECT with clean session, keepalive pings at the
+	initial keepalive, periodic publishing and the reconnect backoff of backoffConnectionCheck(). Sockets are real
+	and non-blocking, all nodes share one epoll loop.
+
+	Not modelled, so the numbers say nothing about them: link probes and the adaptive keepalive (off by default),
+	the outbound rate classes (the publish rate here stays below the telemetry limit), fallback brokers, the DNS
+	cache (the broker address is resolved once), TLS and persistent sessions.
+
+	Linux only, build with
+		g++ -O2 -std=c++11 -o fleet_sim fleet_sim.cpp
+
+	Usage
+		fleet_sim [-H host] [-p port] [-n nodes] [-r publishes per minute] [-q qos] [-d duration s] [-s script]
+		          [-a association min ms] [-A association max ms] [-D dhcp ms] [-f wifi failure %] [-P payload bytes] [-c client prefix]
+
+	A script has one command per line, "<time s> <command> [args]", lines starting with # are ignored:
+		0   storm 1.0 5		power cut: fraction of the nodes off for 5 s, then all power up at the same time
+		30  rate 120		publishes per minute and node
+		30  qos 1			QoS of following publishes, latency is measured PUBLISH -> PUBACK for QoS 1
+		120 end
+	Without a script all nodes power up at 0 and the run ends after the duration.
+
+	Many nodes need a higher open file limit (ulimit -n) and possibly more local ports (net.ipv4.ip_local_port_range).
+*/
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <random>
+
+//copies of the library defaults (WifiUtility.h), not checked against it
+#define MQTT_KEEPALIVE_S			10		//initial keepalive, stays fixed without link probes
+#define RECONNECT_BACKOFF_MIN_MS	1000
+#define RECONNECT_BACKOFF_MAX_MS	60000
+#define WIFI_CONNECT_TIMEOUT_MS		10000
+
+//timeouts of the Arduino clients
+#define TCP_CONNECT_TIMEOUT_MS		3000
+#define MQTT_COMMAND_TIMEOUT_MS		1000	//arduino-mqtt default, CONNACK and PUBACK
+
+#define BOOT_MS						300
+#define STATUS_INTERVAL_MS			5000
+#define MAX_EVENTS					256
+
+
+static uint64_t nowMs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+static size_t residentBytes()
+{
+	long pages = 0, resident = 0;
+	FILE* f = fopen("/proc/self/statm", "r");
+	if(f == NULL)
+		return 0;
+	if(fscanf(f, "%ld %ld", &pages, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return (size_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+typedef enum
+{
+	NODE_OFF = 0,
+	NODE_BOOTING,
+	NODE_ASSOCIATING,
+	NODE_TCP_CONNECTING,
+	NODE_WAIT_CONNACK,
+	NODE_ONLINE,
+	NODE_BACKOFF
+} NodeState;
+
+//kept small, the memory per node is part of the report
+typedef struct
+{
+	int fd;
+	uint8_t state;
+	bool hasLease;			//association takes the fast path after the first successful connect
+	bool assocFails;		//current association attempt runs into the timeout
+	bool inStorm;
+	uint16_t packetID;
+	uint16_t pendingID;		//QoS 1 publish waiting for PUBACK, 0 if none
+	uint32_t backoffMs;
+	uint32_t seq;
+	uint64_t powerOnMs;
+	uint64_t deadlineMs;	//timeout of the current state
+	uint64_t nextPingMs;
+	uint64_t nextPublishMs;
+	uint64_t pingSentMs;
+	uint64_t pendingSentMs;
+	uint64_t scheduledMs;	//entry in the timer heap
+	std::string in;
+	std::string out;
+} Node;
+
+typedef struct
+{
+	uint64_t atMs;
+	uint32_t node;
+} TimerEntry;
+
+struct TimerLater
+{
+	bool operator()(const TimerEntry &a, const TimerEntry &b) const { return a.atMs > b.atMs; }
+};
+
+typedef struct
+{
+	double atS;
+	std::string command;
+	double arg1;
+	double arg2;
+} ScriptCommand;
+
+typedef struct
+{
+	uint64_t connects;
+	uint64_t connectFailures;
+	uint64_t wifiFailures;
+	uint64_t linkLosses;
+	uint64_t publishes;
+	uint64_t pubacks;
+	uint64_t publishTimeouts;
+	std::vector<uint32_t> connectLatencies;	//power on -> CONNACK
+	std::vector<uint32_t> publishLatencies;	//PUBLISH -> PUBACK
+} FleetStats;
+
+
+class Fleet
+{
+	public:
+	Fleet() : nodeCount_(100), ratePerMin_(6), qos_(0), assocMinMs_(800), assocMaxMs_(2500), dhcpMs_(1200), wifiFailPct_(0),
+				payloadSize_(32), clientPrefix_("fleet"), epfd_(-1), stats_(), stormStartMs_(0), stormPending_(0), rng_(1234) {}
+
+	bool setBroker(const char* host, int port);
+	bool begin();
+	void run(std::vector<ScriptCommand> &script);
+
+	uint32_t nodeCount_;
+	double ratePerMin_;
+	int qos_;
+	uint32_t assocMinMs_;
+	uint32_t assocMaxMs_;
+	uint32_t dhcpMs_;
+	double wifiFailPct_;
+	uint32_t payloadSize_;
+	std::string clientPrefix_;
+
+	private:
+	void schedule(uint32_t i);
+	void tick(uint32_t i, uint64_t now);
+	void powerOff(uint32_t i);
+	void powerOn(uint32_t i, uint64_t now);
+	void associate(uint32_t i, uint64_t now);
+	void startTcp(uint32_t i, uint64_t now);
+	void fail(uint32_t i, uint64_t now);
+	void closeSocket(uint32_t i);
+	void onWritable(uint32_t i, uint64_t now);
+	void onReadable(uint32_t i, uint64_t now);
+	void handlePacket(uint32_t i, uint8_t type, const uint8_t* body, uint32_t length, uint64_t now);
+	void send(uint32_t i, const std::string &packet);
+	void updateEvents(uint32_t i);
+	void publish(uint32_t i, uint64_t now);
+	uint64_t publishInterval();
+	void setRate(double ratePerMin, uint64_t now);
+	void storm(double fraction, double outageS, uint64_t now);
+	void status(uint64_t now, uint64_t startMs);
+	void report(uint64_t durationMs);
+
+	static void appendLength(std::string &packet, uint32_t length);
+	static void appendString(std::string &packet, const std::string &text);
+
+	struct sockaddr_in broker_;
+	std::vector<Node> nodes_;
+	std::priority_queue<TimerEntry, std::vector<TimerEntry>, TimerLater> timers_;
+	int epfd_;
+	FleetStats stats_;
+
+	uint64_t stormStartMs_;
+	uint32_t stormPending_;
+	std::vector<uint32_t> stormDurations_;
+	size_t baseResident_;
+	size_t fleetResident_;
+
+	std::mt19937 rng_;
+};
+
+
+bool Fleet::setBroker(const char* host, int port)
+{
+	struct addrinfo hints, *res;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(host, NULL, &hints, &res) != 0)
+		return false;
+	memcpy(&broker_, res->ai_addr, sizeof(broker_));
+	broker_.sin_port = htons(port);
+	freeaddrinfo(res);
+	return true;
+}
+
+bool Fleet::begin()
+{
+	//one descriptor per node plus some headroom
+	struct rlimit limit;
+	if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < nodeCount_ + 64)
+	{
+		limit.rlim_cur = std::min((rlim_t)nodeCount_ + 64, limit.rlim_max);
+		setrlimit(RLIMIT_NOFILE, &limit);
+		if(limit.rlim_cur < nodeCount_ + 64)
+			fprintf(stderr, "warning: open file limit %lu is below the node count\n", (unsigned long)limit.rlim_cur);
+	}
+
+	epfd_ = epoll_create1(0);
+	if(epfd_ < 0)
+		return false;
+
+	baseResident_ = residentBytes();
+	nodes_.resize(nodeCount_);
+	for(uint32_t i=0; i<nodeCount_; i++)
+	{
+		nodes_[i].fd = -1;
+		nodes_[i].state = NODE_OFF;
+		nodes_[i].hasLease = false;
+		nodes_[i].inStorm = false;
+		nodes_[i].packetID = 0;
+		nodes_[i].pendingID = 0;
+		nodes_[i].seq = 0;
+		nodes_[i].scheduledMs = 0;
+	}
+	stats_.connectLatencies.reserve(nodeCount_);
+	fleetResident_ = 0;
+	return true;
+}
+
+void Fleet::run(std::vector<ScriptCommand> &script)
+{
+	struct epoll_event events[MAX_EVENTS];
+	uint64_t startMs = nowMs();
+	uint64_t lastStatusMs = startMs;
+	size_t nextCommand = 0;
+	bool running = true;
+
+	while(running)
+	{
+		uint64_t now = nowMs();
+
+		//script commands due
+		while(nextCommand < script.size() && startMs + (uint64_t)(script[nextCommand].atS*1000) <= now)
+		{
+			ScriptCommand &cmd = script[nextCommand++];
+			printf("[%7.1fs] %s %g %g\n", (now - startMs)/1000.0, cmd.command.c_str(), cmd.arg1, cmd.arg2);
+			if(cmd.command == "storm")
+				storm(cmd.arg1, cmd.arg2, now);
+			else if(cmd.command == "rate")
+				setRate(cmd.arg1, now);
+			else if(cmd.command == "qos")
+				qos_ = (int)cmd.arg1;
+			else if(cmd.command == "end")
+				running = false;
+		}
+
+		//node timers due, stale heap entries (rescheduled nodes) are skipped
+		while(!timers_.empty() && timers_.top().atMs <= now)
+		{
+			TimerEntry entry = timers_.top();
+			timers_.pop();
+			Node &node = nodes_[entry.node];
+			if(node.scheduledMs != entry.atMs)
+				continue;
+			node.scheduledMs = 0;
+			tick(entry.node, now);
+			schedule(entry.node);
+		}
+
+		if(now - lastStatusMs >= STATUS_INTERVAL_MS)
+		{
+			status(now, startMs);
+			lastStatusMs = now;
+		}
+
+		//sleep until the next timer, script command or status line
+		uint64_t wakeMs = lastStatusMs + STATUS_INTERVAL_MS;
+		if(!timers_.empty())
+			wakeMs = std::min(wakeMs, timers_.top().atMs);
+		if(nextCommand < script.size())
+			wakeMs = std::min(wakeMs, startMs + (uint64_t)(script[nextCommand].atS*1000));
+		int timeout = (wakeMs > now) ? (int)(wakeMs - now) : 0;
+
+		int ready = epoll_wait(epfd_, events, MAX_EVENTS, timeout);
+		now = nowMs();
+		for(int e=0; e<ready; e++)
+		{
+			uint32_t i = events[e].data.u32;
+			if(nodes_[i].fd < 0)
+				continue;
+			if(events[e].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+				onWritable(i, now);
+			if(nodes_[i].fd >= 0 && (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+				onReadable(i, now);
+			schedule(i);
+		}
+	}
+	report(nowMs() - startMs);
+}
+
+void Fleet::schedule(uint32_t i)
+{
+	Node &node = nodes_[i];
+	uint64_t next = node.deadlineMs;
+	if(node.state == NODE_ONLINE)
+	{
+		next = node.nextPingMs;
+		if(node.nextPublishMs != 0)
+			next = std::min(next, node.nextPublishMs);
+		if(node.pingSentMs != 0)
+			next = std::min(next, node.pingSentMs + MQTT_KEEPALIVE_S*1500UL);
+		if(node.pendingID != 0)
+			next = std::min(next, node.pendingSentMs + MQTT_COMMAND_TIMEOUT_MS);
+	}
+	if(node.state == NODE_OFF && node.deadlineMs == 0)
+		next = 0;
+	if(next == 0 || next == node.scheduledMs)
+		return;
+	node.scheduledMs = next;
+	TimerEntry entry = {next, i};
+	timers_.push(entry);
+}
+
+void Fleet::tick(uint32_t i, uint64_t now)
+{
+	Node &node = nodes_[i];
+	switch(node.state)
+	{
+		case NODE_OFF:
+			if(node.deadlineMs != 0 && now >= node.deadlineMs)
+				powerOn(i, now);	//end of an outage
+			break;
+		case NODE_BOOTING:
+			if(now >= node.deadlineMs)
+				associate(i, now);
+			break;
+		case NODE_ASSOCIATING:
+			if(now < node.deadlineMs)
+				break;
+			if(node.assocFails)
+			{
+				stats_.wifiFailures++;
+				associate(i, now);	//next network/attempt
+			}
+			else
+				startTcp(i, now);
+			break;
+		case NODE_TCP_CONNECTING:
+		case NODE_WAIT_CONNACK:
+			if(now >= node.deadlineMs)
+				fail(i, now);
+			break;
+		case NODE_BACKOFF:
+			if(now >= node.deadlineMs)
+				startTcp(i, now);	//WiFi stays up, only MQTT is reset
+			break;
+		case NODE_ONLINE:
+			if(node.pingSentMs != 0 && now >= node.pingSentMs + MQTT_KEEPALIVE_S*1500UL)
+			{
+				stats_.linkLosses++;
+				fail(i, now);
+				break;
+			}
+			if(node.pendingID != 0 && now >= node.pendingSentMs + MQTT_COMMAND_TIMEOUT_MS)
+			{
+				stats_.publishTimeouts++;
+				node.pendingID = 0;
+			}
+			if(now >= node.nextPingMs)
+			{
+				static const std::string pingreq("\xC0\x00", 2);
+				node.pingSentMs = now;
+				node.nextPingMs = now + MQTT_KEEPALIVE_S*1000UL;
+				send(i, pingreq);
+				if(node.fd < 0)
+					break;
+			}
+			if(node.nextPublishMs != 0 && now >= node.nextPublishMs)
+				publish(i, now);
+			break;
+	}
+}
+
+void Fleet::powerOff(uint32_t i)
+{
+	closeSocket(i);
+	Node &node = nodes_[i];
+	node.state = NODE_OFF;
+	node.deadlineMs = 0;
+	node.pendingID = 0;
+	node.pingSentMs = 0;
+}
+
+void Fleet::powerOn(uint32_t i, uint64_t now)
+{
+	//RTC and lease file survive a power cut only on the filesystem, the lease is kept
+	Node &node = nodes_[i];
+	node.state = NODE_BOOTING;
+	node.powerOnMs = now;
+	node.deadlineMs = now + BOOT_MS;
+	node.backoffMs = 0;
+}
+
+void Fleet::associate(uint32_t i, uint64_t now)
+{
+	Node &node = nodes_[i];
+	std::uniform_int_distribution<uint32_t> assoc(assocMinMs_, std::max(assocMinMs_, assocMaxMs_));
+	std::uniform_real_distribution<double> chance(0, 100);
+	node.state = NODE_ASSOCIATING;
+	node.assocFails = chance(rng_) < wifiFailPct_;
+	if(node.assocFails)
+		node.deadlineMs = now + WIFI_CONNECT_TIMEOUT_MS;
+	else
+		node.deadlineMs = now + assoc(rng_) + (node.hasLease ? 0 : dhcpMs_);
+}
+
+void Fleet::startTcp(uint32_t i, uint64_t now)
+{
+	Node &node = nodes_[i];
+	node.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if(node.fd < 0)
+	{
+		fail(i, now);
+		return;
+	}
+	int one = 1;
+	setsockopt(node.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if(connect(node.fd, (struct sockaddr*) &broker_, sizeof(broker_)) < 0 && errno != EINPROGRESS)
+	{
+		fail(i, now);
+		return;
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLOUT | EPOLLIN;
+	ev.data.u32 = i;
+	epoll_ctl(epfd_, EPOLL_CTL_ADD, node.fd, &ev);
+	node.state = NODE_TCP_CONNECTING;
+	node.deadlineMs = now + TCP_CONNECT_TIMEOUT_MS;
+	node.in.clear();
+	node.out.clear();
+}
+
+void Fleet::fail(uint32_t i, uint64_t now)
+{
+	//same doubling as WifiUtility::backoffConnectionCheck()
+	Node &node = nodes_[i];
+	closeSocket(i);
+	stats_.connectFailures++;
+	node.backoffMs = (node.backoffMs == 0) ? RECONNECT_BACKOFF_MIN_MS : std::min(2*node.backoffMs, (uint32_t)RECONNECT_BACKOFF_MAX_MS);
+	node.state = NODE_BACKOFF;
+	node.deadlineMs = now + node.backoffMs;
+	node.pendingID = 0;
+	node.pingSentMs = 0;
+}
+
+void Fleet::closeSocket(uint32_t i)
+{
+	Node &node = nodes_[i];
+	if(node.fd < 0)
+		return;
+	epoll_ctl(epfd_, EPOLL_CTL_DEL, node.fd, NULL);
+	close(node.fd);
+	node.fd = -1;
+	std::string().swap(node.in);
+	std::string().swap(node.out);
+}
+
+void Fleet::onWritable(uint32_t i, uint64_t now)
+{
+	Node &node = nodes_[i];
+	if(node.state == NODE_TCP_CONNECTING)
+	{
+		int error = 0;
+		socklen_t len = sizeof(error);
+		if(getsockopt(node.fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0)
+		{
+			fail(i, now);
+			return;
+		}
+
+		//CONNECT, MQTT 3.1.1 with clean session
+		char clientID[64];
+		snprintf(clientID, sizeof(clientID), "%s-%u", clientPrefix_.c_str(), i);
+		std::string body;
+		appendString(body, "MQTT");
+		body += (char)0x04;
+		body += (char)0x02;
+		body += (char)(MQTT_KEEPALIVE_S >> 8);
+		body += (char)(MQTT_KEEPALIVE_S & 0xFF);
+		appendString(body, clientID);
+		std::string packet(1, (char)0x10);
+		appendLength(packet, body.size());
+		packet += body;
+
+		node.state = NODE_WAIT_CONNACK;
+		node.deadlineMs = now + MQTT_COMMAND_TIMEOUT_MS;
+		send(i, packet);
+		return;
+	}
+
+	if(!node.out.empty())
+		send(i, std::string());
+}
+
+void Fleet::onReadable(uint32_t i, uint64_t now)
+{
+	Node &node = nodes_[i];
+	char buffer[1024];
+	while(true)
+	{
+		ssize_t n = recv(node.fd, buffer, sizeof(buffer), 0);
+		if(n > 0)
+		{
+			node.in.append(buffer, n);
+			continue;
+		}
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		//closed by the broker or error
+		if(node.state == NODE_ONLINE)
+			stats_.linkLosses++;
+		fail(i, now);
+		return;
+	}
+
+	//complete packets: fixed header, remaining length, body
+	size_t pos = 0;
+	while(pos + 2 <= node.in.size())
+	{
+		const uint8_t* data = (const uint8_t*) node.in.data();
+		uint32_t length = 0, multiplier = 1;
+		size_t p = pos + 1;
+		bool complete = false;
+		while(p < node.in.size() && p < pos + 5)
+		{
+			length += (data[p] & 0x7F) * multiplier;
+			multiplier *= 128;
+			if((data[p++] & 0x80) == 0)
+			{
+				complete = true;
+				break;
+			}
+		}
+		if(!complete || p + length > node.in.size())
+			break;
+		handlePacket(i, data[pos] >> 4, data + p, length, now);
+		if(nodes_[i].fd < 0)
+			return;	//failed while handling
+		pos = p + length;
+	}
+	node.in.erase(0, pos);
+}
+
+void Fleet::handlePacket(uint32_t i, uint8_t type, const uint8_t* body, uint32_t length, uint64_t now)
+{
+	Node &node = nodes_[i];
+	switch(type)
+	{
+		case 2:		//CONNACK
+			if(node.state != NODE_WAIT_CONNACK || length < 2 || body[1] != 0)
+			{
+				fail(i, now);
+				return;
+			}
+			node.state = NODE_ONLINE;
+			node.hasLease = true;
+			node.backoffMs = 0;
+			node.deadlineMs = 0;
+			node.pingSentMs = 0;
+			node.nextPingMs = now + MQTT_KEEPALIVE_S*1000UL;
+			node.nextPublishMs = 0;
+			if(ratePerMin_ > 0)
+			{
+				//spread the first publish over one interval
+				std::uniform_int_distribution<uint64_t> phase(0, publishInterval());
+				node.nextPublishMs = now + phase(rng_);
+			}
+			stats_.connects++;
+			stats_.connectLatencies.push_back(now - node.powerOnMs);
+			if(node.inStorm)
+			{
+				node.inStorm = false;
+				if(--stormPending_ == 0)
+				{
+					stormDurations_.push_back(now - stormStartMs_);
+					fleetResident_ = std::max(fleetResident_, residentBytes());
+					printf("storm settled after %.1fs\n", (now - stormStartMs_)/1000.0);
+				}
+			}
+			break;
+		case 4:		//PUBACK
+			if(length >= 2 && node.pendingID == ((body[0] << 8) | body[1]))
+			{
+				stats_.pubacks++;
+				stats_.publishLatencies.push_back(now - node.pendingSentMs);
+				node.pendingID = 0;
+			}
+			break;
+		case 13:	//PINGRESP
+			node.pingSentMs = 0;
+			break;
+		default:
+			break;
+	}
+}
+
+void Fleet::send(uint32_t i, const std::string &packet)
+{
+	Node &node = nodes_[i];
+	node.out += packet;
+	while(!node.out.empty())
+	{
+		ssize_t n = ::send(node.fd, node.out.data(), node.out.size(), MSG_NOSIGNAL);
+		if(n < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			fail(i, nowMs());
+			return;
+		}
+		node.out.erase(0, n);
+	}
+	updateEvents(i);
+}
+
+void Fleet::updateEvents(uint32_t i)
+{
+	//write interest only while output is pending
+	Node &node = nodes_[i];
+	struct epoll_event ev;
+	ev.events = EPOLLIN | (node.out.empty() ? 0u : (uint32_t)EPOLLOUT);
+	ev.data.u32 = i;
+	epoll_ctl(epfd_, EPOLL_CTL_MOD, node.fd, &ev);
+}
+
+void Fleet::publish(uint32_t i, uint64_t now)
+{
+	Node &node = nodes_[i];
+	node.nextPublishMs = (ratePerMin_ > 0) ? now + publishInterval() : 0;
+
+	//a device publishing QoS 1 waits for the PUBACK of the previous message
+	int qos = qos_;
+	if(qos > 0 && node.pendingID != 0)
+		return;
+
+	char topic[80];
+	snprintf(topic, sizeof(topic), "%s/%u/data", clientPrefix_.c_str(), i);
+	std::string payload = "{\"seq\":" + std::to_string(++node.seq) + "}";
+	if(payload.size() < payloadSize_)
+		payload.append(payloadSize_ - payload.size(), ' ');
+
+	std::string body;
+	appendString(body, topic);
+	if(qos > 0)
+	{
+		if(++node.packetID == 0)
+			node.packetID = 1;
+		body += (char)(node.packetID >> 8);
+		body += (char)(node.packetID & 0xFF);
+		node.pendingID = node.packetID;
+		node.pendingSentMs = now;
+	}
+	body += payload;
+	std::string packet(1, (char)(0x30 | (qos << 1)));
+	appendLength(packet, body.size());
+	packet += body;
+	stats_.publishes++;
+	send(i, packet);
+}
+
+void Fleet::setRate(double ratePerMin, uint64_t now)
+{
+	ratePerMin_ = ratePerMin;
+	if(ratePerMin_ <= 0)
+		return;
+	//nodes that were idle start within one interval
+	std::uniform_int_distribution<uint64_t> phase(0, publishInterval());
+	for(uint32_t i=0; i<nodeCount_; i++)
+	{
+		if(nodes_[i].state == NODE_ONLINE && nodes_[i].nextPublishMs == 0)
+		{
+			nodes_[i].nextPublishMs = now + phase(rng_);
+			schedule(i);
+		}
+	}
+}
+
+uint64_t Fleet::publishInterval()
+{
+	return (uint64_t)(60000.0 / ratePerMin_);
+}
+
+void Fleet::storm(double fraction, double outageS, uint64_t now)
+{
+	//the same nodes every time: the first fraction of the fleet
+	uint32_t count = std::min(nodeCount_, (uint32_t)(fraction * nodeCount_ + 0.5));
+	stormStartMs_ = now + (uint64_t)(outageS*1000);
+	stormPending_ = count;
+	for(uint32_t i=0; i<count; i++)
+	{
+		powerOff(i);
+		nodes_[i].inStorm = true;
+		if(outageS > 0)
+			nodes_[i].deadlineMs = stormStartMs_;
+		else
+			powerOn(i, now);
+		nodes_[i].scheduledMs = 0;
+		schedule(i);
+	}
+}
+
+void Fleet::status(uint64_t now, uint64_t startMs)
+{
+	uint32_t online = 0, connecting = 0, backoff = 0;
+	for(uint32_t i=0; i<nodeCount_; i++)
+	{
+		if(nodes_[i].state == NODE_ONLINE)
+			online++;
+		else if(nodes_[i].state == NODE_BACKOFF)
+			backoff++;
+		else if(nodes_[i].state != NODE_OFF)
+			connecting++;
+	}
+	printf("[%7.1fs] online %u, connecting %u, backoff %u, publishes %llu, failures %llu\n", (now - startMs)/1000.0, online, connecting, backoff,
+			(unsigned long long)stats_.publishes, (unsigned long long)stats_.connectFailures);
+	fflush(stdout);
+}
+
+static void printPercentiles(const char* name, std::vector<uint32_t> &values)
+{
+	if(values.empty())
+	{
+		printf("%-18s no samples\n", name);
+		return;
+	}
+	std::sort(values.begin(), values.end());
+	size_t n = values.size();
+	printf("%-18s n %zu, p50 %u ms, p90 %u ms, p99 %u ms, max %u ms\n", name, n, values[n/2], values[n*90/100], values[n*99/100], values[n-1]);
+}
+
+void Fleet::report(uint64_t durationMs)
+{
+	fleetResident_ = std::max(fleetResident_, residentBytes());
+	printf("\n---- %u nodes, %.1fs ----\n", nodeCount_, durationMs/1000.0);
+	printf("connects %llu, failed attempts %llu, wifi timeouts %llu, link losses %llu\n", (unsigned long long)stats_.connects,
+			(unsigned long long)stats_.connectFailures, (unsigned long long)stats_.wifiFailures, (unsigned long long)stats_.linkLosses);
+	printf("publishes %llu, pubacks %llu, publish timeouts %llu\n", (unsigned long long)stats_.publishes, (unsigned long long)stats_.pubacks, (unsigned long long)stats_.publishTimeouts);
+	for(size_t s=0; s<stormDurations_.size(); s++)
+		printf("storm %zu settled after %.1fs\n", s + 1, stormDurations_[s]/1000.0);
+	if(stormPending_ > 0)
+		printf("last storm not settled, %u nodes still offline\n", stormPending_);
+	printPercentiles("connect latency", stats_.connectLatencies);
+	printPercentiles("publish latency", stats_.publishLatencies);
+	size_t perNode = (fleetResident_ > baseResident_) ? (fleetResident_ - baseResident_) / nodeCount_ : 0;
+	printf("memory: %zu kB resident, %zu bytes per node (node state %zu bytes)\n", fleetResident_/1024, perNode, sizeof(Node));
+}
+
+void Fleet::appendLength(std::string &packet, uint32_t length)
+{
+	do
+	{
+		uint8_t digit = length % 128;
+		length /= 128;
+		if(length > 0)
+			digit |= 0x80;
+		packet += (char)digit;
+	} while(length > 0);
+}
+
+void Fleet::appendString(std::string &packet, const std::string &text)
+{
+	packet += (char)(text.size() >> 8);
+	packet += (char)(text.size() & 0xFF);
+	packet += text;
+}
+
+
+static bool loadScript(const char* filename, std::vector<ScriptCommand> &script)
+{
+	FILE* f = fopen(filename, "r");
+	if(f == NULL)
+		return false;
+	char line[256];
+	while(fgets(line, sizeof(line), f))
+	{
+		char command[32];
+		ScriptCommand cmd = {0, "", 0, 0};
+		if(line[0] == '#' || sscanf(line, "%lf %31s %lf %lf", &cmd.atS, command, &cmd.arg1, &cmd.arg2) < 2)
+			continue;
+		cmd.command = command;
+		if(cmd.command == "storm" && cmd.arg1 == 0)
+			cmd.arg1 = 1;
+		script.push_back(cmd);
+	}
+	fclose(f);
+	std::stable_sort(script.begin(), script.end(), [](const ScriptCommand &a, const ScriptCommand &b) { return a.atS < b.atS; });
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	Fleet fleet;
+	const char* host = "127.0.0.1";
+	int port = 1883;
+	double durationS = 60;
+	const char* scriptFile = NULL;
+
+	int opt;
+	while((opt = getopt(argc, argv, "H:p:n:r:q:d:s:a:A:D:f:P:c:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'H': host = optarg; break;
+			case 'p': port = atoi(optarg); break;
+			case 'n': fleet.nodeCount_ = atoi(optarg); break;
+			case 'r': fleet.ratePerMin_ = atof(optarg); break;
+			case 'q': fleet.qos_ = atoi(optarg) > 0 ? 1 : 0; break;
+			case 'd': durationS = atof(optarg); break;
+			case 's': scriptFile = optarg; break;
+			case 'a': fleet.assocMinMs_ = atoi(optarg); break;
+			case 'A': fleet.assocMaxMs_ = atoi(optarg); break;
+			case 'D': fleet.dhcpMs_ = atoi(optarg); break;
+			case 'f': fleet.wifiFailPct_ = atof(optarg); break;
+			case 'P': fleet.payloadSize_ = atoi(optarg); break;
+			case 'c': fleet.clientPrefix_ = optarg; break;
+			default:
+				fprintf(stderr, "usage: %s [-H host] [-p port] [-n nodes] [-r publishes/min] [-q qos] [-d duration s] [-s script] "
+								"[-a assoc min ms] [-A assoc max ms] [-D dhcp ms] [-f wifi failure %%] [-P payload bytes] [-c client prefix]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	std::vector<ScriptCommand> script;
+	if(scriptFile != NULL)
+	{
+		if(!loadScript(scriptFile, script))
+		{
+			fprintf(stderr, "cannot read script %s\n", scriptFile);
+			return 1;
+		}
+	}
+	else
+	{
+		ScriptCommand start = {0, "storm", 1, 0};
+		ScriptCommand end = {durationS, "end", 0, 0};
+		script.push_back(start);
+		script.push_back(end);
+	}
+
+	if(fleet.nodeCount_ == 0 || !fleet.setBroker(host, port))
+	{
+		fprintf(stderr, "invalid node count or broker %s\n", host);
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	if(!fleet.begin())
+	{
+		perror("epoll");
+		return 1;
+	}
+	printf("%u nodes against %s:%d\n", fleet.nodeCount_, host, port);
+	fleet.run(script);
+	return 0;
+}
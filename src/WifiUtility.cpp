@@ -1,5 +1,225 @@
 #include "WifiUtility.h"
 
+//lwIP internals for the DHCP lease time and the ARP conflict check
+#include "lwip/netif.h"
+#include "lwip/etharp.h"
+#include "lwip/dhcp.h"
+#include "lwip/dns.h"
+#ifdef ESP32
+	#include "lwip/priv/tcpip_priv.h"	//tcpip_api_call, lwIP runs in its own task
+#else
+	extern "C" {
+		#include <user_interface.h>		//wifi_station_dhcpc_stop
+	}
+#endif
+
+//CRC-32 of the ROM on ESP32 for the stored files, can_yield() of the core on ESP8266
+#ifdef ESP32
+	#include <rom/crc.h>
+#else
+	#include <coredecls.h>
+#endif
+
+//the heap guard only counts allocations of the loop task
+#if WU_HEAP_GUARD && defined(ESP32)
+	#include <freertos/FreeRTOS.h>
+	#include <freertos/task.h>
+#endif
+
+//flash writer for the firmware update over MQTT
+#ifdef ESP32
+	#include <Update.h>
+	#include <mbedtls/md.h>	//HMAC of the image signature
+#else
+	#include <Updater.h>
+#endif
+
+//iterating JSON objects differs between ArduinoJson 5 and 6
+#if (ARDUINOJSON_VERSION_MAJOR >= 6)
+	#define JSON_PAIR			JsonPair
+	#define JSON_KEY(kv)		(kv).key().c_str()
+	#define JSON_VALUE(kv)		(kv).value()
+#else
+	#define JSON_PAIR			JsonPair&
+	#define JSON_KEY(kv)		(kv).key
+	#define JSON_VALUE(kv)		(kv).value
+#endif
+
+//JSON documents come from the heap unless static memory is configured. Then all share one static document instead of
+//1 KB on the 4 KB ESP8266 loop stack each, a user must not be in use anymore when it calls the next (e.g. saveConfigFile())
+#if (ARDUINOJSON_VERSION_MAJOR >= 6)
+	#if WU_STATIC_MEMORY
+		static StaticJsonDocument<WU_JSON_DOC_SIZE> sharedJsonDocument;
+		#define JSON_DOCUMENT(name)		JsonDocument& name = sharedJsonDocument; name.clear()
+	#else
+		#define JSON_DOCUMENT(name)		DynamicJsonDocument name(WU_JSON_DOC_SIZE)
+	#endif
+#else
+	#if WU_STATIC_MEMORY
+		static StaticJsonBuffer<WU_JSON_DOC_SIZE> sharedJsonBuffer;
+		#define JSON_BUFFER(name)		auto& name = sharedJsonBuffer; name.clear()
+	#else
+		#define JSON_BUFFER(name)		DynamicJsonBuffer name
+	#endif
+#endif
+
+static WU_HeapStats heapStats[WU_HEAP_SUBSYSTEMS];
+static volatile uint8_t heapScope = WU_HEAP_APPLICATION;	//not per task, allocations of other tasks during a scope are attributed to it
+
+#if WU_HEAP_GUARD
+//counts allocations of the loop task while armed. operator new is always seen, malloc/calloc/realloc only when linked with
+//-Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc, otherwise the __real_ symbols stay NULL
+extern "C" void* __real_malloc(size_t size) __attribute__((weak));
+extern "C" void* __real_calloc(size_t count, size_t size) __attribute__((weak));
+extern "C" void* __real_realloc(void* ptr, size_t size) __attribute__((weak));
+
+static volatile bool heapGuardArmed = false;
+static volatile uint32_t heapGuardCount = 0;
+static volatile size_t heapGuardLastSize = 0;
+static uint32_t heapGuardReported = 0;
+static bool heapGuardHookWarned = false;
+#ifdef ESP32
+static TaskHandle_t heapGuardTask = NULL;	//task that armed the guard
+#endif
+
+static inline bool heapGuardMallocHooked()
+{
+	return __real_malloc != NULL;
+}
+
+static void heapGuardCountAllocation(size_t size)
+{
+	if(!heapGuardArmed)
+		return;
+#ifdef ESP32
+	if(xTaskGetCurrentTaskHandle() != heapGuardTask)	//lwIP, WiFi and async TCP tasks allocate by design
+		return;
+#else
+	if(!can_yield())	//system and interrupt context, not the sketch loop
+		return;
+#endif
+	heapGuardCount++;
+	heapGuardLastSize = size;
+}
+
+extern "C" void* __wrap_malloc(size_t size)
+{
+	heapGuardCountAllocation(size);
+	return __real_malloc(size);
+}
+
+extern "C" void* __wrap_calloc(size_t count, size_t size)
+{
+	heapGuardCountAllocation(count * size);
+	return __real_calloc(count, size);
+}
+
+extern "C" void* __wrap_realloc(void* ptr, size_t size)
+{
+	heapGuardCountAllocation(size);
+	return __real_realloc(ptr, size);
+}
+#endif
+
+#if WU_HEAP_GUARD || WU_HEAP_TRACKING
+#include <new>	//nothrow_t, align_val_t
+
+#if WU_HEAP_TRACKING
+//every block carries its size and subsystem, so frees are credited to the subsystem that allocated. Every new/delete overload 
+//is replaced below, a block without header never reaches trackedFree
+typedef struct
+{
+	uint32_t size;
+	uint16_t subsystem;
+	uint16_t offset;	//from the malloc block to the header, only aligned new has padding. Keeps the 8 byte alignment
+} HeapBlockHeader;
+#endif
+
+static void* trackedAlloc(size_t size, size_t alignment = 0)
+{
+#if WU_HEAP_GUARD
+	if(!heapGuardMallocHooked())	//otherwise the malloc below is counted
+		heapGuardCountAllocation(size);
+#endif
+#if WU_HEAP_TRACKING
+	size_t padding = (alignment > sizeof(HeapBlockHeader)) ? alignment : 0;
+	uint8_t* block = (uint8_t*)malloc(size + sizeof(HeapBlockHeader) + padding);
+	if(block == NULL)
+		return NULL;
+	uint8_t* data = block + sizeof(HeapBlockHeader);
+	if(padding > 0)
+		data = (uint8_t*)(((uintptr_t)data + alignment - 1) & ~(uintptr_t)(alignment - 1));
+	HeapBlockHeader* header = (HeapBlockHeader*)data - 1;
+	uint8_t subsystem = heapScope;
+	header->size = size;
+	header->subsystem = subsystem;
+	header->offset = (uint8_t*)header - block;
+	WU_HeapStats &stats = heapStats[subsystem];
+	stats.allocations++;
+	stats.bytes += size;
+	stats.liveBytes += size;
+	if(stats.liveBytes > stats.peakBytes)
+		stats.peakBytes = stats.liveBytes;
+	return data;
+#else
+	if(alignment > 0)
+	{
+		void* data = NULL;
+		return (posix_memalign(&data, alignment, size) == 0) ? data : NULL;
+	}
+	return malloc(size);
+#endif
+}
+
+static void trackedFree(void* ptr)
+{
+#if WU_HEAP_TRACKING
+	if(ptr == NULL)
+		return;
+	HeapBlockHeader* header = (HeapBlockHeader*)ptr - 1;
+	heapStats[header->subsystem].liveBytes -= header->size;
+	free((uint8_t*)header - header->offset);
+#else
+	free(ptr);
+#endif
+}
+
+void* operator new(size_t size) { return trackedAlloc(size); }
+void* operator new[](size_t size) { return trackedAlloc(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return trackedAlloc(size); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return trackedAlloc(size); }
+void operator delete(void* ptr) noexcept { trackedFree(ptr); }
+void operator delete[](void* ptr) noexcept { trackedFree(ptr); }
+void operator delete(void* ptr, size_t) noexcept { trackedFree(ptr); }	//the size is in the header
+void operator delete[](void* ptr, size_t) noexcept { trackedFree(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { trackedFree(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { trackedFree(ptr); }
+#ifdef __cpp_aligned_new
+void* operator new(size_t size, std::align_val_t alignment) { return trackedAlloc(size, (size_t)alignment); }
+void* operator new[](size_t size, std::align_val_t alignment) { return trackedAlloc(size, (size_t)alignment); }
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return trackedAlloc(size, (size_t)alignment); }
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return trackedAlloc(size, (size_t)alignment); }
+void operator delete(void* ptr, std::align_val_t) noexcept { trackedFree(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { trackedFree(ptr); }
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept { trackedFree(ptr); }
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept { trackedFree(ptr); }
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { trackedFree(ptr); }
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { trackedFree(ptr); }
+#endif
+#endif
+
+WU_HeapScope::WU_HeapScope(WU_HeapSubsystem subsystem) : subsystem_(subsystem), previous_(heapScope), freeBefore_(ESP.getFreeHeap())
+{
+	heapScope = subsystem;
+	heapStats[subsystem].scopes++;
+}
+
+WU_HeapScope::~WU_HeapScope()
+{
+	heapStats[subsystem_].heapDelta += (int32_t)(freeBefore_ - ESP.getFreeHeap());
+	heapScope = previous_;
+}
+
 const char* WM_Param::preferedDefault()
 {
 	//if(preferStoredDefault && (strlen(value.get()) > 0))
@@ -14,1010 +234,4579 @@ const char* WM_Param::preferedDefault()
 	}
 }
 
-WifiUtility::WifiUtility() : initializing_(true), filesystem_(NULL), configParameters_(std::vector<WM_Param>()), initialConfig_(false), quiet_(false)
+bool WM_Param::parseValue(const char* text, WM_ParamValue &result) const
 {
-	if(!Serial)
-		Serial.begin(115200);
-	Serial.setDebugOutput(false);
-	
-	initAPIPConfigStruct(WM_AP_IPconfig_);
-	initSTAIPConfigStruct(WM_STA_IPconfig_);
+	if(text == NULL || (int)strlen(text) > length)
+		return false;
 	
-	defaultConfig();
+	char* end = NULL;
+	switch(type)
+	{
+		case WM_PARAM_INT:
+			result.i = strtol(text, &end, 10);
+			return (end != text) && (*end == 0) && (result.i >= minValue) && (result.i <= maxValue);
+		case WM_PARAM_FLOAT:
+			result.f = strtod(text, &end);
+			return (end != text) && (*end == 0) && !isnan(result.f) && (result.f >= minValue) && (result.f <= maxValue);
+		case WM_PARAM_BOOL:
+			if(strcasecmp(text, "1") == 0 || strcasecmp(text, "true") == 0 || strcasecmp(text, "on") == 0)
+				result.b = true;
+			else if(strcasecmp(text, "0") == 0 || strcasecmp(text, "false") == 0 || strcasecmp(text, "off") == 0)
+				result.b = false;
+			else
+				return false;
+			return true;
+		case WM_PARAM_IP:
+		{
+			IPAddress ip;
+			if(!ip.fromString(text))
+				return false;
+			result.ip = (uint32_t)ip;
+			return true;
+		}
+		default:
+			result.i = 0;
+			return true;
+	}
 }
 
-void WifiUtility::defaultConfig()
+bool WM_Param::setValue(const char* text)
 {
-	configStationIP();
-	configAP();
-	configService();
+	WM_ParamValue result;
+	if(!parseValue(text, result))
+		return false;
+	value = text;
+	parsed = result;
+	return true;
 }
 
-void WifiUtility::configStationIP(bool useDHCP)
+double WM_Param::numericValue() const
 {
-	if(useDHCP_ != useDHCP)	
+	switch(type)
 	{
-		useDHCP_ = useDHCP;
-		if(!initializing_)		//do not start wifi before everything is intiialized
-			begin();
+		case WM_PARAM_INT:		return parsed.i;
+		case WM_PARAM_FLOAT:	return parsed.f;
+		case WM_PARAM_BOOL:		return parsed.b ? 1 : 0;
+		default:				return 0;
 	}
 }
 
-void WifiUtility::configAP(char* hostname, int APTimeoutS, bool useCustomAPIP, IPAddress *APStaticIP, IPAddress *APStaticGateway, IPAddress *APStaticSubnet, String apSSID)
+TimerWheel::TimerWheel() : currentTick_(0), lastMs_(0), started_(false)
 {
-	hostname_ = hostname;
-	APTimeoutS_ = APTimeoutS;
-	useCustomAPIP_ = useCustomAPIP;
-	(APStaticIP != NULL) 					? APStaticIP_ = *APStaticIP				: APStaticIP_ = IPAddress(192, 168, 100, 1);
-	(APStaticGateway != NULL) 				? APStaticGW_ = *APStaticGateway		: APStaticGW_ = IPAddress(192, 168, 100, 1);
-	(APStaticSubnet != NULL) 				? APStaticSN_ = *APStaticSubnet			: APStaticSN_ = IPAddress(255, 255, 255, 0);
-	(apSSID != "")							? configSSID_ = apSSID					: configSSID_ = "ESP_" + String(ESP_getChipId(), HEX);
-	
-	initAPIPConfigStruct(WM_AP_IPconfig_);
+	for(int i=0; i<TIMER_WHEEL_MAX_JOBS; i++)
+	{
+		jobs_[i].active = false;
+		jobs_[i].generation = 0;
+	}
+	for(int i=0; i<TIMER_WHEEL_SLOTS; i++)
+		slots_[i] = -1;
 }
 
-void WifiUtility::configService(int configPin, int debuglevel, ulong connectionCheckIntervalMs, bool autoReconnect, bool actionReconnect)
+int TimerWheel::schedule(ulong delayMs, TimerCallback callback, void* arg, ulong periodMs)
 {
-	if(configPin == -1)
+	if(callback == NULL)
+		return -1;
+	for(int i=0; i<TIMER_WHEEL_MAX_JOBS; i++)
 	{
-#ifdef ESP32
-	#if ( USING_ESP32_S2 || USING_ESP32_C3 )
-		triggerPin_ = 3; //GPIO 3
-	#else
-		triggerPin_ = 0; //GPIO 0, Boot switch
-	#endif
-#else
-		triggerPin_ = PIN_D3; // D3 on NodeMCU and WeMos.
-#endif
+		if(jobs_[i].active)
+			continue;
+		jobs_[i].callback = callback;
+		jobs_[i].arg = arg;
+		jobs_[i].periodTicks = (periodMs > 0) ? max(msToTicks(periodMs), 1UL) : 0;
+		jobs_[i].expireTick = currentTick_ + max(msToTicks(delayMs), 1UL);	//earliest execution is the next tick
+		jobs_[i].active = true;
+		jobs_[i].generation = (jobs_[i].generation + 1) & 0x7FFF;	//handle stays positive
+		link(i);
+		return (jobs_[i].generation << 8) | i;
 	}
-	else
-		triggerPin_ = configPin;
-	
-	debuglevel_ = debuglevel;
-	connectionCheckIntervalMs_ = connectionCheckIntervalMs;
-	autoReconnect_ = autoReconnect;
-	actionReconnect_ = actionReconnect;
+	return -1;	//pool exhausted
 }
 
-bool WifiUtility::addParameter(const char* id, const char* label, int length, const char* defaultValue, bool preferStoredDefault, const char* customHTML, int labelPlacement)
+bool TimerWheel::reschedule(int handle, ulong delayMs)
 {
-	//empty IDs not allowed
-	if(id == "")
-		return false;
-	//find duplicates
-	if(findParameterIndex(id) >= 0)
+	int index = jobIndex(handle);
+	if(index < 0)
 		return false;
-	
-	//checks OK, fill data in
-	configParameters_.push_back(WM_Param(id, label, length, defaultValue, preferStoredDefault, customHTML, labelPlacement));
+	unlink(index);
+	jobs_[index].expireTick = currentTick_ + max(msToTicks(delayMs), 1UL);
+	link(index);
 	return true;
 }
 
-bool WifiUtility::removeParameter(const char* id)
+bool TimerWheel::cancel(int handle)
 {
-	int index = findParameterIndex(id);
+	int index = jobIndex(handle);
 	if(index < 0)
 		return false;
-	configParameters_.erase(configParameters_.begin()+index);	//duplicates should not exist anyway
+	unlink(index);
+	jobs_[index].active = false;
 	return true;
 }
 
-String WifiUtility::getParameter(const char* id)
+bool TimerWheel::isScheduled(int handle)
 {
-	int index = findParameterIndex(id);
-	if(index < 0)	//nothing found, return empty String
+	return jobIndex(handle) >= 0;
+}
+
+int TimerWheel::jobIndex(int handle)
+{
+	if(handle < 0)
+		return -1;
+	int index = handle & 0xFF;
+	if(index >= TIMER_WHEEL_MAX_JOBS || !jobs_[index].active || jobs_[index].generation != (handle >> 8))
+		return -1;
+	return index;
+}
+
+void TimerWheel::run(ulong nowMs)
+{
+	if(!started_)
 	{
-		return String("");
+		lastMs_ = nowMs;
+		started_ = true;
+		return;
 	}
 	
-	return configParameters_[index].value;
+	//unsigned difference is overflow safe
+	ulong elapsedTicks = (nowMs - lastMs_) / TIMER_WHEEL_TICK_MS;
+	if(elapsedTicks == 0)
+		return;
+	lastMs_ += elapsedTicks * TIMER_WHEEL_TICK_MS;
+	
+	ulong targetTick = currentTick_ + elapsedTicks;
+	//after a long blocking call one round over all buckets is enough, overdue jobs are still in their bucket
+	if(elapsedTicks > TIMER_WHEEL_SLOTS)
+		currentTick_ = targetTick - TIMER_WHEEL_SLOTS;
+	
+	while(currentTick_ != targetTick)
+	{
+		currentTick_++;
+		//callbacks may add/remove jobs, so restart the bucket after each executed job
+		while(runSlot(currentTick_)) {}
+	}
 }
 
-bool WifiUtility::getParameter(const char* id, char* buffer, int bufferLength)
+void TimerWheel::link(int handle)
 {
-	int index = findParameterIndex(id);
-	if(index < 0)	//nothing found, don't do anything
-		return false;
-	
-	if(configParameters_[index].value.length() < bufferLength)	//strlen gives length without \0
+	int8_t &head = slots_[jobs_[handle].expireTick & (TIMER_WHEEL_SLOTS-1)];
+	jobs_[handle].prev = -1;
+	jobs_[handle].next = head;
+	if(head >= 0)
+		jobs_[head].prev = handle;
+	head = handle;
+}
+
+void TimerWheel::unlink(int handle)
+{
+	Job &job = jobs_[handle];
+	if(job.prev >= 0)
+		jobs_[job.prev].next = job.next;
+	else
+		slots_[job.expireTick & (TIMER_WHEEL_SLOTS-1)] = job.next;
+	if(job.next >= 0)
+		jobs_[job.next].prev = job.prev;
+}
+
+bool TimerWheel::runSlot(ulong tick)
+{
+	for(int8_t i = slots_[tick & (TIMER_WHEEL_SLOTS-1)]; i >= 0; i = jobs_[i].next)
 	{
-		strcpy(buffer, configParameters_[index].value.c_str());	//won't put \0 padding at the end of the buffer
+		if((long)(jobs_[i].expireTick - tick) > 0)	//due in a later round of the wheel
+			continue;
+		
+		unlink(i);
+		if(jobs_[i].periodTicks > 0)
+		{
+			jobs_[i].expireTick += jobs_[i].periodTicks;
+			if((long)(jobs_[i].expireTick - tick) <= 0)	//missed periods are skipped, not caught up
+				jobs_[i].expireTick = tick + jobs_[i].periodTicks;
+			link(i);
+		}
+		else
+		{
+			jobs_[i].active = false;
+		}
+		jobs_[i].callback(jobs_[i].arg);
 		return true;
 	}
-	else
-	{
-		strncpy(buffer, configParameters_[index].value.c_str(), bufferLength-1);
-		buffer[bufferLength-1] = 0;	//force null termination
+	return false;
+}
+
+
+EventBus::EventBus()
+{
+	for(int i=0; i<MAX_EVENT_HANDLERS; i++)
+		handlers_[i].callback = NULL;
+}
+
+bool EventBus::subscribe(EventCallback callback, void* arg, uint32_t mask)
+{
+	if(callback == NULL)
 		return false;
+	for(int i=0; i<MAX_EVENT_HANDLERS; i++)
+	{
+		if(handlers_[i].callback == NULL)
+		{
+			handlers_[i].callback = callback;
+			handlers_[i].arg = arg;
+			handlers_[i].mask = mask;
+			return true;
+		}
 	}
+	return false;
 }
 
-int WifiUtility::getParameterBufferLength(const char* id)
+bool EventBus::unsubscribe(EventCallback callback, void* arg)
 {
-	int index = findParameterIndex(id);
-	if(index < 0)	//nothing found
-		return 0;
-	
-	return (configParameters_[index].value.length() + 1);	//+1 for termination to give buffer size
+	for(int i=0; i<MAX_EVENT_HANDLERS; i++)
+	{
+		if(handlers_[i].callback == callback && handlers_[i].arg == arg)
+		{
+			handlers_[i].callback = NULL;
+			return true;
+		}
+	}
+	return false;
 }
 
-void WifiUtility::begin()
+void EventBus::emit(const WifiUtilityEvent &event)
 {
-	D1PRINT(F("\nWIFI utility using ")); 
-	D1PRINT(FS_Name);
-	D1PRINT(F(" on ")); 
-	D1PRINT(ARDUINO_BOARD);
-	D1PRINTLN(ESP_ASYNC_WIFIMANAGER_VERSION);
-	
-	////set filesystem, put here so Serial communication can already be established
-	if(filesystem_ == NULL)
+	for(int i=0; i<MAX_EVENT_HANDLERS; i++)
 	{
-#if USE_LITTLEFS
-		filesystem_ = &LITTLEFS;
-#elif USE_SPIFFS
-		filesystem_ = &SPIFFS;
-#else
-		filesystem_ = &FFat;
+		if(handlers_[i].callback != NULL && (handlers_[i].mask & WU_EVENT_MASK(event.type)))
+			handlers_[i].callback(event, handlers_[i].arg);
+	}
+}
+
+
+
+
+WifiUtility::WifiUtility() : initializing_(true), initialConfig_(false), attachedTriggerPin_(-1), triggerPressed_(false), triggerEdgeMs_(0), triggerPressStartMs_(0), filesystem_(NULL), 
+								networkCount_(0), failedNetworks_(0), savedHistoryState_(0), historySavedMs_(0), 
+								scanCacheCount_(0), scanRunning_(false), smoothedRssi_(0), associatedSinceMs_(0), powerPolicy_(WU_POWER_DEFAULT), powerSaveActive_(false), 
+								radioHeld_(false), radioHoldTimer_(-1), wakePeriodMs_(POWER_BEACON_INTERVAL_MS), powerAccountMs_(0), configParameters_(std::vector<WM_Param>()), usingCachedLease_(false), wifiUp_(false), 
+								lastIP_(0u), profileBudgetUs_(0), budgetExceeded_(0), lastProfileReportMs_(0), connectionCheckTimer_(-1), connectionCheckDue_(false), reconnectBackoffMs_(0), 
+								quiet_(false)
+{
+	memset(&powerStats_, 0, sizeof(powerStats_));
+	memset(&dhcpLease_, 0, sizeof(dhcpLease_));
+	memset(&roamStats_, 0, sizeof(roamStats_));
+	memset(&heapSnapshot_, 0, sizeof(heapSnapshot_));
+	resetProfile();
+#if WU_STATIC_MEMORY
+	configParameters_.reserve(WU_MAX_PARAMETERS);	//no reallocation once begin() is done
 #endif
+	if(!Serial)
+		Serial.begin(115200);
+	Serial.setDebugOutput(false);
 	
-		// Format FileFS if not yet
-#ifdef ESP32
-		if (!FileFS.begin(true))
+	initAPIPConfigStruct(WM_AP_IPconfig_);
+	initSTAIPConfigStruct(WM_STA_IPconfig_);
+	
+	defaultConfig();
+	
+	timers_.schedule(SCAN_INTERVAL_MS, backgroundScanJob, this, SCAN_INTERVAL_MS);
+	timers_.schedule(ROAM_CHECK_INTERVAL_MS, roamCheckJob, this, ROAM_CHECK_INTERVAL_MS);
+	timers_.schedule(HEAP_SNAPSHOT_INTERVAL_MS, heapSnapshotJob, this, HEAP_SNAPSHOT_INTERVAL_MS);
+}
+
+uint32_t WifiUtility::heapGuardViolations()
+{
+#if WU_HEAP_GUARD
+	return heapGuardCount;
 #else
-		if (!FileFS.begin())
+	return 0;
 #endif
-		{
-#ifdef ESP8266
-			FileFS.format();
+}
+
+void WifiUtility::armHeapGuard(bool armed)
+{
+#if WU_HEAP_GUARD
+#ifdef ESP32
+	heapGuardTask = xTaskGetCurrentTaskHandle();
+#endif
+	heapGuardArmed = armed;
 #endif
+}
 
-			D1PRINTLN(F("SPIFFS/LittleFS failed! Already tried formatting."));
+void WifiUtility::checkHeapGuard()
+{
+#if WU_HEAP_GUARD
+	if(!heapGuardMallocHooked() && !heapGuardHookWarned)
+	{
+		D1PRINTLN(F("Heap guard: malloc is not wrapped, only operator new is checked"));
+		heapGuardHookWarned = true;
+	}
+	uint32_t count = heapGuardCount;
+	if(count != heapGuardReported)
+	{
+		D1PRINT(F("Heap guard: ")); D1PRINT(count - heapGuardReported); D1PRINT(F(" allocation(s) after begin(), last ")); D1PRINT((uint32_t)heapGuardLastSize); D1PRINTLN(F(" bytes"));
+		heapGuardReported = count;
+	}
+#endif
+}
+
+const WU_HeapStats& WifiUtility::getHeapStats(WU_HeapSubsystem subsystem)
+{
+	return heapStats[subsystem < WU_HEAP_SUBSYSTEMS ? subsystem : WU_HEAP_APPLICATION];
+}
+
+void WifiUtility::heapSnapshotJob(void* arg)
+{
+	static_cast<WifiUtility*>(arg)->takeHeapSnapshot();
+}
+
+void WifiUtility::takeHeapSnapshot()
+{
+	WU_HeapSnapshot &snap = heapSnapshot_;
+	snap.freeHeap = ESP.getFreeHeap();
+	#ifdef ESP8266
+	snap.largestBlock = ESP.getMaxFreeBlockSize();
+	#else
+	snap.largestBlock = ESP.getMaxAllocHeap();
+	#endif
+	snap.fragmentation = (snap.freeHeap == 0) ? 0 : 100 - (uint8_t)((uint64_t)snap.largestBlock*100/snap.freeHeap);
+	
+	bool first = (snap.takenMs == 0);
+	if(first || snap.freeHeap < snap.minFreeHeap)
+		snap.minFreeHeap = snap.freeHeap;
+	#ifdef ESP32
+	snap.minFreeHeap = min(snap.minFreeHeap, (uint32_t)ESP.getMinFreeHeap());	//low water mark between snapshots
+	#endif
+	if(first || snap.largestBlock < snap.minLargestBlock)
+		snap.minLargestBlock = snap.largestBlock;
+	if(snap.fragmentation > snap.maxFragmentation)
+		snap.maxFragmentation = snap.fragmentation;
+	snap.takenMs = millis() | 1;	//0 marks "no snapshot yet"
+	D3PRINT(F("Heap free ")); D3PRINT(snap.freeHeap); D3PRINT(F(", largest block ")); D3PRINT(snap.largestBlock); D3PRINT(F(", fragmentation ")); D3PRINT(snap.fragmentation); D3PRINTLN(F("%"));
+}
+
+int WifiUtility::heapReport(char* buffer, int bufferLength)
+{
+	static const char* const names[WU_HEAP_SUBSYSTEMS] = {"app", "portal", "config", "mqtt", "subscriptions", "logging"};
+	const WU_HeapSnapshot &snap = heapSnapshot_;
+	int length = snprintf(buffer, bufferLength, "{\"free\":%u,\"largest\":%u,\"frag\":%u,\"minFree\":%u,\"minLargest\":%u,\"maxFrag\":%u",
+		(unsigned)snap.freeHeap, (unsigned)snap.largestBlock, (unsigned)snap.fragmentation, (unsigned)snap.minFreeHeap, (unsigned)snap.minLargestBlock, (unsigned)snap.maxFragmentation);
+	//per subsystem [allocations, bytes, live, peak, scopes, heap delta]
+	for(int i=0; i<WU_HEAP_SUBSYSTEMS && length >= 0 && length < bufferLength; i++)
+	{
+		const WU_HeapStats &stats = heapStats[i];
+		length += snprintf(buffer + length, bufferLength - length, ",\"%s\":[%u,%u,%d,%d,%u,%d]", names[i],
+			(unsigned)stats.allocations, (unsigned)stats.bytes, (int)stats.liveBytes, (int)stats.peakBytes, (unsigned)stats.scopes, (int)stats.heapDelta);
+	}
+	if(length >= 0 && length < bufferLength)
+		length += snprintf(buffer + length, bufferLength - length, "}");
+	if(length < 0 || length >= bufferLength)
+		return -1;
+	return length;
+}
+
+WU_ProfileScope::~WU_ProfileScope()
+{
+	ulong elapsedMs = millis() - startMs_;
+	uint32_t us = (elapsedMs < PROFILE_CYCLE_WRAP_MS) ? (ESP.getCycleCount() - startCycles_) / ESP.getCpuFreqMHz() : elapsedMs*1000UL;
+	owner_->recordPhase(phase_, us);
+}
+
+void WifiUtility::configProfiling(ulong budgetUs)
+{
+	profileBudgetUs_ = budgetUs;
+#if !WU_PROFILING
+	if(budgetUs > 0)
+		D1PRINTLN(F("Profiling budget set, but WU_PROFILING is not enabled"));
+#endif
+}
+
+const WU_PhaseStats& WifiUtility::getPhaseStats(WU_ProfilePhase phase)
+{
+#if WU_PROFILING
+	return phaseStats_[phase < WU_PHASE_COUNT ? phase : WU_PHASE_LOOP];
+#else
+	static const WU_PhaseStats empty = {};
+	return empty;
+#endif
+}
+
+void WifiUtility::resetProfile()
+{
+#if WU_PROFILING
+	memset(phaseStats_, 0, sizeof(phaseStats_));
+	for(int i=0; i<WU_PHASE_COUNT; i++)
+		phaseStats_[i].minUs = UINT32_MAX;
+#endif
+	budgetExceeded_ = 0;
+}
+
+void WifiUtility::recordPhase(uint8_t phase, uint32_t us)
+{
+#if WU_PROFILING
+	WU_PhaseStats &stats = phaseStats_[phase];
+	stats.count++;
+	stats.totalUs += us;
+	if(us < stats.minUs)
+		stats.minUs = us;
+	if(us > stats.maxUs)
+		stats.maxUs = us;
+	int bucket = 0;
+	for(uint32_t limit = 10; us >= limit && bucket < PROFILE_HISTOGRAM_BUCKETS - 1; limit *= 10)
+		bucket++;
+	stats.histogram[bucket]++;
+	
+	if(profileBudgetUs_ == 0 || us <= profileBudgetUs_)
+		return;
+	budgetExceeded_++;
+	if(lastProfileReportMs_ != 0 && millis() - lastProfileReportMs_ < PROFILE_REPORT_INTERVAL_MS)
+		return;
+	lastProfileReportMs_ = millis() | 1;
+	D1PRINT(F("Latency budget exceeded in phase ")); D1PRINT(phase); D1PRINT(F(": ")); D1PRINT(us); D1PRINTLN(F("us"));
+	printProfile();
+#endif
+}
+
+void WifiUtility::printProfile()
+{
+#if WU_PROFILING
+	static const char* const names[WU_PHASE_COUNT] = {"loop", "timers", "trigger", "outbound", "timeout check", "wifi check", "mqtt loop", "reconnect", "begin", "connectMqtt", "publish"};
+	D1PRINTLN(F("phase: count min/mean/max us | <10us <100us <1ms <10ms <100ms <1s <10s >=10s"));
+	for(int i=0; i<WU_PHASE_COUNT; i++)
+	{
+		const WU_PhaseStats &stats = phaseStats_[i];
+		if(stats.count == 0)
+			continue;
+		D1PRINT(i); D1PRINT(F(" ")); D1PRINT(names[i]); D1PRINT(F(": ")); D1PRINT(stats.count); D1PRINT(F(" "));
+		D1PRINT(stats.minUs); D1PRINT(F("/")); D1PRINT((uint32_t)(stats.totalUs / stats.count)); D1PRINT(F("/")); D1PRINT(stats.maxUs); D1PRINT(F(" |"));
+		for(int b=0; b<PROFILE_HISTOGRAM_BUCKETS; b++)
+		{
+			D1PRINT(F(" ")); D1PRINT(stats.histogram[b]);
+		}
+		D1PRINTLN("");
+	}
+	D1PRINT(F("Budget exceeded ")); D1PRINT(budgetExceeded_); D1PRINTLN(F(" times"));
+#endif
+}
+
+void WifiUtility::defaultConfig()
+{
+	configStationIP();
+	configAP();
+	configService();
+	configTrigger();
+	configRoaming();
+}
+
+void WifiUtility::configStationIP(bool useDHCP)
+{
+	if(useDHCP_ != useDHCP)	
+	{
+		useDHCP_ = useDHCP;
+		if(!initializing_)		//do not start wifi before everything is intiialized
+			begin();
+	}
+}
+
+void WifiUtility::configAP(char* hostname, int APTimeoutS, bool useCustomAPIP, IPAddress *APStaticIP, IPAddress *APStaticGateway, IPAddress *APStaticSubnet, String apSSID)
+{
+	hostname_ = hostname;
+	APTimeoutS_ = APTimeoutS;
+	useCustomAPIP_ = useCustomAPIP;
+	(APStaticIP != NULL) 					? APStaticIP_ = *APStaticIP				: APStaticIP_ = IPAddress(192, 168, 100, 1);
+	(APStaticGateway != NULL) 				? APStaticGW_ = *APStaticGateway		: APStaticGW_ = IPAddress(192, 168, 100, 1);
+	(APStaticSubnet != NULL) 				? APStaticSN_ = *APStaticSubnet			: APStaticSN_ = IPAddress(255, 255, 255, 0);
+	(apSSID != "")							? configSSID_ = apSSID					: configSSID_ = "ESP_" + String(ESP_getChipId(), HEX);
+	
+	initAPIPConfigStruct(WM_AP_IPconfig_);
+}
+
+void WifiUtility::configService(int configPin, int debuglevel, ulong connectionCheckIntervalMs, bool autoReconnect, bool actionReconnect, WU_PowerPolicy powerPolicy)
+{
+	if(configPin == -1)
+	{
+#ifdef ESP32
+	#if ( USING_ESP32_S2 || USING_ESP32_C3 )
+		triggerPin_ = 3; //GPIO 3
+	#else
+		triggerPin_ = 0; //GPIO 0, Boot switch
+	#endif
+#else
+		triggerPin_ = PIN_D3; // D3 on NodeMCU and WeMos.
+#endif
+	}
+	else
+		triggerPin_ = configPin;
+	
+	debuglevel_ = debuglevel;
+	connectionCheckIntervalMs_ = connectionCheckIntervalMs;
+	timers_.cancel(connectionCheckTimer_);
+	connectionCheckTimer_ = timers_.schedule(connectionCheckIntervalMs_, connectionCheckJob, this, connectionCheckIntervalMs_);
+	reconnectBackoffMs_ = 0;
+	autoReconnect_ = autoReconnect;
+	actionReconnect_ = actionReconnect;
+	powerPolicy_ = powerPolicy;
+	
+	if(!initializing_)		//pin may have changed
+		attachTriggerPin();
+	if(wifiUp_)
+		applyPowerPolicy();
+}
+
+void WifiUtility::configRoaming(bool enabled, int marginDb, int triggerRssi, ulong minDwellMs)
+{
+	roamEnabled_ = enabled;
+	roamMarginDb_ = marginDb;
+	roamTriggerRssi_ = triggerRssi;
+	roamMinDwellMs_ = minDwellMs;
+}
+
+void WifiUtility::configTrigger(ulong debounceMs, ulong longPressMs)
+{
+	triggerDebounceMs_ = debounceMs;
+	triggerLongPressMs_ = longPressMs;
+}
+
+int WifiUtility::addTimer(ulong intervalMs, TimerCallback callback, void* arg, bool periodic)
+{
+	return timers_.schedule(intervalMs, callback, arg, periodic ? intervalMs : 0);
+}
+
+bool WifiUtility::removeTimer(int handle)
+{
+	if(handle == connectionCheckTimer_)	//library internal timer
+		return false;
+	return timers_.cancel(handle);
+}
+
+bool WifiUtility::onEvent(EventCallback callback, void* arg, uint32_t mask)
+{
+	return events_.subscribe(callback, arg, mask);
+}
+
+bool WifiUtility::removeEventHandler(EventCallback callback, void* arg)
+{
+	return events_.unsubscribe(callback, arg);
+}
+
+bool WifiUtility::addParameter(const char* id, const char* label, int length, const char* defaultValue, bool preferStoredDefault, const char* customHTML, int labelPlacement)
+{
+	//empty IDs not allowed
+	if(id == "")
+		return false;
+	//find duplicates
+	if(findParameterIndex(id) >= 0)
+		return false;
+	
+#if WU_STATIC_MEMORY
+	if(configParameters_.size() >= WU_MAX_PARAMETERS || length > WU_PARAM_VALUE_MAX)
+	{
+		D1PRINT(F("Parameter '")); D1PRINT(id); D1PRINTLN(F("' exceeds the static memory limits"));
+		return false;
+	}
+#endif
+	//checks OK, fill data in
+	configParameters_.push_back(WM_Param(id, label, length, defaultValue, preferStoredDefault, customHTML, labelPlacement));
+	return true;
+}
+
+int WifiUtility::addParameter(const WM_ParamSpec &spec)
+{
+	if(strcmp(spec.id, "") == 0 || findParameterIndex(spec.id) >= 0)
+		return -1;
+	
+#if WU_STATIC_MEMORY
+	if(configParameters_.size() >= WU_MAX_PARAMETERS || spec.length > WU_PARAM_VALUE_MAX)
+	{
+		D1PRINT(F("Parameter '")); D1PRINT(spec.id); D1PRINTLN(F("' exceeds the static memory limits"));
+		return -1;
+	}
+#endif
+	WM_Param param(spec);
+	if(param.value.length() == 0 && spec.type != WM_PARAM_STRING)	//default does not pass its own validation
+	{
+		D1PRINT(F("Invalid default for parameter '")); D1PRINT(spec.id); D1PRINTLN(F("'"));
+		return -1;
+	}
+	configParameters_.push_back(param);
+	return configParameters_.size() - 1;
+}
+
+bool WifiUtility::removeParameter(const char* id)
+{
+	int index = findParameterIndex(id);
+	if(index < 0)
+		return false;
+	configParameters_.erase(configParameters_.begin()+index);	//duplicates should not exist anyway
+	return true;
+}
+
+#if !WU_STATIC_MEMORY
+String WifiUtility::getParameter(const char* id)
+{
+	int index = findParameterIndex(id);
+	if(index < 0)	//nothing found, return empty String
+	{
+		return String("");
+	}
+	
+	return String(configParameters_[index].value.c_str());
+}
+#endif
+
+bool WifiUtility::getParameter(const char* id, char* buffer, int bufferLength)
+{
+	int index = findParameterIndex(id);
+	if(index < 0)	//nothing found, don't do anything
+		return false;
+	
+	if(configParameters_[index].value.length() < bufferLength)	//strlen gives length without \0
+	{
+		strcpy(buffer, configParameters_[index].value.c_str());	//won't put \0 padding at the end of the buffer
+		return true;
+	}
+	else
+	{
+		strncpy(buffer, configParameters_[index].value.c_str(), bufferLength-1);
+		buffer[bufferLength-1] = 0;	//force null termination
+		return false;
+	}
+}
+
+//typed accessors only accept these parameter types
+#define WM_NUMERIC_TYPES	((1 << WM_PARAM_INT) | (1 << WM_PARAM_FLOAT) | (1 << WM_PARAM_BOOL))
+#define WM_ANY_TYPE			0xFF
+
+const WM_Param* WifiUtility::typedParameter(int handle, uint8_t typeMask)
+{
+	if(handle < 0 || handle >= (int)configParameters_.size())
+	{
+		D1PRINT(F("Invalid parameter handle ")); D1PRINTLN(handle);
+		return NULL;
+	}
+	const WM_Param &param = configParameters_[handle];
+	if((typeMask & (1 << param.type)) == 0)
+	{
+		D1PRINT(F("Type mismatch reading parameter '")); D1PRINT(param.id); D1PRINTLN(F("'"));
+		return NULL;
+	}
+	return &param;
+}
+
+template<> long WifiUtility::get<long>(int handle)
+{
+	const WM_Param* param = typedParameter(handle, WM_NUMERIC_TYPES);
+	return (param == NULL) ? 0 : (long)param->numericValue();
+}
+
+template<> int WifiUtility::get<int>(int handle)
+{
+	return (int)get<long>(handle);
+}
+
+template<> float WifiUtility::get<float>(int handle)
+{
+	const WM_Param* param = typedParameter(handle, WM_NUMERIC_TYPES);
+	return (param == NULL) ? 0 : (float)param->numericValue();
+}
+
+template<> bool WifiUtility::get<bool>(int handle)
+{
+	const WM_Param* param = typedParameter(handle, WM_NUMERIC_TYPES);
+	return (param != NULL) && (param->numericValue() != 0);
+}
+
+template<> IPAddress WifiUtility::get<IPAddress>(int handle)
+{
+	const WM_Param* param = typedParameter(handle, 1 << WM_PARAM_IP);
+	return (param == NULL) ? IPAddress(0u) : IPAddress(param->parsed.ip);
+}
+
+template<> const char* WifiUtility::get<const char*>(int handle)
+{
+	const WM_Param* param = typedParameter(handle, WM_ANY_TYPE);
+	return (param == NULL) ? "" : param->value.c_str();
+}
+
+int WifiUtility::getParameterBufferLength(const char* id)
+{
+	int index = findParameterIndex(id);
+	if(index < 0)	//nothing found
+		return 0;
+	
+	return (configParameters_[index].value.length() + 1);	//+1 for termination to give buffer size
+}
+
+#if WU_STATIC_MEMORY
+int WifiUtility::updateParameters(const char* json, char* error, size_t errorSize)
+{
+	uint8_t subsystems = 0;
+	int changed = applyParameters(json, error, errorSize, subsystems);
+	reloadSubsystems(subsystems);
+	return changed;
+}
+#else
+int WifiUtility::updateParameters(const char* json, String* error)
+{
+	uint8_t subsystems = 0;
+	char errorText[64];
+	int changed = applyParameters(json, errorText, sizeof(errorText), subsystems);
+	if(changed < 0 && error != NULL)
+		*error = errorText;
+	reloadSubsystems(subsystems);
+	return changed;
+}
+#endif
+
+//JSON numbers and bools are accepted for typed parameters and converted to their text form
+static const char* jsonParameterText(JsonVariant value, WM_ParamType type, char* buffer, size_t size)
+{
+	if(value.is<const char*>())
+		return value.as<const char*>();
+	if(type == WM_PARAM_STRING)
+		return NULL;
+	if(value.is<bool>())
+		return value.as<bool>() ? "1" : "0";
+	if(value.is<long>())
+		snprintf(buffer, size, "%ld", value.as<long>());
+	else if(value.is<double>())
+		snprintf(buffer, size, "%.7g", value.as<double>());
+	else
+		return NULL;
+	return buffer;
+}
+
+int WifiUtility::applyParameters(const char* json, char* error, size_t errorSize, uint8_t &subsystems)
+{
+	subsystems = 0;
+#if (ARDUINOJSON_VERSION_MAJOR >= 6)
+	JSON_DOCUMENT(doc);
+	if(deserializeJson(doc, json))
+	{
+		if(error != NULL && errorSize > 0)
+			snprintf(error, errorSize, "invalid JSON");
+		return -1;
+	}
+	JsonObject update = doc.as<JsonObject>();
+#else
+	JSON_BUFFER(jsonBuffer);
+	JsonObject& update = jsonBuffer.parseObject(json);
+	if(!update.success())
+	{
+		if(error != NULL && errorSize > 0)
+			snprintf(error, errorSize, "invalid JSON");
+		return -1;
+	}
+#endif
+	
+	//validate everything first, an update is applied completely or not at all
+	char text[24];
+	for(JSON_PAIR kv : update)
+	{
+		int index = findParameterIndex(JSON_KEY(kv));
+		const char* value = (index < 0) ? NULL : jsonParameterText(JSON_VALUE(kv), configParameters_[index].type, text, sizeof(text));
+		WM_ParamValue parsed;
+		if(value == NULL || !configParameters_[index].parseValue(value, parsed))
+		{
+			D1PRINT(F("Rejected parameter update for '")); D1PRINT(JSON_KEY(kv)); D1PRINTLN(F("'"));
+			if(error != NULL && errorSize > 0)
+				snprintf(error, errorSize, "invalid parameter %s", JSON_KEY(kv));
+			return -1;
+		}
+	}
+	
+	int changed = 0;
+	for(JSON_PAIR kv : update)	//the document is not used after this loop, saveConfigFile() reuses it in static memory mode
+	{
+		WM_Param &param = configParameters_[findParameterIndex(JSON_KEY(kv))];
+		const char* value = jsonParameterText(JSON_VALUE(kv), param.type, text, sizeof(text));
+		if(param.value == value)
+			continue;
+		param.setValue(value);
+		subsystems |= parameterSubsystem(param.id);
+		changed++;
+		D2PRINT(F("Parameter '")); D2PRINT(param.id); D2PRINT(F("' updated to '")); D2PRINT(param.value); D2PRINTLN(F("'"));
+	}
+	
+	if(changed > 0)
+		saveConfigFile();
+	return changed;
+}
+
+void WifiUtility::begin()
+{
+	memset(&bootStats_, 0, sizeof(bootStats_));
+	ulong phaseStart = millis();
+	D1PRINT(F("\nWIFI utility using ")); 
+	D1PRINT(FS_Name);
+	D1PRINT(F(" on ")); 
+	D1PRINT(ARDUINO_BOARD);
+	D1PRINTLN(ESP_ASYNC_WIFIMANAGER_VERSION);
+	
+	mountFilesystem();	//put here so Serial communication can already be established
+	
+	bootStats_.fsMountMs = millis() - phaseStart;
+	
+	initializing_ = false;	//any changes to the configuration now may necessitate restarting
+	attachTriggerPin();
+	
+	//WMConfig_ and the credential store are reset when wifi data is loaded
+	routerSSID_ = "";
+	routerPass_ = "";
+	
+	D1PRINT(F("Starting WiFi with "));
+	
+	if(useDHCP_)
+	{
+		D1PRINT(F("DHCP "));
+	}
+	else
+	{
+		D1PRINT(F("fixed IP "));
+	}
+	
+	////Credentials first, the association runs while the rest of the configuration is read
+	phaseStart = millis();
+	bool configDataLoaded = loadWifiConfigData();
+	loadDhcpLease();
+	bootStats_.credentialsMs = millis() - phaseStart;
+	
+	//a connection that survived the restart (SDK auto connect) is kept if it is to a stored network
+	if ( (WiFi.status() == WL_CONNECTED) )
+	{
+		bootStats_.keptConnection = configDataLoaded && storedNetwork(WiFi.SSID().c_str()) >= 0;
+		if(!bootStats_.keptConnection)
+		{
+			D1PRINTLN(F("Restarting, disconnecting WiFi"));
+			WiFi.disconnect();
+		}
+	}
+	
+	ulong associationStart = millis();
+	int candidate = (configDataLoaded && !bootStats_.keptConnection) ? bootCandidate() : -1;
+	bool fromLease = false;
+	if(candidate >= 0)
+	{
+		D1PRINT(F("Fast boot with ")); D1PRINTLN(networks_[candidate].wifi_ssid);
+		WiFi.mode(WIFI_STA);
+		if(!useDHCP_)
+			configWiFi(WM_STA_IPconfig_);
+		fromLease = beginNetwork(candidate);
+		bootStats_.fastPath = true;
+	}
+	else if(!bootStats_.keptConnection)
+	{
+		WiFi.config(0u, 0u, 0u);
+	}
+	
+	phaseStart = millis();
+	parseConfigFile();	//parsing only, WifiMqttUtility::begin() resets MQTT once after the association
+	bootStats_.configParseMs = millis() - phaseStart;
+
+	if (configDataLoaded)
+	{
+		initialConfig_ = false;	//found login data
+		phaseStart = millis();
+		setupNtp();
+		bootStats_.ntpSetupMs = millis() - phaseStart;
+		
+		bool connected = bootStats_.keptConnection;
+		if(bootStats_.fastPath)
+		{
+			phaseStart = millis();
+			connected = finishNetwork(candidate, associationStart, fromLease);
+			bootStats_.associationWaitMs = millis() - phaseStart;
+			if(connected)
+				saveConnectionHistory();	//persist connection history if the ranking changed
+			else
+				D1PRINTLN(F("Fast boot association failed, trying all networks"));
+		}
+		if(!connected)
+			connectMultiWiFi();
+		bootStats_.associationMs = millis() - associationStart;
+	}
+	else
+	{
+		D1PRINT(F("Can't read WiFi Config File."));
+		initialConfig_ = true;
+		initSTAIPConfigStruct(WM_STA_IPconfig_);
+	}
+	
+	updateWifiState(WiFi.status() == WL_CONNECTED);
+	if(wifiUp_)
+		bootStats_.connectedMs = millis();
+	D1PRINT(F("Boot ms: fs ")); D1PRINT(bootStats_.fsMountMs); D1PRINT(F(", credentials ")); D1PRINT(bootStats_.credentialsMs); 
+	D1PRINT(F(", config ")); D1PRINT(bootStats_.configParseMs); D1PRINT(F(", NTP ")); D1PRINT(bootStats_.ntpSetupMs); 
+	D1PRINT(F(", association ")); D1PRINT(bootStats_.associationMs); D1PRINT(F(" (waited ")); D1PRINT(bootStats_.associationWaitMs);
+	D1PRINT(F("), connected at ")); D1PRINTLN(bootStats_.connectedMs);
+	if(!wifiUp_)
+		wifiConfigPortal();
+}
+
+void WifiUtility::setupNtp()
+{
+#if USE_ESP_WIFIMANAGER_NTP      
+	if ( strlen(WMConfig_.TZ_Name) > 0 )
+	{
+		D1PRINT(F("Current TZ_Name =")); D1PRINT(WMConfig_.TZ_Name); D1PRINT(F(", TZ = ")); D1PRINTLN(WMConfig_.TZ);
+
+	#if ESP8266
+		configTime(WMConfig_.TZ, "pool.ntp.org"); 
+	#else
+		//configTzTime(WMConfig_.TZ, "pool.ntp.org" );
+		configTzTime(WMConfig_.TZ, "time.nist.gov", "0.pool.ntp.org", "1.pool.ntp.org");
+	#endif   
+	}
+	else
+	{
+		D1PRINT(F("Current Timezone is not set. Enter Config Portal to set."));
+	} 
+#endif
+}
+
+bool WifiUtility::loop()
+{
+	WU_PROFILE(WU_PHASE_LOOP);
+	loopTimers();
+	loopTriggerPin();
+	if(loopConnectionTimeout())
+		return loopWifiConnection();
+	return true;
+}
+
+void WifiUtility::loopTimers()
+{
+	WU_PROFILE(WU_PHASE_TIMERS);
+	timers_.run(millis());
+}
+
+void WifiUtility::loopTriggerPin()
+{
+	WU_PROFILE(WU_PHASE_TRIGGER);
+	//pin edges are handled by triggerPinISR, nothing to do unless a press is in progress
+	if(!triggerPressed_)
+		return;
+	if(millis() - triggerPressStartMs_ < triggerLongPressMs_)
+		return;
+	
+	//long press elapsed, confirm the level once in case the releasing edge was swallowed by the debounce
+	triggerPressed_ = false;
+	if ((digitalRead(triggerPin_) == LOW))
+	{
+		D1PRINTLN(F("Trigger pin held low -> call config portal"));
+		wifiConfigPortal();
+	}
+}
+
+void WifiUtility::attachTriggerPin()
+{
+	if(attachedTriggerPin_ == triggerPin_)
+		return;
+	if(attachedTriggerPin_ >= 0)
+		detachInterrupt(digitalPinToInterrupt(attachedTriggerPin_));
+	
+	triggerPressed_ = false;
+	attachedTriggerPin_ = triggerPin_;
+	if(triggerPin_ < 0)		//Assume this means that no trigger pin is selected, doable by configuring a pin <=-2 as trigger pin
+		return;
+	attachInterruptArg(digitalPinToInterrupt(triggerPin_), triggerPinISR, this, CHANGE);
+}
+
+void IRAM_ATTR WifiUtility::triggerPinISR(void* arg)
+{
+	WifiUtility* self = static_cast<WifiUtility*>(arg);
+	ulong now = millis();
+	
+	//ignore bouncing edges following an accepted edge
+	if(now - self->triggerEdgeMs_ < self->triggerDebounceMs_)
+		return;
+	self->triggerEdgeMs_ = now;
+	
+	bool pressed = (digitalRead(self->triggerPin_) == LOW);
+	if(pressed && !self->triggerPressed_)
+		self->triggerPressStartMs_ = now;
+	self->triggerPressed_ = pressed;
+}
+
+bool WifiUtility::loopConnectionTimeout()
+{
+	WU_PROFILE(WU_PHASE_TIMEOUT_CHECK);
+	//flag is set by the connection check timer, see loopTimers()
+	bool res = connectionCheckDue_;
+	connectionCheckDue_ = false;
+	return res;
+}
+
+bool WifiUtility::loopWifiConnection()
+{
+	WU_PROFILE(WU_PHASE_WIFI_CHECK);
+	updateWifiState(WiFi.status() == WL_CONNECTED);
+	if (!wifiUp_)
+	{
+		//D1PRINTLN(F("\nWiFi lost."));
+		if(autoReconnect_)
+		{
+			quiet_ = true;	//potentially called very often, don't spam Serial port
+			connectMultiWiFi();
+			quiet_ = false;
+			
+			updateWifiState(WiFi.status() == WL_CONNECTED);
+			backoffConnectionCheck(!wifiUp_);
+			return wifiUp_;
+		}
+		return false;
+	}
+	return true;
+}
+
+void WifiUtility::emitEvent(WifiUtilityEventType type)
+{
+	WifiUtilityEvent event;
+	event.type = type;
+	event.timestampMs = millis();
+	event.ip = lastIP_;
+	events_.emit(event);
+}
+
+#ifdef ESP32
+typedef struct
+{
+	struct tcpip_api_call_data call;	//has to be first, lwIP hands it back to the trampoline
+	void (*function)(void* ctx);
+	void* ctx;
+} WU_LwipCall;
+
+static err_t lwipCallTrampoline(struct tcpip_api_call_data* call)
+{
+	WU_LwipCall* lwipCall = (WU_LwipCall*) call;
+	lwipCall->function(lwipCall->ctx);
+	return ERR_OK;
+}
+#endif
+
+//netif and etharp must only be touched from the lwIP context, blocks until function has run there
+static void runInLwip(void (*function)(void* ctx), void* ctx)
+{
+#ifdef ESP32
+	WU_LwipCall call;
+	call.function = function;
+	call.ctx = ctx;
+	tcpip_api_call(lwipCallTrampoline, &call.call);
+#else
+	function(ctx);	//ESP8266 runs lwIP in the loop context
+#endif
+}
+
+typedef struct
+{
+	uint8_t mac[6];
+	ip4_addr_t ip;
+	bool linkUp;
+	bool sent;
+	bool inUse;
+	uint32_t leaseSeconds;
+	uint32_t leaseAgeS;
+} WU_LwipQuery;
+
+static struct netif* stationNetif(const uint8_t* mac)
+{
+	for(struct netif* netif = netif_list; netif != NULL; netif = netif->next)
+	{
+		if(netif->hwaddr_len == 6 && memcmp(netif->hwaddr, mac, 6) == 0)
+			return netif;
+	}
+	return NULL;
+}
+
+static void lwipLinkUp(void* ctx)
+{
+	WU_LwipQuery* query = (WU_LwipQuery*) ctx;
+	struct netif* netif = stationNetif(query->mac);
+	query->linkUp = (netif != NULL) && netif_is_link_up(netif);
+}
+
+static void lwipArpProbe(void* ctx)
+{
+	//RFC 5227 probe, sender address 0.0.0.0 so nothing is claimed before the check passed
+	WU_LwipQuery* query = (WU_LwipQuery*) ctx;
+	struct netif* netif = stationNetif(query->mac);
+	query->sent = (netif != NULL) && (etharp_acd_probe(netif, &query->ip) == ERR_OK);
+}
+
+static void lwipArpCheck(void* ctx)
+{
+	//an answer to the probe puts the owner of the address into the ARP table
+	WU_LwipQuery* query = (WU_LwipQuery*) ctx;
+	struct netif* netif = stationNetif(query->mac);
+	struct eth_addr* mac = NULL;
+	const ip4_addr_t* entry = NULL;
+	query->inUse = (netif != NULL) && (etharp_find_addr(netif, &query->ip, &mac, &entry) >= 0);
+}
+
+static void lwipLeaseTime(void* ctx)
+{
+	WU_LwipQuery* query = (WU_LwipQuery*) ctx;
+	struct netif* netif = stationNetif(query->mac);
+	struct dhcp* dhcp = (netif != NULL) ? netif_dhcp_data(netif) : NULL;
+	if(dhcp != NULL && dhcp->state != DHCP_STATE_OFF && dhcp->offered_t0_lease > 0)	//a stopped client keeps the old values
+	{
+		query->leaseSeconds = dhcp->offered_t0_lease;
+		query->leaseAgeS = dhcp->lease_used * DHCP_COARSE_TIMER_SECS;	//restarts with every ACK, renewals included
+	}
+}
+
+static void lwipDhcpStart(void* ctx)
+{
+	//DHCP client on the configured address: the address stays while the server is asked, the same address in the ACK changes nothing
+	WU_LwipQuery* query = (WU_LwipQuery*) ctx;
+	struct netif* netif = stationNetif(query->mac);
+	query->sent = (netif != NULL) && (dhcp_start(netif) == ERR_OK);
+}
+
+void WifiUtility::updateWifiState(bool connected)
+{
+	if(connected != wifiUp_)
+	{
+		wifiUp_ = connected;
+		associatedSinceMs_ = millis();
+		smoothedRssi_ = 0;
+		emitEvent(connected ? WU_EVENT_WIFI_UP : WU_EVENT_WIFI_DOWN);
+		if(!connected)
+			lastIP_ = IPAddress(0u);
+		else
+			applyPowerPolicy();
+	}
+	
+	//new lease or changed address while connected, no address yet while DHCP runs is not a change
+	if(connected && (WiFi.localIP() != lastIP_) && (WiFi.localIP() != IPAddress(0u)))
+	{
+		bool changed = (lastIP_ != IPAddress(0u));
+		lastIP_ = WiFi.localIP();
+		emitEvent(WU_EVENT_IP_ACQUIRED);
+		if(changed)
+		{
+			D1PRINT(F("Address changed to ")); D1PRINTLN(lastIP_);
+			onAddressChanged();
+		}
+	}
+}
+
+void WifiUtility::applyPowerPolicy()
+{
+	powerStats_.policy = powerPolicy_;
+	if(powerPolicy_ == WU_POWER_DEFAULT)
+		return;
+	
+	//sleep through as many beacons as the regular traffic allows, DTIM only for the balanced policy
+	uint8_t listenInterval = 0;
+	wakePeriodMs_ = POWER_BEACON_INTERVAL_MS;
+	if(powerPolicy_ == WU_POWER_LOW)
+	{
+		ulong traffic = trafficIntervalMs();
+		ulong period = (traffic > 0) ? traffic / POWER_WAKES_PER_INTERVAL : POWER_BEACON_INTERVAL_MS*POWER_LISTEN_INTERVAL_MAX;
+		listenInterval = constrain(period / POWER_BEACON_INTERVAL_MS, 1UL, (ulong)POWER_LISTEN_INTERVAL_MAX);
+		wakePeriodMs_ = listenInterval * POWER_BEACON_INTERVAL_MS;
+#ifdef ESP32
+		//used from the next association on
+		wifi_config_t conf;
+		if(esp_wifi_get_config(WIFI_IF_STA, &conf) == ESP_OK && conf.sta.listen_interval != listenInterval)
+		{
+			conf.sta.listen_interval = listenInterval;
+			esp_wifi_set_config(WIFI_IF_STA, &conf);
+		}
+#endif
+	}
+	if(listenInterval != powerStats_.listenInterval)
+	{
+		D1PRINT(F("Power policy ")); D1PRINT(powerPolicy_); D1PRINT(F(", listen interval ")); D1PRINTLN(listenInterval);
+	}
+	powerStats_.listenInterval = listenInterval;
+	setPowerSave(powerPolicy_ != WU_POWER_NONE && !radioHeld_);
+}
+
+void WifiUtility::setPowerSave(bool enabled)
+{
+	accountPower();
+	powerSaveActive_ = enabled;
+#ifdef ESP32
+	esp_wifi_set_ps(!enabled ? WIFI_PS_NONE : (powerPolicy_ == WU_POWER_LOW ? WIFI_PS_MAX_MODEM : WIFI_PS_MIN_MODEM));
+#else
+	WiFi.setSleepMode(enabled ? WIFI_MODEM_SLEEP : WIFI_NONE_SLEEP, enabled ? powerStats_.listenInterval : 0);
+#endif
+}
+
+void WifiUtility::holdRadioAwake(ulong durationMs)
+{
+	if(powerPolicy_ == WU_POWER_DEFAULT || powerPolicy_ == WU_POWER_NONE || !wifiUp_)
+		return;
+	if(!radioHeld_)
+	{
+		radioHeld_ = true;
+		powerStats_.holds++;
+		setPowerSave(false);
+	}
+	//extends a running hold
+	timers_.cancel(radioHoldTimer_);
+	radioHoldTimer_ = timers_.schedule(durationMs, radioReleaseJob, this);
+}
+
+void WifiUtility::radioReleaseJob(void* arg)
+{
+	WifiUtility* self = static_cast<WifiUtility*>(arg);
+	self->radioHeld_ = false;
+	if(self->wifiUp_)
+		self->applyPowerPolicy();
+}
+
+void WifiUtility::accountPower()
+{
+	ulong now = millis();
+	ulong elapsed = now - powerAccountMs_;
+	powerAccountMs_ = now;
+	
+	//in power save the radio is assumed on for a short window per wake, off otherwise
+	if(powerSaveActive_)
+	{
+		powerStats_.powerSaveMs += elapsed;
+		powerStats_.estRadioOnMs += elapsed * POWER_BEACON_WAKE_MS / wakePeriodMs_;
+	}
+	else
+	{
+		powerStats_.awakeMs += elapsed;
+		powerStats_.estRadioOnMs += elapsed;
+	}
+	ulong total = powerStats_.awakeMs + powerStats_.powerSaveMs;
+	if(total > 0)
+		powerStats_.estCurrentMa = POWER_CURRENT_SLEEP_MA + (float)(POWER_CURRENT_AWAKE_MA - POWER_CURRENT_SLEEP_MA) * powerStats_.estRadioOnMs / total;
+}
+
+void WifiUtility::connectionCheckJob(void* arg)
+{
+	static_cast<WifiUtility*>(arg)->connectionCheckDue_ = true;
+}
+
+void WifiUtility::backoffConnectionCheck(bool failed)
+{
+	if(!failed)
+	{
+		if(reconnectBackoffMs_ > 0)
+		{
+			reconnectBackoffMs_ = 0;
+			timers_.reschedule(connectionCheckTimer_, connectionCheckIntervalMs_);
+		}
+		return;
+	}
+	
+	reconnectBackoffMs_ = (reconnectBackoffMs_ == 0) ? RECONNECT_BACKOFF_MIN_MS : min(2*reconnectBackoffMs_, (ulong)RECONNECT_BACKOFF_MAX_MS);
+	timers_.reschedule(connectionCheckTimer_, reconnectBackoffMs_);
+}
+
+void WifiUtility::wifiConfigPortal()
+{
+	WU_HEAP_SCOPE(WU_HEAP_PORTAL);
+	D1PRINTLN(F("\nConfig Portal requested."));
+	updateWifiState(false);		//the portal takes over the radio
+	emitEvent(WU_EVENT_PORTAL_OPENED);
+
+	AsyncWebServer webServer = AsyncWebServer(HTTP_PORT);
+	
+#if ( USING_ESP32_S2 || USING_ESP32_C3 )
+	ESPAsync_WiFiManager ESPAsync_wifiManager(&webServer, NULL, hostname_);
+#else
+	DNSServer dnsServer;
+	ESPAsync_WiFiManager ESPAsync_wifiManager(&webServer, &dnsServer, hostname_);
+#endif
+
+	//Check if there is stored WiFi router/password credentials.
+	//If not found, device will remain in configuration mode until switched off via webserver.
+	D1PRINTLN(F("Opening Configuration Portal. "));
+  
+	routerSSID_ = ESPAsync_wifiManager.WiFi_SSID();
+	routerPass_ = ESPAsync_wifiManager.WiFi_Pass();
+  
+	//Don't permit NULL password
+	if ( !initialConfig_ && (routerSSID_ != "") && (routerPass_ != "") )
+	{
+		//If valid AP credential and not DRD, set timeout to configured timeout.
+		ESPAsync_wifiManager.setConfigPortalTimeout(APTimeoutS_);
+		D1PRINT(F("Got stored Credentials. Timeout ")); D1PRINT(String(APTimeoutS_)); D1PRINTLN(F("s."));
+	}
+	else
+	{
+		ESPAsync_wifiManager.setConfigPortalTimeout(0);
+
+		D1PRINT(F("No timeout : "));
+	}
+
+	// Extra parameters to be configured
+	// After connecting, parameter.getValue() will get you the configured value
+	// Format: <ID> <Placeholder text> <default value> <length> <custom HTML> <label placement>
+
+	std::unique_ptr<std::unique_ptr<ESPAsync_WMParameter>[]> parameterHandler(new std::unique_ptr<ESPAsync_WMParameter>[configParameters_.size()], 
+																				std::default_delete<std::unique_ptr<ESPAsync_WMParameter>[]>());	//custom deleter not necessary in C++17, but Arduino is mostly C++11
+
+	for(int i=0; i<configParameters_.size();i++)
+	{
+		parameterHandler[i] = std::unique_ptr<ESPAsync_WMParameter> (new ESPAsync_WMParameter(configParameters_[i].id, configParameters_[i].label, configParameters_[i].preferedDefault(), 
+																								configParameters_[i].length+1, configParameters_[i].customHTML, configParameters_[i].labelPlacement));
+		ESPAsync_wifiManager.addParameter(parameterHandler[i].get());
+	}
+
+	ESPAsync_wifiManager.setMinimumSignalQuality(-1);
+
+	// Set config portal channel, default = 1. Use 0 => random channel from 1-13
+	ESPAsync_wifiManager.setConfigPortalChannel(0);
+	
+	D1PRINT(F("Starting configuration portal @ "));
+	
+	if(useCustomAPIP_)
+	{
+		ESPAsync_wifiManager.setAPStaticIPConfig(WM_AP_IPconfig_);
+		D1PRINT(WM_AP_IPconfig_._ap_static_ip);
+	}
+	else
+	{
+		D1PRINT(F("192.168.4.1"));
+	}
+	
+	ESPAsync_wifiManager.setSTAStaticIPConfig(WM_STA_IPconfig_);	//populate fixed IP data in portal
+
+#if USING_CORS_FEATURE
+	ESPAsync_wifiManager.setCORSHeader("Your Access-Control-Allow-Origin");
+#endif
+
+	// Start an access point
+	// and goes into a blocking loop awaiting configuration.
+	// Once the user leaves the portal with the exit button
+	// processing will continue
+	// SSID to uppercase
+	configSSID_.toUpperCase();
+	configPassword_ = "My" + configSSID_;
+
+	D1PRINT(F(", SSID = "));
+	D1PRINT(configSSID_);
+	D1PRINT(F(", PWD = "));
+	D1PRINTLN(configPassword_);
+  
+	if (!ESPAsync_wifiManager.startConfigPortal((const char *) configSSID_.c_str(), configPassword_.c_str()))
+	{
+		D1PRINT(F("Not connected to WiFi but continuing anyway."));
+	}
+	else
+	{
+		// If you get here you have connected to the WiFi
+		D1PRINT(F("Connected...yeey :)"));
+		D1PRINT(F("Local IP: "));
+		D1PRINTLN(WiFi.localIP());
+	}
+	emitEvent(WU_EVENT_PORTAL_CLOSED);
+
+	// Only clear then save data if CP entered and with new valid Credentials
+	// No CP => stored getSSID() = ""
+	if ( String(ESPAsync_wifiManager.getSSID(0)) != "" && String(ESPAsync_wifiManager.getSSID(1)) != "" )
+	{
+		// Stored  for later usage, but clear first
+		memset(&WMConfig_, 0, sizeof(WMConfig_));
+    
+		for (uint8_t i = 0; i < NUM_WIFI_CREDENTIALS; i++)
+		{
+			String tempSSID = ESPAsync_wifiManager.getSSID(i);
+			String tempPW   = ESPAsync_wifiManager.getPW(i);
+			
+			if (strlen(tempSSID.c_str()) < sizeof(WMConfig_.WiFi_Creds[i].wifi_ssid) - 1)
+				strcpy(WMConfig_.WiFi_Creds[i].wifi_ssid, tempSSID.c_str());
+			else
+				strncpy(WMConfig_.WiFi_Creds[i].wifi_ssid, tempSSID.c_str(), sizeof(WMConfig_.WiFi_Creds[i].wifi_ssid) - 1);
+  
+			if (strlen(tempPW.c_str()) < sizeof(WMConfig_.WiFi_Creds[i].wifi_pw) - 1)
+				strcpy(WMConfig_.WiFi_Creds[i].wifi_pw, tempPW.c_str());
+			else
+				strncpy(WMConfig_.WiFi_Creds[i].wifi_pw, tempPW.c_str(), sizeof(WMConfig_.WiFi_Creds[i].wifi_pw) - 1);  
+  
+			// Don't permit NULL SSID and password len < MIN_AP_PASSWORD_SIZE (8)
+			if ( (String(WMConfig_.WiFi_Creds[i].wifi_ssid) != "") && (strlen(WMConfig_.WiFi_Creds[i].wifi_pw) >= MIN_AP_PASSWORD_SIZE) )
+			{
+				D1PRINT(F("* Add SSID = ")); D1PRINTLN(WMConfig_.WiFi_Creds[i].wifi_ssid); D3PRINT(F(", PW = ")); D3PRINTLN(WMConfig_.WiFi_Creds[i].wifi_pw );
+				addNetwork(WMConfig_.WiFi_Creds[i].wifi_ssid, WMConfig_.WiFi_Creds[i].wifi_pw);	//merged into the store, other known networks are kept
+			}
+		}
+
+#if USE_ESP_WIFIMANAGER_NTP      
+		String tempTZ   = ESPAsync_wifiManager.getTimezoneName();
+
+		if (strlen(tempTZ.c_str()) < sizeof(WMConfig_.TZ_Name) - 1)
+			strcpy(WMConfig_.TZ_Name, tempTZ.c_str());
+		else
+			strncpy(WMConfig_.TZ_Name, tempTZ.c_str(), sizeof(WMConfig_.TZ_Name) - 1);
+
+		const char * TZ_Result = ESPAsync_wifiManager.getTZ(WMConfig_.TZ_Name);
+    
+		if (strlen(TZ_Result) < sizeof(WMConfig_.TZ) - 1)
+			strcpy(WMConfig_.TZ, TZ_Result);
+		else
+			strncpy(WMConfig_.TZ, TZ_Result, sizeof(WMConfig_.TZ_Name) - 1);
+         
+		if ( strlen(WMConfig_.TZ_Name) > 0 )
+		{
+			D1PRINT(F("Saving current TZ_Name =")); D1PRINT(WMConfig_.TZ_Name); D1PRINT(F(", TZ = ")); D1PRINTLN(WMConfig_.TZ);
+
+#if ESP8266
+			configTime(WMConfig_.TZ, "pool.ntp.org"); 
+#else
+			//configTzTime(WMConfig_.TZ, "pool.ntp.org" );
+			configTzTime(WMConfig_.TZ, "time.nist.gov", "0.pool.ntp.org", "1.pool.ntp.org");
+#endif
+		}
+		else
+		{
+			D1PRINT(F("Current Timezone Name is not set. Enter Config Portal to set."));
+		}
+#endif 
+	}
+	
+	ESPAsync_wifiManager.getSTAStaticIPConfig(WM_STA_IPconfig_);
+    saveWifiConfigData();
+	
+	//retrieve parameter values
+	for(int i=0; i<configParameters_.size();i++)
+	{
+		//strcpy(configParameters_[i].value.get(), parameterHandler[i]->getValue());
+		if(!configParameters_[i].setValue(parameterHandler[i]->getValue()))
+		{
+			D1PRINT(F("Parameter '")); D1PRINT(configParameters_[i].id); D1PRINTLN(F("' from the portal is invalid. Old value kept."));
+			continue;
+		}
+		D2PRINT(F("Parameter '")); D2PRINT(configParameters_[i].id); D2PRINT(F("' from the portal has value '")); D2PRINT(configParameters_[i].value); D2PRINTLN(F("'"));
+	}
+	saveConfigFile();
+	begin();	//reset WiFi to enforce fixed/dynamic IP (otherwise fixed IP may be used if one is/was entered in portal)
+}
+
+void WifiUtility::mountFilesystem()
+{
+	//once, also for paths that skip begin() like the fast wake from deep sleep
+	if(filesystem_ == NULL)
+	{
+#if USE_LITTLEFS
+		filesystem_ = &LITTLEFS;
+#elif USE_SPIFFS
+		filesystem_ = &SPIFFS;
+#else
+		filesystem_ = &FFat;
+#endif
+
+		// Format FileFS if not yet
+#ifdef ESP32
+		if (!FileFS.begin(true))
+#else
+		if (!FileFS.begin())
+#endif
+		{
+#ifdef ESP8266
+			FileFS.format();
+#endif
+
+			D1PRINTLN(F("SPIFFS/LittleFS failed! Already tried formatting."));
+  
+			if (!FileFS.begin())
+			{     
+				// prevents debug info from the library to hide err message.
+				delay(100);
+      
+#if USE_LITTLEFS
+				D1PRINTLN(F("LittleFS failed!. Please use SPIFFS or EEPROM. Stay forever"));
+#else
+				D1PRINTLN(F("SPIFFS failed!. Please use LittleFS or EEPROM. Stay forever"));
+#endif
+
+				while (true)
+				{
+					delay(1);
+				}
+			}
+		}
+	}
+}
+
+bool WifiUtility::parseConfigFile() 
+{
+	WU_HEAP_SCOPE(WU_HEAP_CONFIG);
+	// this opens the config file in read-mode
+	File f = FileFS.open(CONFIG_FILENAME, "r");
+
+	if (!f)
+	{
+		D1PRINTLN(F("Config File not found"));
+		return false;
+	}
+	else
+	{
+		// we could open the file
+		size_t size = f.size();
+		// Allocate a buffer to store contents of the file.
+#if WU_STATIC_MEMORY
+		static char fileBuffer[WU_JSON_DOC_SIZE + 1];
+		if(size > WU_JSON_DOC_SIZE)
+		{
+			D1PRINTLN(F("Config file too large for the static buffer"));
+			f.close();
+			return false;
+		}
+		char* buf = fileBuffer;
+		buf[size] = 0;
+		f.readBytes(buf, size);
+#else
+		std::unique_ptr<char[]> buf(new char[size + 1], std::default_delete<char[]>());	//again, Arduino mostly based on C++11 (not sure custom deleter for arrays is necessary)
+		buf[size] = 0;
+
+		// Read and store file contents in buf
+		f.readBytes(buf.get(), size);
+#endif
+		// Closing file
+		f.close();
+		// Using dynamic JSON buffer which is not the recommended memory model, but anyway
+		// See https://github.com/bblanchon/ArduinoJson/wiki/Memory%20model
+	
+		D2PRINTLN(F("Parsing the following from the config file:"));
+#if (ARDUINOJSON_VERSION_MAJOR >= 6)
+
+		JSON_DOCUMENT(json);
+		auto deserializeError = deserializeJson(json, &buf[0]);
+    
+		if ( deserializeError )
+		{
+			D1PRINTLN(F("JSON parseObject() failed"));
+			return false;
+		}
+		
+		if(debuglevel_ >= 2)
+			serializeJson(json, Serial);
+    
+#else
+
+		JSON_BUFFER(jsonBuffer);
+		// Parse JSON string
+		JsonObject& json = jsonBuffer.parseObject(&buf[0]);
+    
+		// Test if parsing succeeds.
+		if (!json.success())
+		{
+			D1PRINTLN(F("JSON parseObject() failed"));
+			return false;
+		}
+		
+		if(debuglevel_ >= 2)
+			json.printTo(Serial);
+    
+#endif
+
+		// Parse all config file parameters, override
+		// local config variables with parsed values
+		for(int i=0; i<configParameters_.size(); i++)
+		{
+			//does not reset old values if none is found in the file - expected behavior?
+			if(json.containsKey(configParameters_[i].id))
+			{
+				if(!configParameters_[i].setValue((const char*)json[configParameters_[i].id]))
+				{
+					D1PRINT(F("Stored value of parameter '")); D1PRINT(configParameters_[i].id); D1PRINTLN(F("' is invalid. Old value kept."));
+				}
+			}
+			else
+			{
+				D1PRINT(F("Could not find parameter '"));
+				D1PRINT(configParameters_[i].id);
+				D1PRINTLN(F("' stored in flash. Old value kept."));
+			}
+		}
+	}
+ 
+	D1PRINTLN(F("\nConfig File successfully parsed"));
+  
+	return true;
+}
+
+bool WifiUtility::saveConfigFile() 
+{
+	WU_HEAP_SCOPE(WU_HEAP_CONFIG);
+	D1PRINTLN(F("Saving Config File"));
+
+#if (ARDUINOJSON_VERSION_MAJOR >= 6)
+	JSON_DOCUMENT(json);
+#else
+	JSON_BUFFER(jsonBuffer);
+	JsonObject& json = jsonBuffer.createObject();
+#endif
+	
+	// JSONify local configuration parameters
+	for(int i=0; i<configParameters_.size(); i++)
+	{
+		if(strcmp(configParameters_[i].id, "") == 0)
+			continue;
+		json[configParameters_[i].id] = configParameters_[i].value.c_str();
+	}
+	
+	// Open file for writing
+	File f = FileFS.open(CONFIG_FILENAME, "w");
+
+	if (!f)
+	{
+		D1PRINTLN(F("Failed to open Config File for writing"));
+		return false;
+	}
+	
+	D2PRINTLN(F("Writing the following to the config file:"));
+#if (ARDUINOJSON_VERSION_MAJOR >= 6)
+	if(debuglevel_ >= 2)
+		serializeJsonPretty(json, Serial);
+	// Write data to file and close it
+	serializeJson(json, f);
+#else
+	if(debuglevel_ >= 2)
+		json.prettyPrintTo(Serial);
+	// Write data to file and close it
+	json.printTo(f);
+#endif
+
+	f.close();
+
+	D1PRINTLN(F("\nConfig File successfully saved"));
+	emitEvent(WU_EVENT_CONFIG_CHANGED);
+	return true;
+}
+
+#if USE_ESP_WIFIMANAGER_NTP
+
+void WifiUtility::printLocalTime()
+{
+	#if ESP8266
+	static time_t now;
+	
+	now = time(nullptr);
+	
+	if ( now > 1451602800 )
+	{
+		Serial.print(F("Local Date/Time: "));
+		Serial.print(ctime(&now));
+	}
+	#else
+	struct tm timeinfo;
+
+	getLocalTime( &timeinfo );
+
+	// Valid only if year > 2000. 
+	// You can get from timeinfo : tm_year, tm_mon, tm_mday, tm_hour, tm_min, tm_sec
+	if (timeinfo.tm_year > 100 )
+	{
+		Serial.print(F("Local Date/Time: "));
+		Serial.print( asctime( &timeinfo ) );
+	}
+	#endif
+}
+
+#endif
+
+
+void WifiUtility::initAPIPConfigStruct(WiFi_AP_IPConfig &in_WM_AP_IPconfig)
+{
+	in_WM_AP_IPconfig._ap_static_ip   = APStaticIP_;
+	in_WM_AP_IPconfig._ap_static_gw   = APStaticGW_;
+	in_WM_AP_IPconfig._ap_static_sn   = APStaticSN_;
+}
+
+void WifiUtility::initSTAIPConfigStruct(WiFi_STA_IPConfig &in_WM_STA_IPconfig)
+{
+	in_WM_STA_IPconfig._sta_static_ip   = IPAddress(0, 0, 0, 0);
+	in_WM_STA_IPconfig._sta_static_gw   = IPAddress(192, 168, 2, 1);
+	in_WM_STA_IPconfig._sta_static_sn   = IPAddress(255, 255, 255, 0);
+	in_WM_STA_IPconfig._sta_static_dns1 = in_WM_STA_IPconfig._sta_static_gw;
+	in_WM_STA_IPconfig._sta_static_dns2 = IPAddress(8, 8, 8, 8);
+}
+
+void WifiUtility::displayIPConfigStruct(WiFi_STA_IPConfig in_WM_STA_IPconfig)
+{
+	D1PRINT(F("stationIP = ")); D1PRINT(in_WM_STA_IPconfig._sta_static_ip); D1PRINT(F(", gatewayIP = ")); D1PRINTLN(in_WM_STA_IPconfig._sta_static_gw);
+	D1PRINT(F("netMask = ")); D1PRINT(in_WM_STA_IPconfig._sta_static_sn);
+	D1PRINT(F(", dns1IP = ")); D1PRINT(in_WM_STA_IPconfig._sta_static_dns1); D1PRINT(F(", dns2IP = ")); D1PRINTLN(in_WM_STA_IPconfig._sta_static_dns2);
+}
+
+void WifiUtility::configWiFi(WiFi_STA_IPConfig in_WM_STA_IPconfig)
+{
+	D1PRINT(F("Config fixed IP: ")); D1PRINTLN(in_WM_STA_IPconfig._sta_static_ip);
+    // Set static IP, Gateway, Subnetmask, DNS1 and DNS2.
+    WiFi.config(in_WM_STA_IPconfig._sta_static_ip, in_WM_STA_IPconfig._sta_static_gw, in_WM_STA_IPconfig._sta_static_sn, in_WM_STA_IPconfig._sta_static_dns1, in_WM_STA_IPconfig._sta_static_dns2);  
+}
+
+uint8_t WifiUtility::connectMultiWiFi()
+{
+	D1PRINTLN(F("Connect MultiWiFi with :"));
+	
+	//network remembered by the SDK/portal is a candidate as well, not saved unless it connects
+	if ( (routerSSID_ != "") && (routerPass_ != "") )
+	{
+		D1PRINT(F("* Config portal Router_SSID = ")); D1PRINTLN(routerSSID_); D3PRINT(F(", Router_Pass = ")); D3PRINTLN(routerPass_);
+		//unverified credentials must not evict a stored network
+		if(storedNetwork(routerSSID_.c_str()) >= 0 || networkCount_ < MAX_WIFI_CREDENTIALS)
+			addNetwork(routerSSID_.c_str(), routerPass_.c_str());
+		else
+			D1PRINTLN(F("Credential store full, portal network not added"));
+	}
+	
+	if(networkCount_ == 0)
+	{
+		D1PRINTLN(F("No stored networks"));
+		return WiFi.status();
+	}
+	
+	WiFi.mode(WIFI_STA);
+	if(!useDHCP_)
+		configWiFi(WM_STA_IPconfig_);
+	
+	//blocking scan only if the background scan has nothing recent
+	bool usedCache = scanCacheFresh();
+	if(usedCache)
+	{
+		D1PRINTLN(F("Using cached scan results"));
+	}
+	else
+	{
+		if(scanRunning_)
+		{
+			WiFi.scanDelete();
+			scanRunning_ = false;
+		}
+		mergeScanResults(WiFi.scanNetworks());
+	}
+	
+	//find the strongest access point of every stored network
+	int32_t rssi[MAX_WIFI_CREDENTIALS];
+	int32_t channel[MAX_WIFI_CREDENTIALS];
+	uint8_t bssid[MAX_WIFI_CREDENTIALS][6];
+	int found = 0;
+	for(int i=0; i<networkCount_; i++)
+	{
+		rssi[i] = INT32_MIN;
+		channel[i] = 0;
+	}
+	
+	for(int n=0; n<scanCacheCount_; n++)
+	{
+		if(millis() - scanCache_[n].seenMs > SCAN_CACHE_MAX_AGE_MS)
+			continue;
+		found++;
+		for(int i=0; i<networkCount_; i++)
+		{
+			if(strcmp(scanCache_[n].ssid, networks_[i].wifi_ssid) == 0 && scanCache_[n].rssi > rssi[i])
+			{
+				rssi[i] = scanCache_[n].rssi;
+				channel[i] = scanCache_[n].channel;
+				memcpy(bssid[i], scanCache_[n].bssid, 6);
+			}
+		}
+	}
+	
+	//order by expected time to connect, networks not seen in the scan last
+	uint8_t order[MAX_WIFI_CREDENTIALS];
+	ulong cost[MAX_WIFI_CREDENTIALS];
+	for(int i=0; i<networkCount_; i++)
+	{
+		cost[i] = expectedConnectMs(networks_[i], rssi[i]);
+		int j = i;
+		while(j > 0 && cost[order[j-1]] > cost[i])
+		{
+			order[j] = order[j-1];
+			j--;
+		}
+		order[j] = i;
+	}
+	
+	for(int i=0; i<networkCount_; i++)
+	{
+		WiFi_StoredNetwork &network = networks_[order[i]];
+		D1PRINT(F("* Stored SSID = ")); D1PRINT(network.wifi_ssid); D3PRINT(F(", PW = ")); D3PRINT(network.wifi_pw); 
+		D1PRINT(F(", RSSI = ")); D1PRINT(rssi[order[i]] == INT32_MIN ? String(F("not found")) : String(rssi[order[i]])); D1PRINT(F(", expected ")); D1PRINT(cost[order[i]]); D1PRINTLN(F("ms"));
+	}
+	
+	D1PRINTLN(F("Connecting MultiWifi..."));
+	
+	bool connected = false;
+	int tries = 0;
+	for(int i=0; i<networkCount_ && !connected; i++)
+	{
+		int index = order[i];
+		if(found > 0 && rssi[index] == INT32_MIN)	//not in range, scan was successful
+			continue;
+		tries++;
+		connected = (rssi[index] == INT32_MIN) ? connectNetwork(index) : connectNetwork(index, channel[index], bssid[index]);
+	}
+	
+	if ( connected )
+	{
+		D1PRINT(F("WiFi connected after ")); D1PRINT(String(tries)); D1PRINTLN(F(" tries."))
+		D1PRINT(F("SSID:")); D1PRINT(WiFi.SSID()); D1PRINT(F(",RSSI=")); D1PRINTLN(WiFi.RSSI());
+		D1PRINT(F("Channel:")); D1PRINT(WiFi.channel()); D1PRINT(F(", IP address:")); D1PRINTLN(WiFi.localIP());
+		saveConnectionHistory();	//persist connection history if the ranking changed
+	}
+	else
+	{
+		D1PRINT(F("WiFi not connected"));
+		//cached access points may be gone, scan on the next attempt
+		if(usedCache)
+		{
+			for(int n=0; n<scanCacheCount_; n++)
+				scanCache_[n].seenMs = millis() - SCAN_CACHE_MAX_AGE_MS - 1;
+		}
+	}
+	return WiFi.status();
+}
+
+void WifiUtility::mergeScanResults(int16_t found)
+{
+	ulong now = millis();
+	for(int16_t n=0; n<found; n++)
+	{
+		//same access point is updated, a new one takes a free slot or the oldest entry
+		int slot = -1;
+		int oldest = 0;
+		for(int i=0; i<scanCacheCount_; i++)
+		{
+			if(memcmp(scanCache_[i].bssid, WiFi.BSSID(n), 6) == 0)
+			{
+				slot = i;
+				break;
+			}
+			if(now - scanCache_[i].seenMs > now - scanCache_[oldest].seenMs)
+				oldest = i;
+		}
+		if(slot < 0)
+			slot = (scanCacheCount_ < SCAN_CACHE_SIZE) ? scanCacheCount_++ : oldest;
+		
+		WiFi_ScanEntry &entry = scanCache_[slot];
+		strncpy(entry.ssid, WiFi.SSID(n).c_str(), SSID_MAX_LEN);
+		entry.ssid[SSID_MAX_LEN] = 0;
+		memcpy(entry.bssid, WiFi.BSSID(n), 6);
+		entry.rssi = WiFi.RSSI(n);
+		entry.channel = WiFi.channel(n);
+		entry.seenMs = now;
+	}
+	if(found >= 0)
+		WiFi.scanDelete();
+}
+
+void WifiUtility::roamCheckJob(void* arg)
+{
+	static_cast<WifiUtility*>(arg)->checkRoaming();
+}
+
+void WifiUtility::checkRoaming()
+{
+	if(!roamEnabled_ || !wifiUp_ || scanRunning_)
+		return;
+	
+	//smoothing plus trigger level and margin give the hysteresis, the dwell time prevents ping-pong between APs
+	int32_t rssi = WiFi.RSSI();
+	smoothedRssi_ = (smoothedRssi_ == 0) ? rssi : (3*smoothedRssi_ + rssi) / 4;
+	if(smoothedRssi_ >= roamTriggerRssi_ || millis() - associatedSinceMs_ < roamMinDwellMs_)
+		return;
+	
+	uint8_t currentBssid[6];
+	memcpy(currentBssid, WiFi.BSSID(), 6);
+	
+	int best = -1;
+	int bestNetwork = -1;
+	bool scanRecent = false;
+	for(int n=0; n<scanCacheCount_; n++)
+	{
+		if(millis() - scanCache_[n].seenMs > ROAM_SCAN_MAX_AGE_MS)
+			continue;
+		scanRecent = true;
+		if(memcmp(scanCache_[n].bssid, currentBssid, 6) == 0 || scanCache_[n].rssi < smoothedRssi_ + roamMarginDb_)
+			continue;
+		if(best >= 0 && scanCache_[n].rssi <= scanCache_[best].rssi)
+			continue;
+		for(int i=0; i<networkCount_; i++)
+		{
+			if(strcmp(scanCache_[n].ssid, networks_[i].wifi_ssid) == 0)
+			{
+				best = n;
+				bestNetwork = i;
+				break;
+			}
+		}
+	}
+	
+	if(best < 0)
+	{
+		//weak link, make sure the decision is based on current data
+		if(!scanRecent)
+			backgroundScanJob(this);
+		return;
+	}
+	
+	WiFi_ScanEntry target = scanCache_[best];	//copy, the cache may change while connecting
+	D1PRINT(F("Roaming from RSSI ")); D1PRINT(smoothedRssi_); D1PRINT(F(" to ")); D1PRINT(target.ssid); D1PRINT(F(" RSSI ")); D1PRINTLN(target.rssi);
+	
+	int32_t rssiBefore = smoothedRssi_;
+	ulong start = millis();
+	onRoamStart();
+	
+	//planned disconnect, otherwise the status may still report the old association
+	WiFi.disconnect();
+	while(WiFi.status() == WL_CONNECTED && millis() - start < 500)
+		delay(10);
+	
+	bool roamed = connectNetwork(bestNetwork, target.channel, target.bssid);
+	if(!roamed)
+	{
+		roamStats_.failedRoams++;
+		connectMultiWiFi();
+	}
+	else
+	{
+		roamStats_.roams++;
+		roamStats_.lastGainDb = WiFi.RSSI() - rssiBefore;
+		roamStats_.totalGainDb += roamStats_.lastGainDb;
+		roamStats_.lastRoamMs = millis();
+	}
+	roamStats_.lastRoamDurationMs = millis() - start;
+	
+	bool connected = (WiFi.status() == WL_CONNECTED);
+	updateWifiState(connected);
+	associatedSinceMs_ = millis();
+	smoothedRssi_ = 0;
+	if(roamed)
+		emitEvent(WU_EVENT_ROAMED);
+	onRoamEnd(connected);
+	
+	D1PRINT(F("Roam ")); D1PRINT(roamed ? F("done") : F("failed")); D1PRINT(F(" after ")); D1PRINT(roamStats_.lastRoamDurationMs); D1PRINTLN(F("ms"));
+}
+
+bool WifiUtility::scanCacheFresh()
+{
+	for(int i=0; i<scanCacheCount_; i++)
+	{
+		if(millis() - scanCache_[i].seenMs <= SCAN_CACHE_MAX_AGE_MS)
+			return true;
+	}
+	return false;
+}
+
+void WifiUtility::backgroundScanJob(void* arg)
+{
+	WifiUtility* self = static_cast<WifiUtility*>(arg);
+	//only scan in the background while the link is up, the connect path scans itself if needed
+	if(!self->wifiUp_ || self->scanRunning_)
+		return;
+	if(WiFi.scanNetworks(true) == WIFI_SCAN_FAILED)
+		return;
+	self->scanRunning_ = true;
+	self->timers_.schedule(SCAN_POLL_MS, scanPollJob, self);
+}
+
+void WifiUtility::scanPollJob(void* arg)
+{
+	WifiUtility* self = static_cast<WifiUtility*>(arg);
+	if(!self->scanRunning_)		//taken over by connectMultiWiFi
+		return;
+	
+	int16_t found = WiFi.scanComplete();
+	if(found == WIFI_SCAN_RUNNING)
+	{
+		self->timers_.schedule(SCAN_POLL_MS, scanPollJob, self);
+		return;
+	}
+	self->scanRunning_ = false;
+	self->mergeScanResults(found);
+}
+
+bool WifiUtility::connectNetwork(int index, int32_t channel, const uint8_t* bssid)
+{
+	ulong start = millis();
+	bool fromLease = beginNetwork(index, channel, bssid);
+	return finishNetwork(index, start, fromLease);
+}
+
+bool WifiUtility::beginNetwork(int index, int32_t channel, const uint8_t* bssid)
+{
+	WiFi_StoredNetwork &network = networks_[index];
+	
+	//skip the DHCP exchange with the last lease of this network, otherwise make sure DHCP is on
+	bool fromLease = useDHCP_ && cachedLeaseValid(network.wifi_ssid);
+	if(useDHCP_)
+		WiFi.config(0u, 0u, 0u);	//drops a static config left by the last lease
+	
+	WiFi.begin(network.wifi_ssid, network.wifi_pw, channel, bssid);
+	if(fromLease)
+		stopDhcp();	//associate without an address, the lease is configured once the probe passed
+	return fromLease;
+}
+
+bool WifiUtility::finishNetwork(int index, ulong start, bool fromLease)
+{
+	WiFi_StoredNetwork &network = networks_[index];
+	bool connected;
+	if(fromLease)
+	{
+		//without an address the status never reaches connected, wait for the link instead
+		while(!stationLinkUp() && (millis() - start) < WIFI_CONNECT_TIMEOUT_MS)
+			delay(WIFI_CONNECT_POLL_MS);
+		connected = stationLinkUp() && claimCachedLease(start);
+	}
+	else
+	{
+		while(WiFi.status() != WL_CONNECTED && (millis() - start) < WIFI_CONNECT_TIMEOUT_MS)
+			delay(WIFI_CONNECT_POLL_MS);
+		connected = (WiFi.status() == WL_CONNECTED);
+		if(connected && useDHCP_)
+			storeDhcpLease();
+	}
+	
+	//keep the success ratio meaningful for recent history when the counters saturate
+	if(network.attempts == UINT16_MAX)
+	{
+		network.attempts /= 2;
+		network.successes /= 2;
+	}
+	network.attempts++;
+	if(connected)
+	{
+		failedNetworks_ &= ~(1 << index);
+		ulong duration = millis() - start;
+		network.successes++;
+		network.avgConnectMs = (network.successes == 1) ? duration : (3UL*network.avgConnectMs + duration) / 4;
+		time_t now = time(nullptr);
+		network.lastConnectTime = (now > 1451602800) ? (uint32_t)now : 0;
+	}
+	else
+	{
+		failedNetworks_ |= (1 << index);
+		WiFi.disconnect();
+	}
+	return connected;
+}
+
+int WifiUtility::storedNetwork(const char* ssid)
+{
+	for(int i=0; i<networkCount_; i++)
+	{
+		if(strcmp(networks_[i].wifi_ssid, ssid) == 0)
+			return i;
+	}
+	return -1;
+}
+
+int WifiUtility::bootCandidate()
+{
+	//the network of the cached lease was the last one used, otherwise the one expected to be fastest
+	int best = (dhcpLease_.ip != 0) ? storedNetwork(dhcpLease_.ssid) : -1;
+	if(best < 0)
+	{
+		for(int i=0; i<networkCount_; i++)
+		{
+			if(networks_[i].successes > 0 && (best < 0 || expectedConnectMs(networks_[i], 0) < expectedConnectMs(networks_[best], 0)))
+				best = i;
+		}
+	}
+	//a network that never connected would block the scan for the full timeout
+	if(best >= 0 && networks_[best].successes == 0)
+		return -1;
+	return best;
+}
+
+ulong WifiUtility::expectedConnectMs(const WiFi_StoredNetwork &network, int32_t rssi)
+{
+	//unknown networks are assumed to take half the timeout
+	ulong connectMs = (network.successes > 0) ? network.avgConnectMs : WIFI_CONNECT_TIMEOUT_MS/2;
+	//a failed attempt costs the full timeout before the next network is tried
+	ulong expected = connectMs + (ulong)WIFI_CONNECT_TIMEOUT_MS * (network.attempts - network.successes + 1) / (network.successes + 1);
+	
+	if(rssi == INT32_MIN)	//not seen in the last scan
+		return expected + 10UL*WIFI_CONNECT_TIMEOUT_MS;
+	if(rssi < -70)			//weak signals need more retries
+		expected += (ulong)(-70 - rssi) * 100;
+	return expected;
+}
+
+void WifiUtility::loadDhcpLease()
+{
+	memset(&dhcpLease_, 0, sizeof(dhcpLease_));
+	File file = FileFS.open(DHCP_LEASE_FILENAME, "r");
+	if(!file)
+		return;
+	file.readBytes((char *) &dhcpLease_, sizeof(dhcpLease_));
+	file.close();
+	if(dhcpLease_.checksum != calcChecksum((uint8_t*) &dhcpLease_, sizeof(dhcpLease_) - sizeof(dhcpLease_.checksum)))
+	{
+		D1PRINTLN(F("DHCP lease checksum wrong"));
+		memset(&dhcpLease_, 0, sizeof(dhcpLease_));
+	}
+}
+
+void WifiUtility::storeDhcpLease()
+{
+	if(!useDHCP_ || usingCachedLease_ || WiFi.status() != WL_CONNECTED)
+		return;
+	
+	WiFi_DhcpLease lease;
+	memset(&lease, 0, sizeof(lease));
+	strncpy(lease.ssid, WiFi.SSID().c_str(), SSID_MAX_LEN - 1);
+	lease.ip = WiFi.localIP();
+	lease.gateway = WiFi.gatewayIP();
+	lease.subnet = WiFi.subnetMask();
+	lease.dns1 = WiFi.dnsIP(0);
+	lease.dns2 = WiFi.dnsIP(1);
+	time_t now = time(nullptr);
+	lease.obtainedTime = (now > 1451602800) ? (uint32_t)now : 0;
+	WU_LwipQuery query;
+	memset(&query, 0, sizeof(query));
+	WiFi.macAddress(query.mac);
+	query.leaseSeconds = DHCP_LEASE_DEFAULT_S;
+	runInLwip(lwipLeaseTime, &query);
+	lease.leaseSeconds = query.leaseSeconds;
+	if(lease.ip == 0)
+		return;
+	
+	//limit flash writes: same lease is only rewritten when half of it is used up
+	bool refresh = (lease.obtainedTime > 0) && (lease.obtainedTime - dhcpLease_.obtainedTime > dhcpLease_.leaseSeconds/2);
+	lease.checksum = dhcpLease_.checksum;
+	if(!refresh && memcmp(&lease, &dhcpLease_, offsetof(WiFi_DhcpLease, obtainedTime)) == 0)
+		return;
+	
+	lease.checksum = calcChecksum((uint8_t*) &lease, sizeof(lease) - sizeof(lease.checksum));
+	dhcpLease_ = lease;
+	File file = FileFS.open(DHCP_LEASE_FILENAME, "w");
+	if(file)
+	{
+		file.write((uint8_t*) &dhcpLease_, sizeof(dhcpLease_));
+		file.close();
+	}
+	D2PRINT(F("Stored DHCP lease ")); D2PRINT(WiFi.localIP()); D2PRINT(F(" for ")); D2PRINT(lease.leaseSeconds); D2PRINTLN(F("s"));
+}
+
+bool WifiUtility::cachedLeaseValid(const char* ssid)
+{
+	usingCachedLease_ = false;
+	if(dhcpLease_.ip == 0 || strcmp(dhcpLease_.ssid, ssid) != 0)
+		return false;
+	
+	//without a valid clock the ARP check has to do
+	time_t now = time(nullptr);
+	if(now > 1451602800 && dhcpLease_.obtainedTime > 0 && (uint32_t)now - dhcpLease_.obtainedTime > dhcpLease_.leaseSeconds)
+		return false;
+	return true;
+}
+
+bool WifiUtility::claimCachedLease(ulong start)
+{
+	if(leaseAddressInUse(IPAddress(dhcpLease_.ip)))
+	{
+		//someone else has the address now, full DHCP
+		D1PRINTLN(F("Cached lease address in use, requesting new lease"));
+		dhcpLease_.ip = 0;
+		WiFi.config(0u, 0u, 0u);
+	}
+	else
+	{
+		WiFi.config(IPAddress(dhcpLease_.ip), IPAddress(dhcpLease_.gateway), IPAddress(dhcpLease_.subnet), IPAddress(dhcpLease_.dns1), IPAddress(dhcpLease_.dns2));
+		usingCachedLease_ = true;
+	}
+	
+	while((WiFi.status() != WL_CONNECTED || WiFi.localIP() == IPAddress(0u)) && (millis() - start) < WIFI_CONNECT_TIMEOUT_MS)
+		delay(WIFI_CONNECT_POLL_MS);
+	bool connected = (WiFi.status() == WL_CONNECTED) && (WiFi.localIP() != IPAddress(0u));
+	if(!connected)
+	{
+		usingCachedLease_ = false;
+	}
+	else if(usingCachedLease_)
+	{
+		D1PRINT(F("Reusing cached lease ")); D1PRINTLN(WiFi.localIP());
+		timers_.schedule(DHCP_RENEW_DELAY_MS, leaseRenewJob, this);
+	}
+	else
+	{
+		storeDhcpLease();
+	}
+	return connected;
+}
+
+void WifiUtility::stopDhcp()
+{
+#ifdef ESP32
+	#if defined(ESP_ARDUINO_VERSION_MAJOR) && (ESP_ARDUINO_VERSION_MAJOR >= 2)
+	esp_netif_dhcpc_stop(esp_netif_get_handle_from_ifkey("WIFI_STA_DEF"));
+	#else
+	tcpip_adapter_dhcpc_stop(TCPIP_ADAPTER_IF_STA);
+	#endif
+#else
+	wifi_station_dhcpc_stop();
+#endif
+}
+
+bool WifiUtility::dhcpLeaseState(uint32_t &leaseSeconds, uint32_t &ageS)
+{
+	WU_LwipQuery query;
+	memset(&query, 0, sizeof(query));
+	WiFi.macAddress(query.mac);
+	runInLwip(lwipLeaseTime, &query);
+	if(query.leaseSeconds == 0)
+		return false;
+	leaseSeconds = query.leaseSeconds;
+	ageS = query.leaseAgeS;
+	return true;
+}
+
+bool WifiUtility::stationLinkUp()
+{
+	WU_LwipQuery query;
+	memset(&query, 0, sizeof(query));
+	WiFi.macAddress(query.mac);
+	runInLwip(lwipLinkUp, &query);
+	return query.linkUp;
+}
+
+bool WifiUtility::leaseAddressInUse(IPAddress address)
+{
+	WU_LwipQuery query;
+	memset(&query, 0, sizeof(query));
+	WiFi.macAddress(query.mac);
+	ip4_addr_set_u32(&query.ip, (uint32_t)address);
+	runInLwip(lwipArpProbe, &query);
+	if(!query.sent)
+		return false;
+	delay(DHCP_ARP_CHECK_MS);
+	runInLwip(lwipArpCheck, &query);
+	return query.inUse;
+}
+
+void WifiUtility::leaseRenewJob(void* arg)
+{
+	static_cast<WifiUtility*>(arg)->renewCachedLease();
+}
+
+void WifiUtility::renewCachedLease()
+{
+	if(!usingCachedLease_ || !wifiUp_)
+		return;
+	//back to DHCP inside lwIP, WiFi.config(0u, 0u, 0u) would clear the address and abort the TCP connections on it.
+	//The server normally confirms the same address, a different one is handled by onAddressChanged
+	WU_LwipQuery query;
+	memset(&query, 0, sizeof(query));
+	WiFi.macAddress(query.mac);
+	runInLwip(lwipDhcpStart, &query);
+	if(!query.sent)
+	{
+		D1PRINTLN(F("DHCP start on the cached lease failed, keeping the address"));
+		return;
+	}
+	usingCachedLease_ = false;
+	timers_.schedule(DHCP_RENEW_WAIT_MS, leaseStoreJob, this);
+}
+
+void WifiUtility::leaseStoreJob(void* arg)
+{
+	WifiUtility* self = static_cast<WifiUtility*>(arg);
+	self->updateWifiState(WiFi.status() == WL_CONNECTED);
+	self->storeDhcpLease();
+}
+
+int WifiUtility::addNetwork(const char* ssid, const char* pw)
+{
+	if(strlen(ssid) == 0 || strlen(ssid) >= SSID_MAX_LEN || strlen(pw) < MIN_AP_PASSWORD_SIZE || strlen(pw) >= PASS_MAX_LEN)
+		return -1;
+	
+	int index = -1;
+	for(int i=0; i<networkCount_; i++)
+	{
+		if(strcmp(networks_[i].wifi_ssid, ssid) == 0)
+		{
+			index = i;
+			break;
+		}
+	}
+	
+	if(index < 0)
+	{
+		if(networkCount_ < MAX_WIFI_CREDENTIALS)
+		{
+			index = networkCount_++;
+		}
+		else
+		{
+			//store full, replace the network with the worst history
+			index = 0;
+			for(int i=1; i<networkCount_; i++)
+			{
+				if(expectedConnectMs(networks_[i], 0) > expectedConnectMs(networks_[index], 0))
+					index = i;
+			}
+			D1PRINT(F("Credential store full, replacing ")); D1PRINTLN(networks_[index].wifi_ssid);
+		}
+		memset(&networks_[index], 0, sizeof(WiFi_StoredNetwork));
+		strcpy(networks_[index].wifi_ssid, ssid);
+	}
+	else if(strcmp(networks_[index].wifi_pw, pw) != 0)
+	{
+		//new password, old history is meaningless
+		networks_[index].attempts = 0;
+		networks_[index].successes = 0;
+	}
+	strcpy(networks_[index].wifi_pw, pw);
+	return index;
+}
+
+bool WifiUtility::addWifiCredentials(const char* ssid, const char* pw)
+{
+	if(addNetwork(ssid, pw) < 0)
+		return false;
+	saveWifiConfigData();
+	return true;
+}
+
+bool WifiUtility::removeWifiCredentials(const char* ssid)
+{
+	for(int i=0; i<networkCount_; i++)
+	{
+		if(strcmp(networks_[i].wifi_ssid, ssid) == 0)
+		{
+			networkCount_--;
+			for(int j=i; j<networkCount_; j++)
+				networks_[j] = networks_[j+1];
+			saveWifiConfigData();
+			return true;
+		}
+	}
+	return false;
+}
+
+int WifiUtility::calcChecksum(uint8_t* address, uint16_t sizeToCalc)
+{
+	uint16_t checkSum = 0;
   
-			if (!FileFS.begin())
-			{     
-				// prevents debug info from the library to hide err message.
-				delay(100);
-      
-#if USE_LITTLEFS
-				D1PRINTLN(F("LittleFS failed!. Please use SPIFFS or EEPROM. Stay forever"));
+	for (uint16_t index = 0; index < sizeToCalc; index++)
+	{
+		checkSum += * ( ( (byte*) address ) + index);
+	}
+
+	return checkSum;
+}
+
+bool WifiUtility::loadWifiConfigData()
+{
+	File file = FileFS.open(WIFI_CONFIG_FILENAME, "r");
+	if(!file && FileFS.exists(WIFI_CONFIG_TEMP_FILENAME))
+		file = FileFS.open(WIFI_CONFIG_TEMP_FILENAME, "r");	//save interrupted between remove and rename, the CRC tells if it is complete
+	D1PRINT(F("Load WiFi config file: "));
+	
+	//reset config structs
+	memset((void *) &WMConfig_,       0, sizeof(WMConfig_));
+	
+	memset((void *) &WM_STA_IPconfig_, 0, sizeof(WM_STA_IPconfig_));
+	
+	networkCount_ = 0;
+	
+	if (!file)
+	{
+		D1PRINTLN(F("failed"));
+		
+		return false;
+	}
+	
+	//whole file in one read, all versions are parsed from the buffer
+	size_t size = file.size();
+	if(size > WIFI_CONFIG_MAX_SIZE)
+	{
+		D1PRINTLN(F("too large"));
+		file.close();
+		return false;
+	}
+#if WU_STATIC_MEMORY
+	static uint8_t fileBuffer[WIFI_CONFIG_MAX_SIZE];
+	uint8_t* buf = fileBuffer;
+#else
+	std::unique_ptr<uint8_t[]> buffer(new uint8_t[size]);
+	uint8_t* buf = buffer.get();
+#endif
+	size_t read = file.readBytes((char *) buf, size);
+	file.close();
+	if(read != size)
+	{
+		D1PRINTLN(F("read failed"));
+		return false;
+	}
+	
+	WiFi_StoreHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(&header, buf, min(size, sizeof(header)));
+	if(size < WIFI_CONFIG_V2_HEADER_SIZE || header.magic != WIFI_CONFIG_MAGIC)
+	{
+		//no header -> original layout, converted to the current version on success
+		bool res = loadLegacyWifiConfigData(buf, size);
+		if(res)
+		{
+			D1PRINTLN(F("Converting WiFi config file to current version"));
+			saveWifiConfigData();
+		}
+		return res;
+	}
+	
+	bool res;
+	if(header.version == 2)
+	{
+		//16 bit byte sum over everything in front of it
+		uint16_t storedChecksum = 0;
+		if(size >= WIFI_CONFIG_V2_HEADER_SIZE + sizeof(storedChecksum))
+			memcpy(&storedChecksum, buf + size - sizeof(storedChecksum), sizeof(storedChecksum));
+		res = size >= WIFI_CONFIG_V2_HEADER_SIZE + sizeof(storedChecksum) && (uint16_t)calcChecksum(buf, size - sizeof(storedChecksum)) == storedChecksum;
+		res = res && parseWifiConfigRecords(buf + WIFI_CONFIG_V2_HEADER_SIZE, size - WIFI_CONFIG_V2_HEADER_SIZE - sizeof(storedChecksum), header.count);
+	}
+	else if(header.version == WIFI_CONFIG_VERSION)
+	{
+		res = size >= sizeof(header) && header.length == size - sizeof(header);
+		if(res)
+		{
+			WiFi_StoreHeader* stored = (WiFi_StoreHeader*)buf;
+			stored->crc = 0;	//buffer is not used afterwards
+			res = crc32Update(0, buf, size) == header.crc;
+		}
+		res = res && parseWifiConfigRecords(buf + sizeof(header), header.length, header.count);
+	}
+	else
+	{
+		D1PRINTLN(F("unknown version"));
+		return false;
+	}
+	
+	if(!res)
+	{
+		D1PRINTLN(F("WiFi config checksum wrong"));
+		memset((void *) &WMConfig_, 0, sizeof(WMConfig_));
+		memset((void *) &WM_STA_IPconfig_, 0, sizeof(WM_STA_IPconfig_));
+		networkCount_ = 0;
+		return false;
+	}
+	
+	savedHistoryState_ = historyState();
+	D1PRINT(F("OK, version ")); D1PRINT(header.version); D1PRINT(F(", ")); D1PRINT(networkCount_); D1PRINTLN(F(" networks"));
+	displayIPConfigStruct(WM_STA_IPconfig_);
+	
+	if(header.version != WIFI_CONFIG_VERSION)
+	{
+		D1PRINTLN(F("Converting WiFi config file to current version"));
+		saveWifiConfigData();
+	}
+	return networkCount_ > 0;
+}
+
+bool WifiUtility::parseWifiConfigRecords(const uint8_t* data, size_t size, uint16_t count)
+{
+	size_t fixedSize = sizeof(WMConfig_.TZ_Name) + sizeof(WMConfig_.TZ) + sizeof(WM_STA_IPconfig_);
+	if(size != fixedSize + (size_t)count*sizeof(WiFi_StoredNetwork))
+		return false;
+	
+	memcpy(WMConfig_.TZ_Name, data, sizeof(WMConfig_.TZ_Name));
+	data += sizeof(WMConfig_.TZ_Name);
+	memcpy(WMConfig_.TZ, data, sizeof(WMConfig_.TZ));
+	data += sizeof(WMConfig_.TZ);
+	memcpy((void *) &WM_STA_IPconfig_, data, sizeof(WM_STA_IPconfig_));
+	data += sizeof(WM_STA_IPconfig_);
+	
+	for(uint16_t i=0; i<count && networkCount_ < MAX_WIFI_CREDENTIALS; i++)	//store may have been built with a larger capacity
+	{
+		memcpy(&networks_[networkCount_++], data, sizeof(WiFi_StoredNetwork));
+		data += sizeof(WiFi_StoredNetwork);
+	}
+	return true;
+}
+
+bool WifiUtility::loadLegacyWifiConfigData(const uint8_t* data, size_t size)
+{
+	if(size < sizeof(WMConfig_) + sizeof(WM_STA_IPconfig_))
+	{
+		D1PRINTLN(F("file too short"));
+		return false;
+	}
+	
+	//fill structs
+	memcpy(&WMConfig_, data, sizeof(WMConfig_));
+	
+	memcpy((void *) &WM_STA_IPconfig_, data + sizeof(WMConfig_), sizeof(WM_STA_IPconfig_));
+	
+	D1PRINTLN(F("OK (version 1)"));
+	
+	if ( WMConfig_.checksum != calcChecksum( (uint8_t*) &WMConfig_, sizeof(WMConfig_) - sizeof(WMConfig_.checksum) ) )
+	{
+		D1PRINTLN(F("WM_config checksum wrong"));
+		return false;
+	}
+	
+	for (uint8_t i = 0; i < NUM_WIFI_CREDENTIALS; i++)
+		addNetwork(WMConfig_.WiFi_Creds[i].wifi_ssid, WMConfig_.WiFi_Creds[i].wifi_pw);
+	
+	displayIPConfigStruct(WM_STA_IPconfig_);
+	
+	return true;
+}
+
+void WifiUtility::saveWifiConfigData()
+{
+	//written to a temporary file and renamed, a reset during the write keeps the old store
+	File file = FileFS.open(WIFI_CONFIG_TEMP_FILENAME, "w");
+	D1PRINTLN(F("Save WiFi config file"));
+	
+	if (file)
+	{
+		WiFi_StoreHeader header;
+		header.magic = WIFI_CONFIG_MAGIC;
+		header.version = WIFI_CONFIG_VERSION;
+		header.count = networkCount_;
+		header.length = sizeof(WMConfig_.TZ_Name) + sizeof(WMConfig_.TZ) + sizeof(WM_STA_IPconfig_) + networkCount_*sizeof(WiFi_StoredNetwork);
+		header.crc = 0;
+		
+		//CRC over the header with crc 0 and everything following it
+		uint32_t crc = crc32Update(0, &header, sizeof(header));
+		crc = crc32Update(crc, WMConfig_.TZ_Name, sizeof(WMConfig_.TZ_Name));
+		crc = crc32Update(crc, WMConfig_.TZ, sizeof(WMConfig_.TZ));
+		crc = crc32Update(crc, &WM_STA_IPconfig_, sizeof(WM_STA_IPconfig_));
+		crc = crc32Update(crc, networks_, networkCount_*sizeof(WiFi_StoredNetwork));
+		header.crc = crc;
+		
+		size_t written = file.write((uint8_t*) &header, sizeof(header));
+		written += file.write((uint8_t*) WMConfig_.TZ_Name, sizeof(WMConfig_.TZ_Name));
+		written += file.write((uint8_t*) WMConfig_.TZ, sizeof(WMConfig_.TZ));
+		
+		displayIPConfigStruct(WM_STA_IPconfig_);
+		
+		written += file.write((uint8_t*) &WM_STA_IPconfig_, sizeof(WM_STA_IPconfig_));
+		written += file.write((uint8_t*) networks_, networkCount_*sizeof(WiFi_StoredNetwork));
+		
+		file.close();
+		if(written != sizeof(header) + header.length)
+		{
+			D1PRINTLN(F("write failed, old file kept"));
+			FileFS.remove(WIFI_CONFIG_TEMP_FILENAME);
+			return;
+		}
+		//LittleFS replaces the target, SPIFFS needs it removed first
+		if(!FileFS.rename(WIFI_CONFIG_TEMP_FILENAME, WIFI_CONFIG_FILENAME))
+		{
+			FileFS.remove(WIFI_CONFIG_FILENAME);
+			if(!FileFS.rename(WIFI_CONFIG_TEMP_FILENAME, WIFI_CONFIG_FILENAME))
+			{
+				D1PRINTLN(F("rename failed"));
+				return;
+			}
+		}
+		savedHistoryState_ = historyState();
+		historySavedMs_ = millis();
+		D1PRINTLN(F("OK"));
+	}
+	else
+	{
+		D1PRINTLN(F("failed"));
+	}
+}
+
+void WifiUtility::saveConnectionHistory()
+{
+	//counters change with every connect, rewriting the file each time would wear the flash
+	if(historyState() == savedHistoryState_ && millis() - historySavedMs_ < WIFI_HISTORY_SAVE_MS)
+	{
+		D2PRINTLN(F("Connection history unchanged, not saved"));
+		return;
+	}
+	saveWifiConfigData();
+}
+
+uint32_t WifiUtility::historyState()
+{
+	//rank of every network plus whether it ever connected and whether its last attempt failed
+	uint8_t state[2*MAX_WIFI_CREDENTIALS];
+	for(int i=0; i<networkCount_; i++)
+	{
+		ulong cost = expectedConnectMs(networks_[i], 0);
+		uint8_t rank = 0;
+		for(int j=0; j<networkCount_; j++)
+		{
+			if(expectedConnectMs(networks_[j], 0) < cost)
+				rank++;
+		}
+		state[2*i] = rank;
+		state[2*i+1] = (networks_[i].successes > 0 ? 1 : 0) | ((failedNetworks_ >> i) & 1) << 1;
+	}
+	return crc32Update(networkCount_, state, 2*networkCount_);
+}
+
+uint32_t WifiUtility::crc32Update(uint32_t crc, const void* data, size_t length)
+{
+#ifdef ESP32
+	return crc32_le(crc, (const uint8_t*) data, length);
+#else
+	//the crc32() of the core is MSB first (CRC-32/BZIP2), this is the reflected CRC-32 of crc32_le so files move between platforms
+	static const uint32_t table[16] = {0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C, 
+										0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+	const uint8_t* bytes = (const uint8_t*) data;
+	crc = ~crc;
+	for(size_t i=0; i<length; i++)
+	{
+		crc ^= bytes[i];
+		crc = (crc >> 4) ^ table[crc & 0x0F];
+		crc = (crc >> 4) ^ table[crc & 0x0F];
+	}
+	return ~crc;
+#endif
+}
+
+
+
+int WifiUtility::findParameterIndex(const char* id)
+{
+	for(int i = 0; i<configParameters_.size();i++) 
+	{
+		if(strcmp(configParameters_[i].id, id) == 0) 
+		{
+			return i;
+		}
+	}
+	D1PRINT(F("Could not find requested parameter '")); D1PRINT(id); D1PRINTLN(F("'"));
+	return -1;	//no match found
+}
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+#ifdef ESP32
+RTC_DATA_ATTR static WU_SleepState rtcSleepState;
+#endif
+
+static constexpr WM_ParamSpec mqttPortSpec = WM_IntParam("MQTT_P", "MQTT Server Port", 1, 65535, "1883");
+
+WifiMqttUtility::WifiMqttUtility(int msgBufferSize) : WifiUtility(), retainedShadow_(false), shadowReplayStartMs_(0), linkProbe_(false), probeSeq_(0), probeSentMs_(0), probeFirstSentMs_(0), 
+																		probeTimeoutTimer_(-1), probeMissed_(0), probeVerified_(false), stableProbes_(0), lastTrafficMs_(0), persistentSession_(false), sessionLoaded_(false), 
+																		heapTelemetryTimer_(-1), sleepCycle_(false), mqttUp_(false), dnsResolvedMs_(0), dnsCacheLoaded_(false), brokerCount_(0), activeBroker_(-1), 
+																		primaryHealthy_(true), primaryChecks_(0), userCallback_(NULL), rawCallback_(NULL), payloadBufferSize_(msgBufferSize), 
+																		payloadBuffer_(new char[msgBufferSize + 1]), remoteConfigPending_(false), otaAckPending_(false), otaRestartPending_(false), transport_(&client_), tlsEnabled_(false), mqtt_(MQTTClient(msgBufferSize))
+{
+	memset((void *) &dnsLookup_, 0, sizeof(dnsLookup_));
+	memset((void *) fallbackLookups_, 0, sizeof(fallbackLookups_));
+	memset(&session_, 0, sizeof(session_));
+	memset(&sessionStats_, 0, sizeof(sessionStats_));
+	memset(wildcardShadow_, 0, sizeof(wildcardShadow_));
+	memset(&otaStatus_, 0, sizeof(otaStatus_));
+	otaMd5_[0] = 0;
+	otaKey_[0] = 0;
+	memset(&shadowStats_, 0, sizeof(shadowStats_));
+	memset(&sleepState_, 0, sizeof(sleepState_));
+	memset(&sleepStats_, 0, sizeof(sleepStats_));
+	memset(&dnsCache_, 0, sizeof(dnsCache_));
+	memset(&transportStats_, 0, sizeof(transportStats_));
+	#ifdef ESP8266
+	tlsTrust_ = NULL;
+	tlsSessionValid_ = false;
+	#endif
+	memset(&dnsStats_, 0, sizeof(dnsStats_));
+	timers_.schedule(MQTT_DNS_CHECK_MS, dnsRefreshJob, this, MQTT_DNS_CHECK_MS);
+	timers_.schedule(MQTT_PRIMARY_CHECK_MS, primaryCheckJob, this, MQTT_PRIMARY_CHECK_MS);
+	
+	//all messages pass through the library first (remote config), then go to the user callback
+	mqtt_.ref = this;
+	mqtt_.onMessageAdvanced(messageReceived);
+	memset(&linkStats_, 0, sizeof(linkStats_));
+	linkStats_.rtoMs = MQTT_PROBE_RTO_INITIAL_MS;
+	keepAliveTimer_ = -1;
+	setKeepAlive(MQTT_KEEPALIVE_S);
+	
+	configRateLimit(WU_CLASS_CONTROL, OUTBOUND_CONTROL_RATE, OUTBOUND_CONTROL_BURST);
+	configRateLimit(WU_CLASS_TELEMETRY, OUTBOUND_TELEMETRY_RATE, OUTBOUND_TELEMETRY_BURST);
+	configRateLimit(WU_CLASS_BULK, OUTBOUND_BULK_RATE, OUTBOUND_BULK_BURST);
+	
+	addParameter(mqttDataID[0], "MQTT Server Adresse", 20);
+	addParameter(mqttPortSpec);
+	addParameter(mqttDataID[2], "MQTT Client ID", 20);
+	addParameter(mqttDataID[3], "MQTT Username", 20);
+	addParameter(mqttDataID[4], "MQTT Key", 40);
+	addParameter(mqttFallbackID, "MQTT Fallback Brokers (host:port,...)", 60);
+	
+#if WU_STATIC_MEMORY
+	subscriptions.reserve(WU_MAX_SUBSCRIPTIONS);
+#else
+	subscriptions.reserve(2);
+#endif
+}
+
+bool WifiMqttUtility::begin()
+{
+	WU_PROFILE(WU_PHASE_BEGIN);
+	armHeapGuard(false);
+	WifiUtility::begin();
+	bool connected = resetMqtt();
+	armHeapGuard(true);
+	return connected;
+}
+
+bool WifiMqttUtility::connectMqtt()
+{
+	WU_PROFILE(WU_PHASE_CONNECT_MQTT);
+	//worst case - no WiFi -> try to reconnect everything
+	updateWifiState(WiFi.status() == WL_CONNECTED);
+	if(!wifiUp_)
+		begin();
+	
+	//check if MQTT server connection is open
+	updateMqttState(transport_->connected());
+	if(!mqttUp_)
+	{
+		D1PRINTLN(F("MQTT not connected, trying to connect."));
+		bool reconnected = resetMqtt();
+		if(reconnected)
+		{
+			D1PRINTLN(F("Connection of MQTT successful!"));
+		}
+		else
+		{
+			D1PRINTLN(F("Connection of MQTT unsuccessful!"));
+		}
+		return reconnected;
+	}
+	
+	D1PRINTLN(F("MQTT connection fine!"));
+	
+	//everything if fine!
+	return true;
+}
+
+bool WifiMqttUtility::resetMqtt()
+{
+	WU_HEAP_SCOPE(WU_HEAP_MQTT);
+	//a failed attempt without a link would mark the primary unhealthy
+	if(WiFi.status() != WL_CONNECTED)
+	{
+		D1PRINTLN(F("WiFi not connected, MQTT connect skipped"));
+		updateMqttState(false);
+		return false;
+	}
+	D1PRINTLN(F("Retrieving MQTT connection data from stored parameters"));
+	//retrieve config values with minimal overhead
+	char* mqttConnectData[5];	//parameters for  [0] server address, [1] server port, [2] client ID, [3] username, [4] password
+#if WU_STATIC_MEMORY
+	char connectBuffers[5][WU_PARAM_VALUE_MAX + 1];
+#endif
+	for(int i=0;i<5;i++)
+	{
+#if WU_STATIC_MEMORY
+		int bufferSize = WU_PARAM_VALUE_MAX + 1;
+		mqttConnectData[i] = connectBuffers[i];
 #else
-				D1PRINTLN(F("SPIFFS failed!. Please use LittleFS or EEPROM. Stay forever"));
+		int bufferSize = getParameterBufferLength(mqttDataID[i]);
+		mqttConnectData[i] = new char[bufferSize];
+#endif
+		getParameter(mqttDataID[i], mqttConnectData[i], bufferSize);
+	}
+	
+	D1PRINT(F("Connecting MQTT with Server ")); D1PRINT(mqttConnectData[0]); D1PRINT(F(":"));D1PRINT(get<int>(mqttDataID[1])); D1PRINT(F(" client ID ")); D1PRINT(mqttConnectData[2]); D1PRINT(F(" Username "));D1PRINTLN(mqttConnectData[3]);
+	D2PRINT(F(" Password")); D1PRINTLN(mqttConnectData[4]);
+
+	//connect client and MQTT handler and resubscribe, primary first unless it is known to be down
+	loadBrokerList();
+	bool connected = false;
+	activeBroker_ = -1;
+	bool triedPrimary = primaryHealthy_ || brokerCount_ < 2;
+	if(triedPrimary)
+		connected = connectBroker(0, mqttConnectData[2], mqttConnectData[3], mqttConnectData[4]);
+	if(!connected && brokerCount_ > 1)
+	{
+		primaryHealthy_ = false;
+		primaryChecks_ = 0;
+		connected = failoverBrokers(mqttConnectData[2], mqttConnectData[3], mqttConnectData[4]);
+		//all fallbacks down, the primary may be back already
+		if(!connected && !triedPrimary)
+			connected = connectBroker(0, mqttConnectData[2], mqttConnectData[3], mqttConnectData[4]);
+	}
+	if(connected)
+	{
+		//a persistent session still has the subscriptions
+		if(!mqtt_.sessionPresent())
+		{
+			for(int i=0;i<subscriptions.size();i++)
+				mqtt_.subscribe(subscriptions[i].topic.c_str());
+		}
+		//probing restarts unverified, the new broker may not allow the probe topic
+		timers_.cancel(probeTimeoutTimer_);
+		char probeTopic[WU_TOPIC_MAX + 1];
+		snprintf(probeTopic, sizeof(probeTopic), "%s%s", MQTT_PROBE_TOPIC_PREFIX, mqttConnectData[2]);
+		probeTopic_ = probeTopic;
+		probeVerified_ = false;
+		probeMissed_ = 0;
+		lastTrafficMs_ = millis();
+		if(linkProbe_)
+			mqtt_.subscribe(probeTopic_.c_str());
+		replaySession();
+		shadowReplayStartMs_ = millis();	//retained messages follow the subscribe
+	}
+#if !WU_STATIC_MEMORY
+	for(int i=0;i<5;i++)
+		delete[] mqttConnectData[i];
 #endif
+	updateMqttState(connected);
+	return connected;
+}
 
-				while (true)
+void WifiMqttUtility::wifiConfigPortal()
+{
+	//the portal and the following reload allocate, as at startup
+	armHeapGuard(false);
+	WifiUtility::wifiConfigPortal();
+	resetMqtt();
+	armHeapGuard(!initializing_);
+}
+
+bool WifiMqttUtility::loop()
+{
+	WU_PROFILE(WU_PHASE_LOOP);
+	checkHeapGuard();
+	loopTimers();
+	loopTriggerPin();
+	loopOutbound();
+	loopDns();
+	if(loopConnectionTimeout())
+	{
+		if(loopWifiConnection())
+		{
+			bool mqttLooped;
+			{
+				WU_PROFILE(WU_PHASE_MQTT_LOOP);
+				mqttLooped = mqtt_.loop();
+			}
+			if(mqttLooped)
+			{
+				updateMqttState(true);
+				loopRemoteConfig();
+				loopOta();
+				return true;
+			}
+			else
+			{
+				updateMqttState(false);
+				if(autoReconnect_)
 				{
-					delay(1);
+					WU_PROFILE(WU_PHASE_RECONNECT);
+					quiet_ = true;
+					resetMqtt();
+					quiet_ = false;
+					bool connected = mqtt_.loop();
+					backoffConnectionCheck(!connected);
+					if(connected)
+						return true;
 				}
+				return false;	//MQTT not connected
 			}
 		}
+		updateMqttState(false);
+		return false;	//WiFi is not connected/cannot be connected
+	}
+	return true;	//nothing to do
+}
+
+uint8_t WifiMqttUtility::parameterSubsystem(const char* id)
+{
+	if(strcmp(mqttFallbackID, id) == 0)
+		return WU_SUBSYSTEM_MQTT;
+	for(int i=0; i<5; i++)
+	{
+		if(strcmp(mqttDataID[i], id) == 0)
+			return WU_SUBSYSTEM_MQTT;
+	}
+	return WifiUtility::parameterSubsystem(id);
+}
+
+void WifiMqttUtility::reloadSubsystems(uint8_t subsystems)
+{
+	WifiUtility::reloadSubsystems(subsystems);
+	if(subsystems & WU_SUBSYSTEM_MQTT)
+	{
+		D1PRINTLN(F("MQTT parameters changed, reconnecting MQTT only"));
+		resetMqtt();
 	}
+}
+
+void WifiMqttUtility::onRoamStart()
+{
+	//publishing is paused by closing the session cleanly, resumed right after the roam
+	if(mqtt_.connected())
+		mqtt_.disconnect();
+	updateMqttState(false);
+}
+
+void WifiMqttUtility::onRoamEnd(bool connected)
+{
+	if(connected)
+		resetMqtt();
+}
+
+void WifiMqttUtility::onAddressChanged()
+{
+	//the broker socket is bound to the old address
+	resetMqtt();
+}
+
+bool WifiMqttUtility::enableOTA(String topic, const char* signingKey)
+{
+	const char* const suffixes[3] = {OTA_BEGIN_SUFFIX, OTA_CHUNK_SUFFIX "+", OTA_END_SUFFIX};
+	char subscription[WU_TOPIC_MAX + sizeof(OTA_CHUNK_SUFFIX "+")];
+	bool res = true;
 	
-	initializing_ = false;	//any changes to the configuration now may necessitate restarting
+	//the key only comes from the sketch, nothing received over MQTT or the portal can change it
+	size_t keyLength = (signingKey == NULL) ? 0 : strlen(signingKey);
+	if(topic != "" && (keyLength < OTA_KEY_MIN_LEN || keyLength > OTA_KEY_MAX_LEN))
+	{
+		D1PRINT(F("Firmware updates need a signing key of ")); D1PRINT(OTA_KEY_MIN_LEN); D1PRINT(F(" to ")); D1PRINT(OTA_KEY_MAX_LEN); D1PRINTLN(F(" characters, disabled"));
+		topic = "";
+		res = false;
+	}
+	memset(otaKey_, 0, sizeof(otaKey_));
+	if(topic != "")
+		memcpy(otaKey_, signingKey, keyLength);
+	for(int i=0; i<3 && otaTopic_ != ""; i++)
+	{
+		snprintf(subscription, sizeof(subscription), "%s%s", otaTopic_.c_str(), suffixes[i]);
+		unsubscribe(subscription);
+	}
+	otaTopic_ = topic;
+	for(int i=0; i<3 && otaTopic_ != ""; i++)
+	{
+		snprintf(subscription, sizeof(subscription), "%s%s", otaTopic_.c_str(), suffixes[i]);
+		res &= subscribe(subscription);
+	}
+	return res;
+}
+
+bool WifiMqttUtility::otaMessage(const char* topic, const char* bytes, int length)
+{
+	size_t baseLength = otaTopic_.length();
+	if(baseLength == 0 || strncmp(topic, otaTopic_.c_str(), baseLength) != 0)
+		return false;
 	
-	////Reset any residual settings
-	if ( (WiFi.status() == WL_CONNECTED) )
+	const char* suffix = topic + baseLength;
+	if(strncmp(suffix, OTA_CHUNK_SUFFIX, strlen(OTA_CHUNK_SUFFIX)) == 0)
 	{
-		D1PRINTLN(F("Restarting, disconnecting WiFi"));
-		WiFi.disconnect();
-		delay(1000);
+		otaChunk(strtoul(suffix + strlen(OTA_CHUNK_SUFFIX), NULL, 10), (const uint8_t*) bytes, length);
+	}
+	else if(strcmp(suffix, OTA_BEGIN_SUFFIX) == 0)
+	{
+		char request[OTA_REQUEST_MAX_LEN];
+		if(length >= (int)sizeof(request))
+		{
+			otaAck("request too long");
+			return true;
+		}
+		memcpy(request, bytes, length);
+		request[length] = 0;
+		otaBegin(request);
+	}
+	else if(strcmp(suffix, OTA_END_SUFFIX) == 0)
+	{
+		otaEnd();
+	}
+	else
+	{
+		return false;	//other topic with the same prefix
+	}
+	holdRadioAwake(POWER_AWAKE_HOLD_MS);	//next chunk follows the ack
+	return true;
+}
+
+void WifiMqttUtility::otaBegin(const char* request)
+{
+#if (ARDUINOJSON_VERSION_MAJOR >= 6)
+	JSON_DOCUMENT(json);
+	if(deserializeJson(json, request))
+	{
+		otaAck("invalid JSON");
+		return;
+	}
+#else
+	JSON_BUFFER(jsonBuffer);
+	JsonObject& json = jsonBuffer.parseObject(request);
+	if(!json.success())
+	{
+		otaAck("invalid JSON");
+		return;
+	}
+#endif
+	uint32_t size = json["size"].as<uint32_t>();
+	const char* md5 = json["md5"].as<const char*>();
+	const char* sha256 = json["sha256"].as<const char*>();
+	const char* signature = json["sig"].as<const char*>();
+	uint8_t digest[OTA_HASH_LEN];
+	if(size == 0 || md5 == NULL || strlen(md5) != 32 || sha256 == NULL || !parseHex(sha256, digest, sizeof(digest)) || signature == NULL)
+	{
+		otaAck("size, md5, sha256 and sig required");
+		return;
+	}
+	if(!otaSignatureValid(size, sha256, signature))
+	{
+		otaAck("invalid signature");
+		return;
 	}
 	
-	WiFi.config(0u, 0u, 0u);
-	//WMConfig_ is reset when wifi data is loaded
-	//wifiMulti_ reset in connectMultiWiFi
-	checkWifiTimeout_ = millis();
-	routerSSID_ = "";
-	routerPass_ = "";
+	//same image again after a reconnect: continue where it stopped
+	if(otaStatus_.active)
+	{
+		if(otaStatus_.size == size && strcasecmp(otaMd5_, md5) == 0 && memcmp(otaSha256_, digest, sizeof(digest)) == 0)
+		{
+			D1PRINT(F("Resuming firmware update at chunk ")); D1PRINTLN(otaStatus_.nextChunk);
+			otaAck();
+			return;
+		}
+		#ifdef ESP8266
+		otaAck("other update running, restart first");	//the updater cannot be reset
+		return;
+		#else
+		otaAbort();
+		#endif
+	}
 	
-	D1PRINT(F("Starting WiFi with "));
+	uint32_t duplicates = otaStatus_.duplicates;
+	uint32_t outOfOrder = otaStatus_.outOfOrder;
+	memset(&otaStatus_, 0, sizeof(otaStatus_));
+	otaStatus_.duplicates = duplicates;
+	otaStatus_.outOfOrder = outOfOrder;
+	if(!Update.begin(size))
+	{
+		otaStatus_.updateError = Update.getError();
+		otaAck("begin failed");
+		return;
+	}
+	if(!Update.setMD5(md5))
+	{
+		otaAbort();
+		otaAck("invalid md5");
+		return;
+	}
+	strcpy(otaMd5_, md5);
+	memcpy(otaSha256_, digest, sizeof(digest));
+#ifdef ESP32
+	mbedtls_sha256_init(&otaHash_);
+	mbedtls_sha256_starts(&otaHash_, 0);
+#else
+	br_sha256_init(&otaHash_);
+#endif
+	otaStatus_.active = true;
+	otaStatus_.size = size;
+	D1PRINT(F("Firmware update started, ")); D1PRINT(size); D1PRINTLN(F(" bytes"));
+	otaAck();
+}
+
+void WifiMqttUtility::otaChunk(uint32_t chunk, const uint8_t* data, int length)
+{
+	if(!otaStatus_.active)
+	{
+		otaAck("not started");
+		return;
+	}
 	
-	if(useDHCP_)
+	//anything but the next chunk only triggers an ack, the sender continues from there
+	if(chunk != otaStatus_.nextChunk)
 	{
-		D1PRINT(F("DHCP "));
+		if(chunk < otaStatus_.nextChunk)
+			otaStatus_.duplicates++;
+		else
+			otaStatus_.outOfOrder++;
+		otaAck();
+		return;
+	}
+	
+	if(otaStatus_.written + length > otaStatus_.size)
+	{
+		otaAbort();
+		otaAck("image larger than announced");
+		return;
+	}
+	if(Update.write((uint8_t*) data, length) != (size_t)length)
+	{
+		otaStatus_.updateError = Update.getError();
+		otaAbort();
+		otaAck("write failed");
+		return;
+	}
+#ifdef ESP32
+	mbedtls_sha256_update(&otaHash_, data, length);
+#else
+	br_sha256_update(&otaHash_, data, length);
+#endif
+	otaStatus_.written += length;
+	otaStatus_.nextChunk++;
+	D3PRINT(F("Firmware chunk ")); D3PRINT(chunk); D3PRINT(F(", ")); D3PRINT(otaStatus_.written); D3PRINT(F("/")); D3PRINTLN(otaStatus_.size);
+	otaAck();
+}
+
+void WifiMqttUtility::otaEnd()
+{
+	if(!otaStatus_.active)
+	{
+		otaAck("not started");
+		return;
+	}
+	if(otaStatus_.written < otaStatus_.size)
+	{
+		otaAck();	//chunks missing, the ack tells which one is next
+		return;
+	}
+	
+	//the signed SHA-256 first, the MD5 announced in begin is checked by the updater
+	uint8_t digest[OTA_HASH_LEN];
+#ifdef ESP32
+	mbedtls_sha256_finish(&otaHash_, digest);
+	mbedtls_sha256_free(&otaHash_);
+#else
+	br_sha256_out(&otaHash_, digest);
+#endif
+	if(memcmp(digest, otaSha256_, sizeof(digest)) != 0)
+	{
+		otaAbort();
+		otaAck("image does not match the signed hash");
+		return;
+	}
+	otaStatus_.active = false;
+	if(!Update.end())
+	{
+		otaStatus_.updateError = Update.getError();
+		otaAck("verification failed");
+		return;
+	}
+	D1PRINTLN(F("Firmware update verified, restarting"));
+	snprintf(otaAck_, sizeof(otaAck_), "{\"ok\":true,\"done\":true,\"written\":%lu}", (unsigned long)otaStatus_.written);
+	otaAckPending_ = true;
+	otaRestartPending_ = true;
+}
+
+void WifiMqttUtility::otaAck(const char* error)
+{
+	//acks are cumulative, a newer one replaces one not sent yet
+	if(error == NULL)
+	{
+		snprintf(otaAck_, sizeof(otaAck_), "{\"ok\":true,\"next\":%lu,\"written\":%lu}", (unsigned long)otaStatus_.nextChunk, (unsigned long)otaStatus_.written);
+	}
+	else
+	{
+		D1PRINT(F("Firmware update: ")); D1PRINTLN(error);
+		snprintf(otaAck_, sizeof(otaAck_), "{\"ok\":false,\"error\":\"%s\",\"code\":%u,\"next\":%lu}", error, (unsigned)otaStatus_.updateError, (unsigned long)otaStatus_.nextChunk);
+	}
+	otaAckPending_ = true;
+}
+
+void WifiMqttUtility::otaAbort()
+{
+#ifdef ESP32
+	if(otaStatus_.active)
+		mbedtls_sha256_free(&otaHash_);
+#endif
+	otaStatus_.active = false;
+	#ifdef ESP32
+	Update.abort();
+	#else
+	//the updater cannot be reset, every later begin() would fail. Restart after the error ack, the image is never activated
+	//without a successful end() and the sender starts over once the node is back
+	otaRestartPending_ = true;
+	#endif
+}
+
+bool WifiMqttUtility::otaSignatureValid(uint32_t size, const char* sha256, const char* signature)
+{
+	uint8_t expected[OTA_HASH_LEN];
+	if(otaKey_[0] == 0 || !parseHex(signature, expected, sizeof(expected)))
+	{
+		D1PRINTLN(F("Firmware update refused, no signing key or no signature"));
+		return false;
+	}
+	
+	//"<size>:<sha256>" with the hash in lower case hex
+	char message[16 + 2*OTA_HASH_LEN];
+	int length = snprintf(message, sizeof(message), "%lu:", (unsigned long)size);
+	for(int i=0; sha256[i] != 0 && length < (int)sizeof(message) - 1; i++)
+		message[length++] = tolower(sha256[i]);
+	message[length] = 0;
+	
+	uint8_t mac[OTA_HASH_LEN];
+#ifdef ESP32
+	if(mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), (const uint8_t*) otaKey_, strlen(otaKey_), (const uint8_t*) message, length, mac) != 0)
+		return false;
+#else
+	br_hmac_key_context keyContext;
+	br_hmac_context context;
+	br_hmac_key_init(&keyContext, &br_sha256_vtable, otaKey_, strlen(otaKey_));
+	br_hmac_init(&context, &keyContext, 0);
+	br_hmac_update(&context, message, length);
+	br_hmac_out(&context, mac);
+#endif
+	//constant time, the sender learns nothing from the ack timing
+	uint8_t difference = 0;
+	for(int i=0; i<OTA_HASH_LEN; i++)
+		difference |= mac[i] ^ expected[i];
+	return difference == 0;
+}
+
+bool WifiMqttUtility::parseHex(const char* hex, uint8_t* out, size_t length)
+{
+	if(strlen(hex) != 2*length)
+		return false;
+	for(size_t i=0; i<2*length; i++)
+	{
+		char digit = tolower(hex[i]);
+		uint8_t value;
+		if(digit >= '0' && digit <= '9')
+			value = digit - '0';
+		else if(digit >= 'a' && digit <= 'f')
+			value = digit - 'a' + 10;
+		else
+			return false;
+		out[i/2] = (i % 2 == 0) ? value << 4 : out[i/2] | value;
+	}
+	return true;
+}
+
+void WifiMqttUtility::loopOta()
+{
+	if(!otaAckPending_)
+		return;
+	otaAckPending_ = false;
+	char ackTopic[WU_TOPIC_MAX + sizeof(OTA_ACK_SUFFIX)];
+	snprintf(ackTopic, sizeof(ackTopic), "%s%s", otaTopic_.c_str(), OTA_ACK_SUFFIX);
+	mqtt_.publish(ackTopic, otaAck_);	//not rate limited, the acks pace the sender
+	if(otaRestartPending_)
+	{
+		otaRestartPending_ = false;
+		timers_.schedule(OTA_RESTART_DELAY_MS, otaRestartJob, this);	//ack is out before the restart
+	}
+}
+
+void WifiMqttUtility::otaRestartJob(void* arg)
+{
+	ESP.restart();
+}
+
+bool WifiMqttUtility::enableRemoteConfig(String topic)
+{
+	if(remoteConfigTopic_ != "")
+		unsubscribe(remoteConfigTopic_.c_str());
+	remoteConfigTopic_ = topic;
+	if(topic == "")
+		return true;
+	return subscribe(remoteConfigTopic_.c_str());
+}
+
+void WifiMqttUtility::messageReceived(MQTTClient *client, char topic[], char bytes[], int length)
+{
+	WifiMqttUtility* self = static_cast<WifiMqttUtility*>(client->ref);
+	
+	//firmware chunks go to flash straight from the client buffer
+	if(self->otaMessage(topic, bytes, length))
+		return;
+	
+	//payload is not terminated in the advanced callback, copy it into the buffer sized with the client
+	if(length > self->payloadBufferSize_)
+		return;
+	char* terminatedPayload = self->payloadBuffer_;
+	memcpy(terminatedPayload, bytes, length);
+	terminatedPayload[length] = 0;
+	
+	if(self->linkProbe_ && self->probeTopic_ == topic)
+	{
+		self->probeEchoed(terminatedPayload);
+		return;
 	}
-	else
+	self->lastTrafficMs_ = millis();
+	
+	if(self->remoteConfigTopic_ != "" && self->remoteConfigTopic_ == topic)
 	{
-		D1PRINT(F("fixed IP "));
+		//the client must not be used inside its callback, handle it in the next loop
+		self->pendingRemoteConfig_ = terminatedPayload;
+		self->remoteConfigPending_ = true;
+		return;
 	}
 	
-	////Load stored data from file, then connect WiFi if possible, otherwise call config portal
-	bool configDataLoaded = loadWifiConfigData();
-	loadConfigFile();
+	if(self->retainedShadow_ && !self->shadowPass(topic, terminatedPayload, length))
+		return;
 	
-
-	if (configDataLoaded)
+	if(self->rawCallback_ != NULL)
+		self->rawCallback_(topic, terminatedPayload, length);
+#if !WU_STATIC_MEMORY
+	if(self->userCallback_ != NULL)
 	{
-		initialConfig_ = false;	//found login data
-#if USE_ESP_WIFIMANAGER_NTP      
-		if ( strlen(WMConfig_.TZ_Name) > 0 )
-		{
-			D1PRINT(F("Current TZ_Name =")); D1PRINT(WMConfig_.TZ_Name); D1PRINT(F(", TZ = ")); D1PRINTLN(WMConfig_.TZ);
-
-	#if ESP8266
-			configTime(WMConfig_.TZ, "pool.ntp.org"); 
-	#else
-			//configTzTime(WMConfig_.TZ, "pool.ntp.org" );
-			configTzTime(WMConfig_.TZ, "time.nist.gov", "0.pool.ntp.org", "1.pool.ntp.org");
-	#endif   
-		}
-		else
-		{
-			D1PRINT(F("Current Timezone is not set. Enter Config Portal to set."));
-		} 
+		String topicString = topic;
+		String payloadString = terminatedPayload;
+		self->userCallback_(topicString, payloadString);
+	}
 #endif
-    
-		connectMultiWiFi();
+}
+
+bool WifiMqttUtility::shadowPass(const char* topic, const char* payload, int length)
+{
+	uint32_t payloadHash = fnvHash(payload, length);
+	bool unchanged = false;
+	
+	//exact subscriptions keep the shadow in the registry, wildcard matches in the slot table
+	int index = -1;
+	for(int i=0; i<subscriptions.size() && index < 0; i++)
+	{
+		if(subscriptions[i].topic == topic)
+			index = i;
+	}
+	if(index >= 0)
+	{
+		MQTT_Subscription &subscription = subscriptions[index];
+		unchanged = subscription.seen && subscription.payloadHash == payloadHash;
+		subscription.payloadHash = payloadHash;
+		subscription.seen = true;
 	}
 	else
 	{
-		D1PRINT(F("Can't read WiFi Config File."));
-		initialConfig_ = true;
-		initSTAIPConfigStruct(WM_STA_IPconfig_);
+		uint32_t topicHash = fnvHash(topic, strlen(topic));
+		topicHash += (topicHash == 0);	//0 marks free slots
+		int slot = 0;
+		for(int i=0; i<MQTT_SHADOW_WILDCARD_SLOTS; i++)
+		{
+			if(wildcardShadow_[i].topicHash == topicHash)
+			{
+				slot = i;
+				unchanged = wildcardShadow_[i].payloadHash == payloadHash;
+				break;
+			}
+			if(wildcardShadow_[i].topicHash == 0 || wildcardShadow_[i].usedMs < wildcardShadow_[slot].usedMs)
+				slot = i;
+		}
+		wildcardShadow_[slot].topicHash = topicHash;
+		wildcardShadow_[slot].payloadHash = payloadHash;
+		wildcardShadow_[slot].usedMs = millis();
 	}
 	
-	if(WiFi.status() != WL_CONNECTED)
-		wifiConfigPortal();
+	//outside the replay window a repeated payload is a real message
+	if(unchanged && millis() - shadowReplayStartMs_ < MQTT_SHADOW_REPLAY_MS)
+	{
+		shadowStats_.suppressed++;
+		return false;
+	}
+	shadowStats_.passed++;
+	return true;
 }
 
-bool WifiUtility::loop()
+uint32_t WifiMqttUtility::fnvHash(const char* data, size_t length)
 {
-	loopTriggerPin();
-	if(loopConnectionTimeout())
-		return loopWifiConnection();
-	return true;
+	//FNV-1a
+	uint32_t hash = 2166136261UL;
+	for(size_t i=0; i<length; i++)
+	{
+		hash ^= (uint8_t)data[i];
+		hash *= 16777619UL;
+	}
+	return hash;
 }
 
-void WifiUtility::loopTriggerPin()
+void WifiMqttUtility::loopRemoteConfig()
 {
-	if(triggerPin_ < 0)		//Assume this means that no trigger pin is selected, doable by configuring a pin <=-2 as trigger pin
+	if(!remoteConfigPending_)
 		return;
-	//check trigger pin -> launch config portal if low
-	if ((digitalRead(triggerPin_) == LOW))
+	remoteConfigPending_ = false;
+	
+	D1PRINTLN(F("Remote config update received"));
+	char error[64];	//only filled on errors
+	
+	//acknowledge before a possible MQTT restart so the sender gets the result on the current connection.
+	//The payload is parsed before anything can receive the next one, no copy needed
+	uint8_t subsystems = 0;
+	int changed = applyParameters(pendingRemoteConfig_.c_str(), error, sizeof(error), subsystems);
+	pendingRemoteConfig_ = "";
+	char ack[96];
+	char ackTopic[WU_TOPIC_MAX + sizeof(REMOTE_CONFIG_ACK_SUFFIX)];
+	if(changed >= 0)
+		snprintf(ack, sizeof(ack), "{\"ok\":true,\"changed\":%d}", changed);
+	else
+		snprintf(ack, sizeof(ack), "{\"ok\":false,\"error\":\"%s\"}", error);
+	snprintf(ackTopic, sizeof(ackTopic), "%s%s", remoteConfigTopic_.c_str(), REMOTE_CONFIG_ACK_SUFFIX);
+	publish(ackTopic, ack, WU_CLASS_CONTROL);
+	reloadSubsystems(subsystems);
+}
+
+bool WifiMqttUtility::brokerAddress(const char* host, IPAddress &ip)
+{
+	if(ip.fromString(host))		//literal address, nothing to resolve
+		return true;
+	if(strlen(host) == 0 || strlen(host) >= MQTT_HOST_MAX_LEN)
+		return false;
+	
+	if(!dnsCacheLoaded_)
+		loadDnsCache();
+	
+	//expired entries are used as well, they are refreshed off the reconnect path
+	if(dnsCache_.ip != 0 && strcmp(dnsCache_.host, host) == 0)
 	{
-		D1PRINTLN(F("Trigger pin low -> call config portal"));
-		wifiConfigPortal();
+		dnsStats_.cacheHits++;
+		ip = IPAddress(dnsCache_.ip);
+		return true;
 	}
+	
+	if(!resolveBroker(host))
+		return false;
+	ip = IPAddress(dnsCache_.ip);
+	return true;
 }
 
-bool WifiUtility::loopConnectionTimeout()
+bool WifiMqttUtility::resolveBroker(const char* host)
 {
-	//detect either timer overflow or elapse of configured time interval
-	ulong currentMillis = millis();
-	bool res = (currentMillis > checkWifiTimeout_) || (lastloop_ > currentMillis);
-	if(res)
-		checkWifiTimeout_ = currentMillis + connectionCheckIntervalMs_;
-	lastloop_ = currentMillis;
-	return res;
+	IPAddress ip;
+	ulong start = millis();
+	if(WiFi.hostByName(host, ip) != 1)
+		ip = IPAddress(0u);
+	return updateDnsCache(host, ip, millis() - start);
 }
 
-bool WifiUtility::loopWifiConnection()
+bool WifiMqttUtility::updateDnsCache(const char* host, IPAddress ip, ulong lookupMs)
 {
-	if (WiFi.status() != WL_CONNECTED)
+	bool resolved = (ip != IPAddress(0u));
+	dnsStats_.lastLookupMs = lookupMs;
+	dnsStats_.maxLookupMs = max(dnsStats_.maxLookupMs, dnsStats_.lastLookupMs);
+	dnsStats_.lookups++;
+	
+	D1PRINT(F("DNS lookup of ")); D1PRINT(host); D1PRINT(resolved ? F(" OK after ") : F(" failed after ")); D1PRINT(dnsStats_.lastLookupMs); D1PRINTLN(F("ms"));
+	if(!resolved)
 	{
-		//D1PRINTLN(F("\nWiFi lost."));
-		if(autoReconnect_)
+		dnsStats_.failures++;
+		return false;
+	}
+	
+	dnsResolvedMs_ = millis();
+	bool changed = (dnsCache_.ip != (uint32_t)ip) || (strcmp(dnsCache_.host, host) != 0);
+	time_t now = time(nullptr);
+	strncpy(dnsCache_.host, host, MQTT_HOST_MAX_LEN - 1);
+	dnsCache_.host[MQTT_HOST_MAX_LEN - 1] = 0;
+	dnsCache_.ip = ip;
+	dnsCache_.resolvedTime = (now > 1451602800) ? (uint32_t)now : 0;
+	dnsCache_.ttlSeconds = MQTT_DNS_TTL_S;
+	
+	//only persist changes to spare the flash
+	if(changed)
+	{
+		dnsCache_.checksum = calcChecksum((uint8_t*) &dnsCache_, sizeof(dnsCache_) - sizeof(dnsCache_.checksum));
+		File file = FileFS.open(MQTT_DNS_FILENAME, "w");
+		if(file)
 		{
-			quiet_ = true;	//potentially called very often, don't spam Serial port
-			connectMultiWiFi();
-			quiet_ = false;
-			
-			if(WiFi.status() == WL_CONNECTED)
-				return true;
+			file.write((uint8_t*) &dnsCache_, sizeof(dnsCache_));
+			file.close();
 		}
-		return false;
 	}
 	return true;
 }
 
-void WifiUtility::wifiConfigPortal()
+void WifiMqttUtility::loadDnsCache()
 {
-	D1PRINTLN(F("\nConfig Portal requested."));
-
-	AsyncWebServer webServer = AsyncWebServer(HTTP_PORT);
-	
-#if ( USING_ESP32_S2 || USING_ESP32_C3 )
-	ESPAsync_WiFiManager ESPAsync_wifiManager(&webServer, NULL, hostname_);
-#else
-	DNSServer dnsServer;
-	ESPAsync_WiFiManager ESPAsync_wifiManager(&webServer, &dnsServer, hostname_);
-#endif
-
-	//Check if there is stored WiFi router/password credentials.
-	//If not found, device will remain in configuration mode until switched off via webserver.
-	D1PRINTLN(F("Opening Configuration Portal. "));
-  
-	routerSSID_ = ESPAsync_wifiManager.WiFi_SSID();
-	routerPass_ = ESPAsync_wifiManager.WiFi_Pass();
-  
-	//Don't permit NULL password
-	if ( !initialConfig_ && (routerSSID_ != "") && (routerPass_ != "") )
+	dnsCacheLoaded_ = true;
+	File file = FileFS.open(MQTT_DNS_FILENAME, "r");
+	if(!file)
+		return;
+	file.readBytes((char *) &dnsCache_, sizeof(dnsCache_));
+	file.close();
+	if(dnsCache_.checksum != calcChecksum((uint8_t*) &dnsCache_, sizeof(dnsCache_) - sizeof(dnsCache_.checksum)))
 	{
-		//If valid AP credential and not DRD, set timeout to configured timeout.
-		ESPAsync_wifiManager.setConfigPortalTimeout(APTimeoutS_);
-		D1PRINT(F("Got stored Credentials. Timeout ")); D1PRINT(String(APTimeoutS_)); D1PRINTLN(F("s."));
+		memset(&dnsCache_, 0, sizeof(dnsCache_));
+		return;
 	}
+	
+	//age from a previous boot only counts with a valid clock, otherwise refresh soon
+	time_t now = time(nullptr);
+	if(now > 1451602800 && dnsCache_.resolvedTime > 0 && (uint32_t)now - dnsCache_.resolvedTime < dnsCache_.ttlSeconds)
+		dnsResolvedMs_ = millis() - ((uint32_t)now - dnsCache_.resolvedTime) * 1000UL;
 	else
-	{
-		ESPAsync_wifiManager.setConfigPortalTimeout(0);
+		dnsResolvedMs_ = millis() - dnsCache_.ttlSeconds * 1000UL - 1;
+}
 
-		D1PRINT(F("No timeout : "));
-	}
+bool WifiMqttUtility::dnsCacheExpired()
+{
+	return (dnsCache_.ip != 0) && (millis() - dnsResolvedMs_ > dnsCache_.ttlSeconds * 1000UL);
+}
 
-	// Extra parameters to be configured
-	// After connecting, parameter.getValue() will get you the configured value
-	// Format: <ID> <Placeholder text> <default value> <length> <custom HTML> <label placement>
+void WifiMqttUtility::dnsRefreshJob(void* arg)
+{
+	static_cast<WifiMqttUtility*>(arg)->refreshBrokerAddress();
+}
 
-	std::unique_ptr<std::unique_ptr<ESPAsync_WMParameter>[]> parameterHandler(new std::unique_ptr<ESPAsync_WMParameter>[configParameters_.size()], 
-																				std::default_delete<std::unique_ptr<ESPAsync_WMParameter>[]>());	//custom deleter not necessary in C++17, but Arduino is mostly C++11
+static void lwipDnsFound(const char* name, const ip_addr_t* addr, void* arg)
+{
+	MQTT_DnsLookup* lookup = (MQTT_DnsLookup*) arg;
+	lookup->ip = (addr != NULL) ? ip4_addr_get_u32(ip_2_ip4(addr)) : 0;
+	lookup->state = MQTT_DNS_DONE;
+}
 
-	for(int i=0; i<configParameters_.size();i++)
+static void lwipDnsStart(void* ctx)
+{
+	MQTT_DnsLookup* lookup = (MQTT_DnsLookup*) ctx;
+	ip_addr_t addr;
+	err_t err = dns_gethostbyname(lookup->host, &addr, lwipDnsFound, lookup);
+	if(err == ERR_OK)	//answered from the lwIP cache
+		lwipDnsFound(lookup->host, &addr, lookup);
+	else if(err != ERR_INPROGRESS)
+		lwipDnsFound(lookup->host, NULL, lookup);
+}
+
+void WifiMqttUtility::refreshBrokerAddress()
+{
+	if(!wifiUp_ || !dnsCacheExpired() || dnsLookup_.state != MQTT_DNS_IDLE)
+		return;
+	
+	//host may have been changed in the meantime
+	if(strcmp(brokers_[0].host, dnsCache_.host) != 0)
+		return;
+	strcpy(dnsLookup_.host, dnsCache_.host);
+	dnsLookup_.startMs = millis();
+	dnsLookup_.state = MQTT_DNS_PENDING;
+	runInLwip(lwipDnsStart, &dnsLookup_);
+}
+
+void WifiMqttUtility::loopDns()
+{
+	if(dnsLookup_.state != MQTT_DNS_DONE)
+		return;
+	dnsLookup_.state = MQTT_DNS_IDLE;
+	if(strcmp(dnsLookup_.host, dnsCache_.host) != 0)	//broker changed while the lookup was running
+		return;
+	uint32_t oldIP = dnsCache_.ip;
+	if(updateDnsCache(dnsLookup_.host, IPAddress(dnsLookup_.ip), millis() - dnsLookup_.startMs) && dnsCache_.ip != oldIP)
 	{
-		parameterHandler[i] = std::unique_ptr<ESPAsync_WMParameter> (new ESPAsync_WMParameter(configParameters_[i].id, configParameters_[i].label, configParameters_[i].preferedDefault(), 
-																								configParameters_[i].length+1, configParameters_[i].customHTML, configParameters_[i].labelPlacement));
-		ESPAsync_wifiManager.addParameter(parameterHandler[i].get());
+		D1PRINTLN(F("Broker address changed"));
+		resetMqtt();
 	}
+}
 
-	ESPAsync_wifiManager.setMinimumSignalQuality(-1);
-
-	// Set config portal channel, default = 1. Use 0 => random channel from 1-13
-	ESPAsync_wifiManager.setConfigPortalChannel(0);
-	
-	D1PRINT(F("Starting configuration portal @ "));
+int WifiMqttUtility::loadBrokerList()
+{
+	memset(brokers_, 0, sizeof(brokers_));
+	getParameter(mqttDataID[0], brokers_[0].host, MQTT_HOST_MAX_LEN);
+	brokers_[0].port = get<int>(mqttDataID[1]);	//port is validated and parsed when loaded
+	brokerCount_ = 1;
 	
-	if(useCustomAPIP_)
+	//"host[:port],host[:port]" parsed in place
+	int index = findParameterIndex(mqttFallbackID);
+	const char* list = (index < 0) ? "" : configParameters_[index].value.c_str();
+	while(*list != 0 && brokerCount_ < MQTT_MAX_BROKERS)
 	{
-		ESPAsync_wifiManager.setAPStaticIPConfig(WM_AP_IPconfig_);
-		D1PRINT(WM_AP_IPconfig_._ap_static_ip);
+		while(*list == ' ')
+			list++;
+		size_t entryLength = strcspn(list, ",");
+		size_t hostLength = strcspn(list, ":,");
+		while(hostLength > 0 && list[hostLength - 1] == ' ')
+			hostLength--;
+		long port = (list[hostLength] == ':') ? strtol(list + hostLength + 1, NULL, 10) : brokers_[0].port;
+		
+		if(hostLength == 0 || hostLength >= MQTT_HOST_MAX_LEN || port <= 0 || port > 65535)
+		{
+			D1PRINT(F("Ignoring invalid fallback broker entry ")); D1PRINTLN(brokerCount_);
+		}
+		else
+		{
+			memcpy(brokers_[brokerCount_].host, list, hostLength);
+			brokers_[brokerCount_].host[hostLength] = 0;
+			brokers_[brokerCount_].port = port;
+			brokerCount_++;
+		}
+		list += entryLength;
+		if(*list == ',')
+			list++;
 	}
+	return brokerCount_;
+}
+
+bool WifiMqttUtility::connectBroker(int index, const char* clientID, const char* user, const char* pw, IPAddress resolved)
+{
+	MQTT_Broker &broker = brokers_[index];
+	D1PRINT(F("Connecting MQTT broker ")); D1PRINT(broker.host); D1PRINT(F(":")); D1PRINTLN(broker.port);
+	
+	//primary address comes from the DNS cache, fallbacks are resolved by the failover
+	IPAddress brokerIP = resolved;
+	bool useAddress = (index == 0) ? brokerAddress(broker.host, brokerIP) : (brokerIP != IPAddress(0u) || brokerIP.fromString(broker.host));
+	if(useAddress)
+		mqtt_.begin(brokerIP, broker.port, *transport_);
 	else
+		mqtt_.begin(broker.host, broker.port, *transport_);
+	
+	//transport is connected here to time the (TLS) handshake, MQTT skips its own connect
+	bool connected = connectTransport(broker, useAddress, brokerIP) && mqtt_.connect(clientID, user, pw, true);
+	if(connected)
 	{
-		D1PRINT(F("192.168.4.1"));
+		activeBroker_ = index;
+		if(index == 0)
+			primaryHealthy_ = true;
 	}
-	
-	ESPAsync_wifiManager.setSTAStaticIPConfig(WM_STA_IPconfig_);	//populate fixed IP data in portal
-
-#if USING_CORS_FEATURE
-	ESPAsync_wifiManager.setCORSHeader("Your Access-Control-Allow-Origin");
-#endif
-
-	// Start an access point
-	// and goes into a blocking loop awaiting configuration.
-	// Once the user leaves the portal with the exit button
-	// processing will continue
-	// SSID to uppercase
-	configSSID_.toUpperCase();
-	configPassword_ = "My" + configSSID_;
+	else if(index == 0 && dnsCache_.ip != 0)
+		dnsResolvedMs_ = millis() - MQTT_DNS_TTL_S*1000UL - 1;	//address may be stale, re-resolve with the next refresh
+	return connected;
+}
 
-	D1PRINT(F(", SSID = "));
-	D1PRINT(configSSID_);
-	D1PRINT(F(", PWD = "));
-	D1PRINTLN(configPassword_);
-  
-	if (!ESPAsync_wifiManager.startConfigPortal((const char *) configSSID_.c_str(), configPassword_.c_str()))
+bool WifiMqttUtility::failoverBrokers(const char* clientID, const char* user, const char* pw)
+{
+	D1PRINTLN(F("Primary broker unavailable, trying fallback brokers"));
+	
+	//all fallback names are looked up at once, a dead name costs one DNS timeout instead of one per broker
+	IPAddress ips[MQTT_MAX_BROKERS];
+	for(int i=1; i<brokerCount_; i++)
 	{
-		D1PRINT(F("Not connected to WiFi but continuing anyway."));
+		MQTT_DnsLookup &lookup = fallbackLookups_[i-1];
+		if(ips[i].fromString(brokers_[i].host) || lookup.state == MQTT_DNS_PENDING)	//literal address or an earlier lookup still running
+			continue;
+		strcpy(lookup.host, brokers_[i].host);
+		lookup.startMs = millis();
+		lookup.state = MQTT_DNS_PENDING;
+		runInLwip(lwipDnsStart, &lookup);
 	}
-	else
+	
+	ulong start = millis();
+	bool pending = true;
+	while(pending && millis() - start < MQTT_FAILOVER_DNS_MS)
 	{
-		// If you get here you have connected to the WiFi
-		D1PRINT(F("Connected...yeey :)"));
-		D1PRINT(F("Local IP: "));
-		D1PRINTLN(WiFi.localIP());
+		pending = false;
+		for(int i=1; i<brokerCount_; i++)
+			pending = pending || (fallbackLookups_[i-1].state == MQTT_DNS_PENDING);
+		if(pending)
+			delay(5);
 	}
-
-	// Only clear then save data if CP entered and with new valid Credentials
-	// No CP => stored getSSID() = ""
-	if ( String(ESPAsync_wifiManager.getSSID(0)) != "" && String(ESPAsync_wifiManager.getSSID(1)) != "" )
+	
+	//fallbacks are listed in order of preference
+	for(int i=1; i<brokerCount_; i++)
 	{
-		// Stored  for later usage, but clear first
-		memset(&WMConfig_, 0, sizeof(WMConfig_));
-    
-		for (uint8_t i = 0; i < NUM_WIFI_CREDENTIALS; i++)
-		{
-			String tempSSID = ESPAsync_wifiManager.getSSID(i);
-			String tempPW   = ESPAsync_wifiManager.getPW(i);
-			
-			if (strlen(tempSSID.c_str()) < sizeof(WMConfig_.WiFi_Creds[i].wifi_ssid) - 1)
-				strcpy(WMConfig_.WiFi_Creds[i].wifi_ssid, tempSSID.c_str());
-			else
-				strncpy(WMConfig_.WiFi_Creds[i].wifi_ssid, tempSSID.c_str(), sizeof(WMConfig_.WiFi_Creds[i].wifi_ssid) - 1);
-  
-			if (strlen(tempPW.c_str()) < sizeof(WMConfig_.WiFi_Creds[i].wifi_pw) - 1)
-				strcpy(WMConfig_.WiFi_Creds[i].wifi_pw, tempPW.c_str());
-			else
-				strncpy(WMConfig_.WiFi_Creds[i].wifi_pw, tempPW.c_str(), sizeof(WMConfig_.WiFi_Creds[i].wifi_pw) - 1);  
-  
-			// Don't permit NULL SSID and password len < MIN_AP_PASSWORD_SIZE (8)
-			if ( (String(WMConfig_.WiFi_Creds[i].wifi_ssid) != "") && (strlen(WMConfig_.WiFi_Creds[i].wifi_pw) >= MIN_AP_PASSWORD_SIZE) )
-			{
-				D1PRINT(F("* Add SSID = ")); D1PRINTLN(WMConfig_.WiFi_Creds[i].wifi_ssid); D3PRINT(F(", PW = ")); D3PRINTLN(WMConfig_.WiFi_Creds[i].wifi_pw );
-				wifiMulti_.addAP(WMConfig_.WiFi_Creds[i].wifi_ssid, WMConfig_.WiFi_Creds[i].wifi_pw);
-			}
-		}
-
-#if USE_ESP_WIFIMANAGER_NTP      
-		String tempTZ   = ESPAsync_wifiManager.getTimezoneName();
-
-		if (strlen(tempTZ.c_str()) < sizeof(WMConfig_.TZ_Name) - 1)
-			strcpy(WMConfig_.TZ_Name, tempTZ.c_str());
-		else
-			strncpy(WMConfig_.TZ_Name, tempTZ.c_str(), sizeof(WMConfig_.TZ_Name) - 1);
-
-		const char * TZ_Result = ESPAsync_wifiManager.getTZ(WMConfig_.TZ_Name);
-    
-		if (strlen(TZ_Result) < sizeof(WMConfig_.TZ) - 1)
-			strcpy(WMConfig_.TZ, TZ_Result);
-		else
-			strncpy(WMConfig_.TZ, TZ_Result, sizeof(WMConfig_.TZ_Name) - 1);
-         
-		if ( strlen(WMConfig_.TZ_Name) > 0 )
+		MQTT_DnsLookup &lookup = fallbackLookups_[i-1];
+		if(lookup.state == MQTT_DNS_DONE)
 		{
-			D1PRINT(F("Saving current TZ_Name =")); D1PRINT(WMConfig_.TZ_Name); D1PRINT(F(", TZ = ")); D1PRINTLN(WMConfig_.TZ);
-
-#if ESP8266
-			configTime(WMConfig_.TZ, "pool.ntp.org"); 
-#else
-			//configTzTime(WMConfig_.TZ, "pool.ntp.org" );
-			configTzTime(WMConfig_.TZ, "time.nist.gov", "0.pool.ntp.org", "1.pool.ntp.org");
-#endif
+			lookup.state = MQTT_DNS_IDLE;
+			if(strcmp(lookup.host, brokers_[i].host) == 0)
+				ips[i] = IPAddress(lookup.ip);
 		}
-		else
+		if(ips[i] == IPAddress(0u))
 		{
-			D1PRINT(F("Current Timezone Name is not set. Enter Config Portal to set."));
+			D1PRINT(F("Fallback broker ")); D1PRINT(brokers_[i].host); D1PRINTLN(F(" not resolved"));
+			continue;
 		}
-#endif 
+		if(connectBroker(i, clientID, user, pw, ips[i]))
+			return true;
 	}
+	return false;
+}
+
+void WifiMqttUtility::primaryCheckJob(void* arg)
+{
+	static_cast<WifiMqttUtility*>(arg)->checkPrimaryBroker();
+}
+
+void WifiMqttUtility::checkPrimaryBroker()
+{
+	//also while no broker is connected, otherwise nothing would try the primary again
+	if(activeBroker_ == 0 || primaryHealthy_ || !wifiUp_)
+		return;
 	
-	ESPAsync_wifiManager.getSTAStaticIPConfig(WM_STA_IPconfig_);
-    saveWifiConfigData();
+	//enough successful probes since the failover -> move back to the primary
+	if(primaryChecks_ >= MQTT_PRIMARY_HEALTHY_CHECKS)
+	{
+		D1PRINTLN(F("Primary broker healthy again, moving back"));
+		primaryHealthy_ = true;
+		primaryChecks_ = 0;
+		if(mqtt_.connected())
+			mqtt_.disconnect();
+		resetMqtt();
+		return;
+	}
 	
-	//retrieve parameter values
-	for(int i=0; i<configParameters_.size();i++)
+	IPAddress ip;
+	if(!brokerAddress(brokers_[0].host, ip))
 	{
-		//strcpy(configParameters_[i].value.get(), parameterHandler[i]->getValue());
-		configParameters_[i].value = String(parameterHandler[i]->getValue());
-		D2PRINT(F("Parameter '")); D2PRINT(configParameters_[i].id); D2PRINT(F("' from the portal has value '")); D2PRINT(configParameters_[i].value); D2PRINTLN(F("'"));
+		primaryChecks_ = 0;
+		return;
 	}
-	saveConfigFile();
-	begin();	//reset WiFi to enforce fixed/dynamic IP (otherwise fixed IP may be used if one is/was entered in portal)
+	//non-blocking probe, the result is evaluated with the next check
+	primaryProbe_.onConnect([this](void* arg, AsyncClient* client) { primaryChecks_++; client->close(true); }, NULL);
+	primaryProbe_.onError([this](void* arg, AsyncClient* client, int8_t error) { primaryChecks_ = 0; }, NULL);
+	if(!primaryProbe_.connect(ip, brokers_[0].port))
+		primaryChecks_ = 0;
 }
 
-bool WifiUtility::loadConfigFile() 
+void WifiMqttUtility::configTLS(const char* caCert)
 {
-	// this opens the config file in read-mode
-	File f = FileFS.open(CONFIG_FILENAME, "r");
-
-	if (!f)
+	#ifdef ESP8266
+	if(caCert)
 	{
-		D1PRINTLN(F("Config File not found"));
-		return false;
+		delete tlsTrust_;
+		tlsTrust_ = new BearSSL::X509List(caCert);
+		secureClient_.setTrustAnchors(tlsTrust_);
 	}
 	else
-	{
-		// we could open the file
-		size_t size = f.size();
-		// Allocate a buffer to store contents of the file.
-		std::unique_ptr<char[]> buf(new char[size + 1], std::default_delete<char[]>());	//again, Arduino mostly based on C++11 (not sure custom deleter for arrays is necessary)
+		secureClient_.setInsecure();
+	secureClient_.setSession(&tlsSession_);
+	loadTlsSession();
+	#else
+	//no session API in the ESP32 client, only the handshake time is reported
+	if(caCert)
+		secureClient_.setCACert(caCert);
+	else
+		secureClient_.setInsecure();
+	#endif
+	transport_ = &secureClient_;
+	tlsEnabled_ = true;
+}
 
-		// Read and store file contents in buf
-		f.readBytes(buf.get(), size);
-		// Closing file
-		f.close();
-		// Using dynamic JSON buffer which is not the recommended memory model, but anyway
-		// See https://github.com/bblanchon/ArduinoJson/wiki/Memory%20model
+bool WifiMqttUtility::connectTransport(const MQTT_Broker &broker, bool useAddress, IPAddress ip)
+{
+	if(transport_->connected())
+		transport_->stop();
 	
-		D2PRINTLN(F("Parsing the following from the config file:"));
-#if (ARDUINOJSON_VERSION_MAJOR >= 6)
-
-		DynamicJsonDocument json(1024);
-		auto deserializeError = deserializeJson(json, buf.get());
-    
-		if ( deserializeError )
+	#ifdef ESP8266
+	uint8_t cachedSession[sizeof(BearSSL::Session)];
+	memcpy(cachedSession, &tlsSession_, sizeof(cachedSession));
+	#endif
+	
+	//TLS needs the host name for SNI and certificate verification
+	ulong start = millis();
+	int ret = (useAddress && !tlsEnabled_) ? transport_->connect(ip, broker.port) : transport_->connect(broker.host, broker.port);
+	ulong duration = millis() - start;
+	if(ret <= 0)
+	{
+		D1PRINT(F("Transport connect failed after ")); D1PRINT(duration); D1PRINTLN(F("ms"));
+		return false;
+	}
+	
+	transportStats_.connects++;
+	transportStats_.lastConnectMs = duration;
+	transportStats_.maxConnectMs = max(transportStats_.maxConnectMs, duration);
+	D1PRINT(tlsEnabled_ ? F("TLS handshake ") : F("TCP connect ")); D1PRINT(duration); D1PRINT(F("ms"));
+	
+	#ifdef ESP8266
+	//unchanged session parameters mean the server accepted the cached session
+	if(tlsEnabled_)
+	{
+		if(tlsSessionValid_ && memcmp(cachedSession, &tlsSession_, sizeof(cachedSession)) == 0)
 		{
-			D1PRINTLN(F("JSON parseObject() failed"));
-			return false;
+			transportStats_.resumed++;
+			D1PRINT(F(", session resumed"));
 		}
-		
-		if(debuglevel_ >= 2)
-			serializeJson(json, Serial);
-    
-#else
+		else
+			storeTlsSession();
+	}
+	#endif
+	D1PRINTLN();
+	return true;
+}
 
-		DynamicJsonBuffer jsonBuffer;
-		// Parse JSON string
-		JsonObject& json = jsonBuffer.parseObject(buf.get());
-    
-		// Test if parsing succeeds.
-		if (!json.success())
-		{
-			D1PRINTLN(F("JSON parseObject() failed"));
-			return false;
-		}
-		
-		if(debuglevel_ >= 2)
-			json.printTo(Serial);
-    
-#endif
+void WifiMqttUtility::loadTlsSession()
+{
+	#ifdef ESP8266
+	uint32_t data[(sizeof(BearSSL::Session) + 3)/4 + 2];
+	if(!ESP.rtcUserMemoryRead(TLS_SESSION_RTC_OFFSET, data, sizeof(data)))
+		return;
+	if(data[0] != TLS_SESSION_MAGIC || data[1] != (uint32_t)calcChecksum((uint8_t*)&data[2], sizeof(BearSSL::Session)))
+		return;
+	memcpy(&tlsSession_, &data[2], sizeof(BearSSL::Session));
+	tlsSessionValid_ = true;
+	D1PRINTLN(F("TLS session loaded from RTC memory"));
+	#endif
+}
 
-		// Parse all config file parameters, override
-		// local config variables with parsed values
-		for(int i=0; i<configParameters_.size(); i++)
-		{
-			//does not reset old values if none is found in the file - expected behavior?
-			if(json.containsKey(configParameters_[i].id))
-			{
-				configParameters_[i].value = (const char*)json[configParameters_[i].id];
-			}
-			else
-			{
-				D1PRINT(F("Could not find parameter '"));
-				D1PRINT(configParameters_[i].id);
-				D1PRINTLN(F("' stored in flash. Old value kept."));
-			}
-		}
+void WifiMqttUtility::storeTlsSession()
+{
+	#ifdef ESP8266
+	uint32_t data[(sizeof(BearSSL::Session) + 3)/4 + 2];
+	memset(data, 0, sizeof(data));
+	memcpy(&data[2], &tlsSession_, sizeof(BearSSL::Session));
+	data[0] = TLS_SESSION_MAGIC;
+	data[1] = (uint32_t)calcChecksum((uint8_t*)&data[2], sizeof(BearSSL::Session));
+	tlsSessionValid_ = ESP.rtcUserMemoryWrite(TLS_SESSION_RTC_OFFSET, data, sizeof(data));
+	#endif
+}
+
+void WifiMqttUtility::keepAliveJob(void* arg)
+{
+	//keep the MQTT connection serviced even if the connection check interval is longer than the keepalive
+	WifiMqttUtility* self = static_cast<WifiMqttUtility*>(arg);
+	if(self->mqtt_.connected())
+	{
+		self->mqtt_.loop();
+		self->sendProbe();
 	}
- 
-	D1PRINTLN(F("\nConfig File successfully parsed"));
-  
-	return true;
 }
 
-bool WifiUtility::saveConfigFile() 
+void WifiMqttUtility::setKeepAlive(uint16_t seconds)
 {
-	D1PRINTLN(F("Saving Config File"));
+	linkStats_.keepAliveS = seconds;
+	mqtt_.setKeepAlive(seconds);
+	if(keepAliveTimer_ >= 0)
+		timers_.cancel(keepAliveTimer_);
+	keepAliveTimer_ = timers_.schedule(seconds*1000UL/2, keepAliveJob, this, seconds*1000UL/2);
+	if(wifiUp_)
+		applyPowerPolicy();	//listen interval follows the keepalive
+}
 
-#if (ARDUINOJSON_VERSION_MAJOR >= 6)
-	DynamicJsonDocument json(1024);
-#else
-	DynamicJsonBuffer jsonBuffer;
-	JsonObject& json = jsonBuffer.createObject();
-#endif
+void WifiMqttUtility::sendProbe()
+{
+	//one probe in flight at a time
+	if(!linkProbe_ || probeTopic_ == "" || timers_.isScheduled(probeTimeoutTimer_))
+		return;
+	probeSeq_++;
+	probeSentMs_ = millis();
+	if(probeMissed_ == 0)
+		probeFirstSentMs_ = probeSentMs_;
+	linkStats_.probesSent++;
+	holdRadioAwake(linkStats_.rtoMs << probeMissed_);	//no beacon wait in the measured RTT
+	char seq[11];
+	snprintf(seq, sizeof(seq), "%lu", (unsigned long)probeSeq_);
+	mqtt_.publish(probeTopic_.c_str(), seq);
+	probeTimeoutTimer_ = timers_.schedule(linkStats_.rtoMs << probeMissed_, probeTimeoutJob, this);
+}
+
+void WifiMqttUtility::probeEchoed(const char* payload)
+{
+	if(strtoul(payload, NULL, 10) != probeSeq_ || !timers_.isScheduled(probeTimeoutTimer_))
+		return;	//late echo of a probe already counted as missed
+	timers_.cancel(probeTimeoutTimer_);
 	
-	// JSONify local configuration parameters
-	for(int i=0; i<configParameters_.size(); i++)
+	//samples of retransmitted probes are ambiguous (Karn), only the timeout is reset
+	ulong rtt = millis() - probeSentMs_;
+	if(probeMissed_ == 0)
 	{
-		if(strcmp(configParameters_[i].id, "") == 0)
-			continue;
-		json[configParameters_[i].id] = configParameters_[i].value.c_str();
+		if(linkStats_.probesAnswered == 0)
+		{
+			linkStats_.srttMs = rtt;
+			linkStats_.rttvarMs = rtt/2;
+			linkStats_.minRttMs = rtt;
+		}
+		else
+		{
+			ulong delta = (rtt > linkStats_.srttMs) ? rtt - linkStats_.srttMs : linkStats_.srttMs - rtt;
+			linkStats_.rttvarMs = (3*linkStats_.rttvarMs + delta)/4;
+			linkStats_.srttMs = (7*linkStats_.srttMs + rtt)/8;
+		}
+		linkStats_.minRttMs = min(linkStats_.minRttMs, rtt);
+		linkStats_.maxRttMs = max(linkStats_.maxRttMs, rtt);
+		linkStats_.rtoMs = constrain(linkStats_.srttMs + max((ulong)TIMER_WHEEL_TICK_MS, 4*linkStats_.rttvarMs), MQTT_PROBE_RTO_MIN_MS, MQTT_PROBE_RTO_MAX_MS);
 	}
+	linkStats_.probesAnswered++;
+	probeMissed_ = 0;
+	probeVerified_ = true;
+	ulong idleS = (probeFirstSentMs_ - lastTrafficMs_)/1000;
+	if(lastTrafficMs_ != 0 && idleS > linkStats_.longestIdleS)
+		linkStats_.longestIdleS = idleS;
+	lastTrafficMs_ = millis();
+	D3PRINT(F("Probe RTT ")); D3PRINT(rtt); D3PRINT(F("ms, SRTT ")); D3PRINT(linkStats_.srttMs); D3PRINT(F("ms, RTO ")); D3PRINTLN(linkStats_.rtoMs);
 	
-	// Open file for writing
-	File f = FileFS.open(CONFIG_FILENAME, "w");
-
-	if (!f)
+	//a stable link allows a longer keepalive, below the idle time at which a link was lost before
+	if(++stableProbes_ >= MQTT_KEEPALIVE_STABLE_PROBES)
 	{
-		D1PRINTLN(F("Failed to open Config File for writing"));
-		return false;
+		stableProbes_ = 0;
+		uint16_t keepAlive = min(linkStats_.keepAliveS + MQTT_KEEPALIVE_STEP_S, MQTT_KEEPALIVE_MAX_S);
+		if(linkStats_.shortestLostIdleS != 0 && keepAlive/2 >= linkStats_.shortestLostIdleS)
+			return;
+		if(keepAlive != linkStats_.keepAliveS)
+		{
+			D1PRINT(F("Increasing MQTT keepalive to ")); D1PRINTLN(keepAlive);
+			setKeepAlive(keepAlive);
+		}
 	}
-	
-	D2PRINTLN(F("Writing the following to the config file:"));
-#if (ARDUINOJSON_VERSION_MAJOR >= 6)
-	if(debuglevel_ >= 2)
-		serializeJsonPretty(json, Serial);
-	// Write data to file and close it
-	serializeJson(json, f);
-#else
-	if(debuglevel_ >= 2)
-		json.prettyPrintTo(Serial);
-	// Write data to file and close it
-	json.printTo(f);
-#endif
-
-	f.close();
-
-	D1PRINTLN(F("\nConfig File successfully saved"));
-	return true;
 }
 
-#if USE_ESP_WIFIMANAGER_NTP
-
-void WifiUtility::printLocalTime()
+bool WifiMqttUtility::beginSleepCycle()
 {
-	#if ESP8266
-	static time_t now;
+	sleepCycle_ = true;
+	mqtt_.setCleanSession(false);	//broker keeps subscriptions and QoS1 messages while asleep
 	
-	now = time(nullptr);
+	bool stateValid = readSleepState();
+	sleepStats_.wakeCount = sleepState_.wakeCount;
+	sleepStats_.fastWakes = sleepState_.fastWakes;
+	sleepStats_.lastWakeToSleepMs = sleepState_.lastWakeToSleepMs;
+	D1PRINT(F("Wake ")); D1PRINT(sleepState_.wakeCount); D1PRINT(F(", last cycle awake ")); D1PRINT(sleepState_.lastWakeToSleepMs); D1PRINTLN(F("ms"));
 	
-	if ( now > 1451602800 )
+	bool connected;
+	if(stateValid && fastWake())
 	{
-		Serial.print(F("Local Date/Time: "));
-		Serial.print(ctime(&now));
+		sleepStats_.fastWakes = ++sleepState_.fastWakes;
+		connected = true;
+		armHeapGuard(true);
 	}
-	#else
-	struct tm timeinfo;
-
-	getLocalTime( &timeinfo );
-
-	// Valid only if year > 2000. 
-	// You can get from timeinfo : tm_year, tm_mon, tm_mday, tm_hour, tm_min, tm_sec
-	if (timeinfo.tm_year > 100 )
+	else
 	{
-		Serial.print(F("Local Date/Time: "));
-		Serial.print( asctime( &timeinfo ) );
+		D1PRINTLN(F("No usable sleep state, full start"));
+		connected = begin();
 	}
-	#endif
+	sleepStats_.wakeToConnectMs = millis();
+	D1PRINT(F("Connected after ")); D1PRINT(sleepStats_.wakeToConnectMs); D1PRINTLN(F("ms since wake"));
+	return connected;
 }
 
-#endif
-
-
-void WifiUtility::initAPIPConfigStruct(WiFi_AP_IPConfig &in_WM_AP_IPconfig)
+bool WifiMqttUtility::fastWake()
 {
-	in_WM_AP_IPconfig._ap_static_ip   = APStaticIP_;
-	in_WM_AP_IPconfig._ap_static_gw   = APStaticGW_;
-	in_WM_AP_IPconfig._ap_static_sn   = APStaticSN_;
+	//parameters as parsed before the last sleep, no JSON. The filesystem is mounted for the session journal
+	if(!unpackParameters())
+		return false;
+	mountFilesystem();
+	initializing_ = false;
+	attachTriggerPin();
+	
+	//last AP and lease, no scan and no DHCP exchange while the lease is young enough
+	WiFi.persistent(false);
+	WiFi.mode(WIFI_STA);
+	if(sleepState_.leaseSeconds == 0 || sleepState_.leaseAgeS < sleepState_.leaseSeconds/2)
+		WiFi.config(IPAddress(sleepState_.ip), IPAddress(sleepState_.gateway), IPAddress(sleepState_.subnet), IPAddress(sleepState_.dns1), IPAddress(sleepState_.dns2));
+	else
+		WiFi.config(0u, 0u, 0u);
+	ulong start = millis();
+	WiFi.begin(sleepState_.ssid, sleepState_.pw, sleepState_.channel, sleepState_.bssid);
+	while(WiFi.status() != WL_CONNECTED && (millis() - start) < WIFI_CONNECT_TIMEOUT_MS)
+		delay(WIFI_CONNECT_POLL_MS / 10);
+	if(WiFi.status() != WL_CONNECTED)
+	{
+		D1PRINTLN(F("Fast wake: AP not reachable"));
+		WiFi.disconnect();
+		return false;
+	}
+	updateWifiState(true);
+	
+	//broker address as resolved before the sleep
+	memset(&dnsCache_, 0, sizeof(dnsCache_));
+	getParameter(mqttDataID[0], dnsCache_.host, MQTT_HOST_MAX_LEN);
+	dnsCache_.ip = sleepState_.brokerIP;
+	dnsCache_.ttlSeconds = MQTT_DNS_TTL_S;
+	dnsResolvedMs_ = millis();
+	dnsCacheLoaded_ = true;
+	return resetMqtt();
 }
 
-void WifiUtility::initSTAIPConfigStruct(WiFi_STA_IPConfig &in_WM_STA_IPconfig)
+void WifiMqttUtility::sleep(ulong durationMs)
 {
-	in_WM_STA_IPconfig._sta_static_ip   = IPAddress(0, 0, 0, 0);
-	in_WM_STA_IPconfig._sta_static_gw   = IPAddress(192, 168, 2, 1);
-	in_WM_STA_IPconfig._sta_static_sn   = IPAddress(255, 255, 255, 0);
-	in_WM_STA_IPconfig._sta_static_dns1 = in_WM_STA_IPconfig._sta_static_gw;
-	in_WM_STA_IPconfig._sta_static_dns2 = IPAddress(8, 8, 8, 8);
+	loopOutbound();
+	captureSleepState(durationMs);
+	
+	//DISCONNECT keeps the persistent session, and flushes what was published
+	mqtt_.disconnect();
+	transport_->stop();
+	writeSleepState();
+	D1PRINT(F("Entering deep sleep for ")); D1PRINT(durationMs); D1PRINT(F("ms, awake ")); D1PRINT(sleepState_.lastWakeToSleepMs); D1PRINTLN(F("ms"));
+	
+	#ifdef ESP8266
+	ESP.deepSleep((uint64_t)durationMs*1000);
+	#else
+	esp_sleep_enable_timer_wakeup((uint64_t)durationMs*1000);
+	esp_deep_sleep_start();
+	#endif
 }
 
-void WifiUtility::displayIPConfigStruct(WiFi_STA_IPConfig in_WM_STA_IPconfig)
+void WifiMqttUtility::captureSleepState(ulong sleepMs)
 {
-	D1PRINT(F("stationIP = ")); D1PRINT(in_WM_STA_IPconfig._sta_static_ip); D1PRINT(F(", gatewayIP = ")); D1PRINTLN(in_WM_STA_IPconfig._sta_static_gw);
-	D1PRINT(F("netMask = ")); D1PRINT(in_WM_STA_IPconfig._sta_static_sn);
-	D1PRINT(F(", dns1IP = ")); D1PRINT(in_WM_STA_IPconfig._sta_static_dns1); D1PRINT(F(", dns2IP = ")); D1PRINTLN(in_WM_STA_IPconfig._sta_static_dns2);
+	sleepState_.wakeCount++;
+	sleepState_.lastWakeToSleepMs = millis();
+	
+	//only a working connection is worth keeping, otherwise the next wake does the full start
+	bool valid = (sleepState_.magic == SLEEP_STATE_MAGIC) && wifiUp_ && mqttUp_;
+	if(wifiUp_ && mqttUp_ && (sleepState_.magic != SLEEP_STATE_MAGIC || strcmp(sleepState_.ssid, WiFi.SSID().c_str()) != 0 || (uint32_t)WiFi.localIP() != sleepState_.ip))
+	{
+		//new network or lease, taken from the running connection
+		strncpy(sleepState_.ssid, WiFi.SSID().c_str(), sizeof(sleepState_.ssid) - 1);
+		strncpy(sleepState_.pw, WiFi.psk().c_str(), sizeof(sleepState_.pw) - 1);
+		memcpy(sleepState_.bssid, WiFi.BSSID(), sizeof(sleepState_.bssid));
+		sleepState_.channel = WiFi.channel();
+		sleepState_.ip = WiFi.localIP();
+		sleepState_.gateway = WiFi.gatewayIP();
+		sleepState_.subnet = WiFi.subnetMask();
+		sleepState_.dns1 = WiFi.dnsIP(0);
+		sleepState_.dns2 = WiFi.dnsIP(1);
+		sleepState_.leaseSeconds = useDHCP_ ? DHCP_LEASE_DEFAULT_S : 0;	//replaced by the DHCP client below
+		sleepState_.leaseAgeS = 0;
+		valid = true;
+	}
+	uint32_t leaseSeconds, leaseAgeS;
+	if(useDHCP_ && dhcpLeaseState(leaseSeconds, leaseAgeS))
+	{
+		//lease of the running DHCP client, a renewal that kept the address restarts the age as well
+		sleepState_.leaseSeconds = leaseSeconds;
+		sleepState_.leaseAgeS = leaseAgeS + sleepMs/1000;
+	}
+	else
+	{
+		sleepState_.leaseAgeS += (sleepState_.lastWakeToSleepMs + sleepMs) / 1000;	//cached lease in use, no DHCP client running
+	}
+	if(valid)
+	{
+		sleepState_.brokerIP = dnsCache_.ip;
+		valid = packParameters();
+	}
+	sleepState_.magic = valid ? SLEEP_STATE_MAGIC : 0;
 }
 
-void WifiUtility::configWiFi(WiFi_STA_IPConfig in_WM_STA_IPconfig)
+bool WifiMqttUtility::readSleepState()
 {
-	D1PRINT(F("Config fixed IP: ")); D1PRINTLN(in_WM_STA_IPconfig._sta_static_ip);
-    // Set static IP, Gateway, Subnetmask, DNS1 and DNS2.
-    WiFi.config(in_WM_STA_IPconfig._sta_static_ip, in_WM_STA_IPconfig._sta_static_gw, in_WM_STA_IPconfig._sta_static_sn, in_WM_STA_IPconfig._sta_static_dns1, in_WM_STA_IPconfig._sta_static_dns2);  
+	#ifdef ESP8266
+	if(!ESP.rtcUserMemoryRead(SLEEP_STATE_RTC_OFFSET, (uint32_t*) &sleepState_, sizeof(sleepState_)))
+		memset(&sleepState_, 0, sizeof(sleepState_));
+	#else
+	memcpy(&sleepState_, &rtcSleepState, sizeof(sleepState_));
+	#endif
+	
+	//counters survive an invalid state as long as the memory itself is intact
+	uint16_t checksum = calcChecksum((uint8_t*) &sleepState_.paramLayout, sizeof(sleepState_) - offsetof(WU_SleepState, paramLayout));
+	if(sleepState_.checksum != checksum)
+	{
+		memset(&sleepState_, 0, sizeof(sleepState_));
+		return false;
+	}
+	return sleepState_.magic == SLEEP_STATE_MAGIC && sleepState_.paramLayout == parameterLayout();
 }
 
-uint8_t WifiUtility::connectMultiWiFi()
+void WifiMqttUtility::writeSleepState()
 {
-#if ESP32
-	// For ESP32, this better be 0 to shorten the connect time.
-	// For ESP32-S2/C3, must be > 500
-	#if ( USING_ESP32_S2 || USING_ESP32_C3 )
-		#define WIFI_MULTI_1ST_CONNECT_WAITING_MS           500L
+	sleepState_.paramLayout = parameterLayout();
+	sleepState_.checksum = calcChecksum((uint8_t*) &sleepState_.paramLayout, sizeof(sleepState_) - offsetof(WU_SleepState, paramLayout));
+	#ifdef ESP8266
+	ESP.rtcUserMemoryWrite(SLEEP_STATE_RTC_OFFSET, (uint32_t*) &sleepState_, sizeof(sleepState_));
 	#else
-		// For ESP32 core v1.0.6, must be >= 500
-		#define WIFI_MULTI_1ST_CONNECT_WAITING_MS           800L
+	memcpy(&rtcSleepState, &sleepState_, sizeof(sleepState_));
 	#endif
-#else
-	// For ESP8266, this better be 2200 to enable connect the 1st time
-	#define WIFI_MULTI_1ST_CONNECT_WAITING_MS             2200L
-#endif
-
-#define WIFI_MULTI_CONNECT_WAITING_MS                   500L
-
-	uint8_t status;
-
-	//WiFi.mode(WIFI_STA);
-	
-	wifiMulti_ = WiFiMulti();
+}
 
-	D1PRINTLN(F("Connect MultiWiFi with :"));
+uint16_t WifiMqttUtility::parameterLayout()
+{
+	uint16_t layout = configParameters_.size();
+	for(int i=0; i<configParameters_.size(); i++)
+		layout = layout*31 + calcChecksum((uint8_t*) configParameters_[i].id, strlen(configParameters_[i].id));
+	return layout;
+}
 
-	if ( (routerSSID_ != "") && (routerPass_ != "") )
+bool WifiMqttUtility::packParameters()
+{
+	int pos = 0;
+	for(int i=0; i<configParameters_.size(); i++)
 	{
-		D1PRINT(F("* Config portal Router_SSID = ")); D1PRINTLN(routerSSID_); D3PRINT(F(", Router_Pass = ")); D3PRINTLN(routerPass_);
-		wifiMulti_.addAP(routerSSID_.c_str(), routerPass_.c_str());
+		int len = configParameters_[i].value.length() + 1;
+		if(pos + len > SLEEP_PARAM_BLOB_SIZE)
+		{
+			D1PRINTLN(F("Parameters too large for the sleep state"));
+			return false;
+		}
+		memcpy(&sleepState_.params[pos], configParameters_[i].value.c_str(), len);
+		pos += len;
 	}
+	sleepState_.paramCount = configParameters_.size();
+	return true;
+}
 
-	for (uint8_t i = 0; i < NUM_WIFI_CREDENTIALS; i++)
+bool WifiMqttUtility::unpackParameters()
+{
+	if(sleepState_.paramCount != configParameters_.size())
+		return false;
+	int pos = 0;
+	for(int i=0; i<configParameters_.size(); i++)
 	{
-		// Don't permit NULL SSID and password len < MIN_AP_PASSWORD_SIZE (8)
-		if ( (String(WMConfig_.WiFi_Creds[i].wifi_ssid) != "") && (strlen(WMConfig_.WiFi_Creds[i].wifi_pw) >= MIN_AP_PASSWORD_SIZE) )
-		{
-			D1PRINT(F("* Stored SSID = ")); D1PRINT(WMConfig_.WiFi_Creds[i].wifi_ssid); D3PRINT(F(", PW = ")); D3PRINT(WMConfig_.WiFi_Creds[i].wifi_pw); D1PRINTLN(F(""));
-			wifiMulti_.addAP(WMConfig_.WiFi_Creds[i].wifi_ssid, WMConfig_.WiFi_Creds[i].wifi_pw);
-		}
+		const char* value = &sleepState_.params[pos];
+		pos += strnlen(value, SLEEP_PARAM_BLOB_SIZE - pos) + 1;
+		if(pos > SLEEP_PARAM_BLOB_SIZE)
+			return false;
+		configParameters_[i].setValue(value);
 	}
+	return true;
+}
 
-	D1PRINTLN(F("Connecting MultiWifi..."));
+void WifiMqttUtility::configHeapTelemetry(String topic, ulong intervalMs)
+{
+	if(heapTelemetryTimer_ >= 0)
+		timers_.cancel(heapTelemetryTimer_);
+	heapTelemetryTimer_ = -1;
+	heapTopic_ = topic;
+	if(topic != "")
+		heapTelemetryTimer_ = timers_.schedule(intervalMs, heapTelemetryJob, this, intervalMs);
+}
 
-	//WiFi.mode(WIFI_STA);
+void WifiMqttUtility::heapTelemetryJob(void* arg)
+{
+	static_cast<WifiMqttUtility*>(arg)->publishHeapReport();
+}
 
-	if(!useDHCP_)
-		configWiFi(WM_STA_IPconfig_);
+void WifiMqttUtility::publishHeapReport()
+{
+	char report[HEAP_REPORT_MAX_LEN];
+	takeHeapSnapshot();
+	if(heapReport(report, sizeof(report)) < 0)
+	{
+		D1PRINTLN(F("Heap report exceeds HEAP_REPORT_MAX_LEN"));
+		return;
+	}
+	publish(heapTopic_.c_str(), report, WU_CLASS_TELEMETRY);
+}
 
-	int i = 0;
-	status = wifiMulti_.run();
-	delay(WIFI_MULTI_1ST_CONNECT_WAITING_MS);
+void WifiMqttUtility::configRateLimit(WU_TrafficClass cls, uint32_t ratePerS, uint32_t burst)
+{
+	WU_OutboundClass &oc = outbound_[cls];
+	oc.ratePerS = ratePerS;
+	oc.burst = max(burst, (uint32_t)1);
+	oc.tokensMilli = oc.burst*1000;
+	oc.refillMs = millis();
+}
 
-	while ( ( i++ < 20 ) && ( status != WL_CONNECTED ) )
+bool WifiMqttUtility::publish(const char topic[], const char payload[], WU_TrafficClass cls, bool retained, int qos)
+{
+	WU_PROFILE(WU_PHASE_PUBLISH);
+	WU_OutboundClass &oc = outbound_[cls];
+	WU_OutboundMessage msg = {topic, payload, retained, qos, millis()};
+	
+	//without autoReconnect nothing else brings MQTT back
+	if(!mqttUp_ && actionReconnect_)
+		connectMqtt();
+	
+	//same rule as in loop(): waiting messages that have a token go first, then this one if its class has a token left
+	loopOutbound();
+	if(oc.count == 0 && mqttUp_ && takeToken(oc))
+		return sendOutbound(oc, msg);
+	
+	if(oc.count == OUTBOUND_QUEUE_SIZE)
 	{
-		status = wifiMulti_.run();
-
-		if ( status == WL_CONNECTED )
-			break;
-		else
-			delay(WIFI_MULTI_CONNECT_WAITING_MS);
+		D2PRINT(F("Outbound queue full, dropping oldest message of class ")); D2PRINTLN(cls);
+		oc.stats.dropped++;
+		oc.head = (oc.head + 1) % OUTBOUND_QUEUE_SIZE;
+		oc.count--;
 	}
+	holdRadioAwake(POWER_AWAKE_HOLD_MS);	//queue drains without waiting for beacons
+	oc.queue[(oc.head + oc.count) % OUTBOUND_QUEUE_SIZE] = msg;
+	oc.count++;
+	oc.stats.queued = oc.count;
+	oc.stats.maxQueued = max(oc.stats.maxQueued, (uint16_t)oc.count);
+	return mqttUp_;	//queued while disconnected is not published, it goes out after the next connect
+}
+
+void WifiMqttUtility::configPersistentSession(bool enable)
+{
+	persistentSession_ = enable;
+	mqtt_.setCleanSession(!enable);	//broker keeps the session while the node restarts
+}
 
-	if ( status == WL_CONNECTED )
+void WifiMqttUtility::loadSessionJournal()
+{
+	sessionLoaded_ = true;
+	memset(&session_, 0, sizeof(session_));
+	mountFilesystem();
+	File file = FileFS.open(MQTT_SESSION_FILENAME, "r");
+	if(!file && FileFS.exists(MQTT_SESSION_TEMP_FILENAME))
+		file = FileFS.open(MQTT_SESSION_TEMP_FILENAME, "r");	//compaction interrupted between remove and rename
+	if(!file)
+		return;
+	
+	//records in the order written, a torn last record ends the journal
+	size_t size = file.size();
+	size_t offset = 0;
+	MQTT_JournalRecord record;
+	MQTT_InflightMessage inflight;
+	while(offset + sizeof(record) <= size && file.readBytes((char *) &record, sizeof(record)) == sizeof(record))
 	{
-		D1PRINT(F("WiFi connected after ")); D1PRINT(String(i)); D1PRINTLN(F(" tries."))
-		D1PRINT(F("SSID:")); D1PRINT(WiFi.SSID()); D1PRINT(F(",RSSI=")); D1PRINTLN(WiFi.RSSI());
-		D1PRINT(F("Channel:")); D1PRINT(WiFi.channel()); D1PRINT(F(", IP address:")); D1PRINTLN(WiFi.localIP());
+		uint32_t storedCrc = record.crc;
+		record.crc = 0;
+		memset(&inflight, 0, sizeof(inflight));
+		if(record.type == MQTT_JOURNAL_ADD && (record.topicLength > WU_TOPIC_MAX || record.payloadLength > WU_PAYLOAD_MAX || 
+				file.readBytes(inflight.topic, record.topicLength) != record.topicLength || file.readBytes(inflight.payload, record.payloadLength) != record.payloadLength))
+			break;
+		uint32_t crc = crc32Update(0, &record, sizeof(record));
+		if(record.type == MQTT_JOURNAL_ADD)
+		{
+			crc = crc32Update(crc, inflight.topic, record.topicLength);
+			crc = crc32Update(crc, inflight.payload, record.payloadLength);
+		}
+		if(crc != storedCrc)
+			break;
+		offset += sizeof(record) + ((record.type == MQTT_JOURNAL_ADD) ? record.topicLength + record.payloadLength : 0);
+		
+		int slot = -1;
+		for(int i=0; i<MQTT_SESSION_WINDOW; i++)
+		{
+			if(session_.window[i].packetId != 0 && session_.window[i].sequence == record.sequence)
+				slot = i;
+		}
+		if(record.type == MQTT_JOURNAL_ADD)
+		{
+			inflight.packetId = record.packetId;
+			inflight.retained = record.retained;
+			inflight.sequence = record.sequence;
+			session_.window[sessionSlot()] = inflight;
+			session_.sequence = max(session_.sequence, record.sequence);
+		}
+		else if(slot >= 0 && record.type == MQTT_JOURNAL_DONE)
+			session_.window[slot].packetId = 0;
+		else if(slot >= 0 && record.type == MQTT_JOURNAL_ID)
+			session_.window[slot].packetId = record.packetId;
+		if(record.packetId != 0)
+			session_.lastPacketId = record.packetId;
 	}
-	else
+	file.close();
+	session_.journalBytes = offset;
+	if(offset != size || !FileFS.exists(MQTT_SESSION_FILENAME))
 	{
-		D1PRINT(F("WiFi not connected"));
+		D1PRINTLN(F("MQTT session journal incomplete, compacting"));
+		compactSessionJournal();
 	}
-	return status;
 }
 
-int WifiUtility::calcChecksum(uint8_t* address, uint16_t sizeToCalc)
+size_t WifiMqttUtility::writeJournalRecord(File &file, uint8_t type, const MQTT_InflightMessage &inflight)
 {
-	uint16_t checkSum = 0;
-  
-	for (uint16_t index = 0; index < sizeToCalc; index++)
+	MQTT_JournalRecord record;
+	memset(&record, 0, sizeof(record));
+	record.type = type;
+	record.retained = inflight.retained;
+	record.packetId = inflight.packetId;
+	record.sequence = inflight.sequence;
+	if(type == MQTT_JOURNAL_ADD)
 	{
-		checkSum += * ( ( (byte*) address ) + index);
+		record.topicLength = strlen(inflight.topic);
+		record.payloadLength = strlen(inflight.payload);
 	}
-
-	return checkSum;
+	uint32_t crc = crc32Update(0, &record, sizeof(record));
+	crc = crc32Update(crc, inflight.topic, record.topicLength);
+	record.crc = crc32Update(crc, inflight.payload, record.payloadLength);
+	
+	size_t written = file.write((uint8_t*) &record, sizeof(record));
+	written += file.write((const uint8_t*) inflight.topic, record.topicLength);
+	written += file.write((const uint8_t*) inflight.payload, record.payloadLength);
+	return (written == sizeof(record) + record.topicLength + record.payloadLength) ? written : 0;
 }
 
-bool WifiUtility::loadWifiConfigData()
+bool WifiMqttUtility::appendJournalRecord(uint8_t type, const MQTT_InflightMessage &inflight)
 {
-	File file = FileFS.open(WIFI_CONFIG_FILENAME, "r");
-	D1PRINT(F("Load WiFi config file: "));
-	
-	//reset config structs
-	memset((void *) &WMConfig_,       0, sizeof(WMConfig_));
-
-	memset((void *) &WM_STA_IPconfig_, 0, sizeof(WM_STA_IPconfig_));
-
-	if (file)
+	mountFilesystem();
+	File file = FileFS.open(MQTT_SESSION_FILENAME, "a");
+	if(!file)
 	{
-		//fill structs
-		file.readBytes((char *) &WMConfig_,   sizeof(WMConfig_));
-
-		file.readBytes((char *) &WM_STA_IPconfig_, sizeof(WM_STA_IPconfig_));
-
-		file.close();
-		D1PRINTLN(F("OK"));
-
-		if ( WMConfig_.checksum != calcChecksum( (uint8_t*) &WMConfig_, sizeof(WMConfig_) - sizeof(WMConfig_.checksum) ) )
-		{
-			D1PRINTLN(F("WM_config checksum wrong"));
-			return false;
-		}
-    
-		displayIPConfigStruct(WM_STA_IPconfig_);
-
-		return true;
+		D1PRINTLN(F("MQTT session journal not writable"));
+		return false;
 	}
-	else
+	size_t written = writeJournalRecord(file, type, inflight);
+	file.close();
+	if(written == 0)
 	{
-		D1PRINTLN(F("failed"));
-
+		D1PRINTLN(F("MQTT session journal write failed"));
+		compactSessionJournal();	//drops the partial record
 		return false;
 	}
+	session_.journalBytes += written;
+	if(session_.journalBytes > MQTT_SESSION_COMPACT_BYTES)
+		compactSessionJournal();
+	return true;
 }
 
-void WifiUtility::saveWifiConfigData()
+void WifiMqttUtility::compactSessionJournal()
 {
-	File file = FileFS.open(WIFI_CONFIG_FILENAME, "w");
-	D1PRINTLN(F("Save WiFi config file"));
-
-	if (file)
+	mountFilesystem();
+	session_.journalBytes = 0;
+	bool inflight = false;
+	for(int i=0; i<MQTT_SESSION_WINDOW; i++)
+		inflight = inflight || session_.window[i].packetId != 0;
+	if(!inflight)
 	{
-		WMConfig_.checksum = calcChecksum( (uint8_t*) &WMConfig_, sizeof(WMConfig_) - sizeof(WMConfig_.checksum) );
-    
-		file.write((uint8_t*) &WMConfig_, sizeof(WMConfig_));
-
-		displayIPConfigStruct(WM_STA_IPconfig_);
-
-		file.write((uint8_t*) &WM_STA_IPconfig_, sizeof(WM_STA_IPconfig_));
-
-		file.close();
-		D1PRINTLN(F("OK"));
+		FileFS.remove(MQTT_SESSION_FILENAME);
+		return;
 	}
-	else
+	
+	//messages in flight written aside and renamed, a reset during the write keeps the old journal
+	File file = FileFS.open(MQTT_SESSION_TEMP_FILENAME, "w");
+	if(!file)
 	{
-		D1PRINTLN(F("failed"));
+		D1PRINTLN(F("MQTT session journal not writable"));
+		return;
+	}
+	size_t total = 0;
+	bool ok = true;
+	for(int i=0; i<MQTT_SESSION_WINDOW && ok; i++)
+	{
+		if(session_.window[i].packetId == 0)
+			continue;
+		size_t written = writeJournalRecord(file, MQTT_JOURNAL_ADD, session_.window[i]);
+		ok = written > 0;
+		total += written;
 	}
+	file.close();
+	if(!ok)
+	{
+		D1PRINTLN(F("MQTT session journal not compacted"));
+		FileFS.remove(MQTT_SESSION_TEMP_FILENAME);
+		return;
+	}
+	//LittleFS replaces the target, SPIFFS needs it removed first
+	if(!FileFS.rename(MQTT_SESSION_TEMP_FILENAME, MQTT_SESSION_FILENAME))
+	{
+		FileFS.remove(MQTT_SESSION_FILENAME);
+		FileFS.rename(MQTT_SESSION_TEMP_FILENAME, MQTT_SESSION_FILENAME);
+	}
+	session_.journalBytes = total;
 }
 
+void WifiMqttUtility::finishInflight(int slot)
+{
+	MQTT_InflightMessage &inflight = session_.window[slot];
+	appendJournalRecord(MQTT_JOURNAL_DONE, inflight);
+	inflight.packetId = 0;
+}
 
-
-int WifiUtility::findParameterIndex(const char* id)
+int WifiMqttUtility::sessionSlot()
 {
-	for(int i = 0; i<configParameters_.size();i++) 
+	//free slot, otherwise the oldest message is given up
+	int slot = 0;
+	for(int i=0; i<MQTT_SESSION_WINDOW; i++)
 	{
-		if(strcmp(configParameters_[i].id, id) == 0) 
-		{
+		if(session_.window[i].packetId == 0)
 			return i;
-		}
+		if(session_.window[i].sequence < session_.window[slot].sequence)
+			slot = i;
 	}
-	D1PRINT(F("Could not find requested parameter '")); D1PRINT(id); D1PRINTLN(F("'"));
-	return -1;	//no match found
+	return slot;
 }
 
+int WifiMqttUtility::journalMessage(const char* topic, const char* payload, bool retained)
+{
+	if(!persistentSession_)
+		return -1;
+	if(!sessionLoaded_)
+		loadSessionJournal();
+	if(strlen(topic) > WU_TOPIC_MAX || strlen(payload) > WU_PAYLOAD_MAX)
+	{
+		D1PRINTLN(F("QoS1 message too large for the session journal"));
+		sessionStats_.dropped++;
+		return -1;
+	}
+	
+	int slot = sessionSlot();
+	MQTT_InflightMessage &inflight = session_.window[slot];
+	if(inflight.packetId != 0)
+	{
+		D1PRINT(F("Session window full, giving up packet ")); D1PRINTLN(inflight.packetId);
+		sessionStats_.dropped++;
+		finishInflight(slot);
+	}
+	
+	//lwmqtt takes the next ID, 0 is skipped
+	uint16_t packetId = mqtt_.lastPacketID() + 1;
+	inflight.packetId = (packetId == 0) ? 1 : packetId;
+	inflight.retained = retained;
+	inflight.sequence = ++session_.sequence;
+	strcpy(inflight.topic, topic);
+	strcpy(inflight.payload, payload);
+	sessionStats_.journaled++;
+	if(!appendJournalRecord(MQTT_JOURNAL_ADD, inflight))
+	{
+		inflight.packetId = 0;	//sent without the journal
+		return -1;
+	}
+	return slot;
+}
 
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-WifiMqttUtility::WifiMqttUtility(int msgBufferSize) : WifiUtility(), mqtt_(MQTTClient(msgBufferSize))
+void WifiMqttUtility::replaySession()
 {
-	addParameter(mqttDataID[0], "MQTT Server Adresse", 20);
-	addParameter(mqttDataID[1], "MQTT Server Port", 5, "1883");
-	addParameter(mqttDataID[2], "MQTT Client ID", 20);
-	addParameter(mqttDataID[3], "MQTT Username", 20);
-	addParameter(mqttDataID[4], "MQTT Key", 40);
+	if(!persistentSession_)
+		return;
+	if(!sessionLoaded_)
+		loadSessionJournal();
 	
-	subscriptions.reserve(2);
+	while(mqtt_.connected())
+	{
+		//oldest first
+		int slot = -1;
+		for(int i=0; i<MQTT_SESSION_WINDOW; i++)
+		{
+			if(session_.window[i].packetId != 0 && (slot < 0 || session_.window[i].sequence < session_.window[slot].sequence))
+				slot = i;
+		}
+		if(slot < 0)
+			break;
+		
+		MQTT_InflightMessage &inflight = session_.window[slot];
+		D1PRINT(F("Replaying QoS1 packet ")); D1PRINTLN(inflight.packetId);
+		mqtt_.prepareDuplicate(inflight.packetId);
+		if(!mqtt_.publish(inflight.topic, inflight.payload, inflight.retained, 1))
+			break;
+		finishInflight(slot);
+		sessionStats_.replayed++;
+	}
 }
 
-bool WifiMqttUtility::begin()
+bool WifiMqttUtility::takeToken(WU_OutboundClass &oc)
 {
-	WifiUtility::begin();
-	return resetMqtt();
+	ulong now = millis();
+	ulong elapsed = min(now - oc.refillMs, (ulong)oc.burst*1000);	//a full bucket at 1 msg/s at least, avoids overflow
+	oc.tokensMilli = min(oc.tokensMilli + (uint32_t)elapsed*oc.ratePerS, oc.burst*1000);
+	oc.refillMs = now;
+	if(oc.tokensMilli < 1000)
+		return false;
+	oc.tokensMilli -= 1000;
+	return true;
 }
 
-bool WifiMqttUtility::connectMqtt()
+bool WifiMqttUtility::sendOutbound(WU_OutboundClass &oc, WU_OutboundMessage &msg)
 {
-	//worst case - no WiFi -> try to reconnect everything
-	if( (WiFi.status() != WL_CONNECTED) )
-		begin();
+	if(actionReconnect_)
+		connectMqtt();
+	if(msg.qos > 0)
+		holdRadioAwake(POWER_AWAKE_HOLD_MS);	//PUBACK
 	
-	//check if MQTT server connection is open
-	if(!client_.connected())
+	//write ahead, the slot is freed once the PUBACK arrived
+	int slot = (msg.qos > 0) ? journalMessage(msg.topic.c_str(), msg.payload.c_str(), msg.retained) : -1;
+	bool sent = mqtt_.publish(msg.topic.c_str(), msg.payload.c_str(), msg.retained, msg.qos);
+	if(sent)
+		lastTrafficMs_ = millis();
+	if(slot >= 0)
 	{
-		D1PRINTLN(F("MQTT not connected, trying to connect."));
-		bool reconnected = resetMqtt();
-		if(reconnected)
+		MQTT_InflightMessage &inflight = session_.window[slot];
+		session_.lastPacketId = mqtt_.lastPacketID();
+		if(sent)
 		{
-			D1PRINTLN(F("Connection of MQTT successful!"));
+			finishInflight(slot);
+			sessionStats_.acked++;
 		}
-		else
+		else if(inflight.packetId != session_.lastPacketId)
 		{
-			D1PRINTLN(F("Connection of MQTT unsuccessful!"));
+			inflight.packetId = session_.lastPacketId;	//prediction was off, keep the ID actually used
+			appendJournalRecord(MQTT_JOURNAL_ID, inflight);
 		}
-		return reconnected;
 	}
-	
-	D1PRINTLN(F("MQTT connection fine!"));
-	
-	//everything if fine!
+	if(!sent)
+	{
+		if(slot >= 0)
+			return true;	//replayed after the next reconnect
+		oc.stats.dropped++;
+		return false;
+	}
+	ulong latency = millis() - msg.queuedMs;
+	oc.stats.sent++;
+	oc.stats.avgLatencyMs = (oc.stats.sent == 1) ? latency : (7*oc.stats.avgLatencyMs + latency)/8;
+	oc.stats.maxLatencyMs = max(oc.stats.maxLatencyMs, latency);
 	return true;
 }
 
-bool WifiMqttUtility::resetMqtt()
+void WifiMqttUtility::loopOutbound()
 {
-	D1PRINTLN(F("Retrieving MQTT connection data from stored parameters"));
-	//retrieve config values with minimal overhead
-	char* mqttConnectData[5];	//parameters for  [0] server address, [1] server port, [2] client ID, [3] username, [4] password
-	for(int i=0;i<5;i++)
-	{
-		int bufferSize = getParameterBufferLength(mqttDataID[i]);
-		mqttConnectData[i] = new char[bufferSize];
-		getParameter(mqttDataID[i], mqttConnectData[i], bufferSize);
-	}
-	
-	D1PRINT(F("Connecting MQTT with Server ")); D1PRINT(mqttConnectData[0]); D1PRINT(F(":"));D1PRINT(mqttConnectData[1]); D1PRINT(F(" client ID ")); D1PRINT(mqttConnectData[2]); D1PRINT(F(" Username "));D1PRINTLN(mqttConnectData[3]);
-	D2PRINT(F(" Password")); D1PRINTLN(mqttConnectData[4]);
-
-	//connect client and MQTT handler and resubscribe
-	mqtt_.begin(mqttConnectData[0], atoi(mqttConnectData[1]), client_);
-	bool connected = mqtt_.connect(mqttConnectData[2], mqttConnectData[3], mqttConnectData[4]);
-	if(connected)
+	WU_PROFILE(WU_PHASE_OUTBOUND);
+	if(!mqttUp_)
+		return;
+	//classes in priority order, a class only held back by its rate limit does not block lower ones
+	for(int cls=0; cls<WU_CLASS_COUNT; cls++)
 	{
-		for(int i=0;i<subscriptions.size();i++)
-			mqtt_.subscribe(subscriptions[i]);
-		return true;
+		WU_OutboundClass &oc = outbound_[cls];
+		while(oc.count > 0 && takeToken(oc))
+		{
+			WU_OutboundMessage &msg = oc.queue[oc.head];
+			sendOutbound(oc, msg);
+#if !WU_STATIC_MEMORY
+			msg.topic = String();	//release the strings right away
+			msg.payload = String();
+#endif
+			oc.head = (oc.head + 1) % OUTBOUND_QUEUE_SIZE;
+			oc.count--;
+			oc.stats.queued = oc.count;
+		}
 	}
-	return false;
 }
 
-void WifiMqttUtility::wifiConfigPortal()
+void WifiMqttUtility::probeTimeoutJob(void* arg)
 {
-	WifiUtility::wifiConfigPortal();
-	resetMqtt();
+	static_cast<WifiMqttUtility*>(arg)->probeTimedOut();
 }
 
-bool WifiMqttUtility::loop()
+void WifiMqttUtility::probeTimedOut()
 {
-	loopTriggerPin();
-	if(loopConnectionTimeout())
+	stableProbes_ = 0;
+	//without any echo the broker may just not allow the probe topic, rely on the keepalive then
+	if(!probeVerified_ || !mqtt_.connected())
+		return;
+	if(++probeMissed_ < MQTT_PROBE_MAX_MISSED)
 	{
-		if(loopWifiConnection())
-		{
-			if(mqtt_.loop())
-			{
-				return true;
-			}
-			else
-			{
-				if(autoReconnect_)
-				{
-					quiet_ = true;
-					resetMqtt();
-					quiet_ = false;
-					if(mqtt_.loop())
-						return true;
-				}
-				return false;	//MQTT not connected
-			}
-		}
-		return false;	//WiFi is not connected/cannot be connected
+		sendProbe();	//retransmit with doubled timeout
+		return;
 	}
-	return true;	//nothing to do
+	
+	D1PRINT(F("MQTT link dead, ")); D1PRINT(probeMissed_); D1PRINTLN(F(" probes unanswered"));
+	linkStats_.deadLinks++;
+	probeMissed_ = 0;
+	
+	//a loss after a longer idle gap than any answered probe hints at a NAT timeout, probe more often from now on
+	ulong idleS = (probeFirstSentMs_ - lastTrafficMs_ + 999)/1000;
+	if(lastTrafficMs_ != 0 && idleS > linkStats_.longestIdleS)
+	{
+		if(linkStats_.shortestLostIdleS == 0 || idleS < linkStats_.shortestLostIdleS)
+			linkStats_.shortestLostIdleS = idleS;
+		setKeepAlive(max(linkStats_.keepAliveS/2, MQTT_KEEPALIVE_MIN_S));
+	}
+	
+	transport_->stop();
+	updateMqttState(false);
+	connectionCheckDue_ = true;	//reconnect with the next loop
 }
 
 bool WifiMqttUtility::checkMqttConnected()
 {
-	return mqtt_.connected();
+	updateMqttState(mqtt_.connected());
+	return mqttUp_;
+}
+
+void WifiMqttUtility::updateMqttState(bool connected)
+{
+	if(connected == mqttUp_)
+		return;
+	mqttUp_ = connected;
+	emitEvent(connected ? WU_EVENT_MQTT_CONNECTED : WU_EVENT_MQTT_DISCONNECTED);
 }
 
 bool WifiMqttUtility::loadConfigFile()
 {
-	bool res = WifiUtility::loadConfigFile();
+	bool res = parseConfigFile();
 	resetMqtt();
 	return res;
 }
 
 bool WifiMqttUtility::subscribe(const char topic[]) 
 {
+	WU_HEAP_SCOPE(WU_HEAP_SUBSCRIPTIONS);
 	addSubscription(topic);
 	if(actionReconnect_) 
 		connectMqtt(); 
 	return mqtt_.subscribe(topic); 
 
 }
-bool WifiMqttUtility::subscribe(String topic) 
-{ 
-	removeSubscription(topic);
-	addSubscription(topic);
-	if(actionReconnect_) 
-		connectMqtt(); 
-	return mqtt_.subscribe(topic); 
-}
-
 bool WifiMqttUtility::unsubscribe(const char topic[]) 
 { 
-	removeSubscription(String(topic));
+	WU_HEAP_SCOPE(WU_HEAP_SUBSCRIPTIONS);
+	removeSubscription(topic);
 	if(actionReconnect_) 
 		connectMqtt(); 
 	return mqtt_.unsubscribe(topic); 
 
 }
-bool WifiMqttUtility::unsubscribe(String topic) 
-{ 
-	removeSubscription(String(topic));
-	if(actionReconnect_) 
-		connectMqtt(); 
-	return mqtt_.unsubscribe(topic); 
-}
-
-void WifiMqttUtility::addSubscription(String topic)
+bool WifiMqttUtility::addSubscription(const char* topic)
 {
 	for(int i=0; i<subscriptions.size();i++)
 	{
-		if(subscriptions[i] == topic)
-			return;
+		if(subscriptions[i].topic == topic)
+			return true;
+	}
+#if WU_STATIC_MEMORY
+	if(subscriptions.size() >= WU_MAX_SUBSCRIPTIONS || strlen(topic) > WU_TOPIC_MAX)
+	{
+		D1PRINT(F("Subscription to '")); D1PRINT(topic); D1PRINTLN(F("' exceeds the static memory limits"));
+		return false;
 	}
-	subscriptions.push_back(topic);	//no duplicates found, add
+#endif
+	MQTT_Subscription subscription;
+	subscription.topic = topic;
+	subscription.payloadHash = 0;
+	subscription.seen = false;	//retained state of a new subscription always passes
+	subscriptions.push_back(subscription);	//no duplicates found, add
+	return true;
 }
 
-void WifiMqttUtility::removeSubscription(String topic)
+void WifiMqttUtility::removeSubscription(const char* topic)
 {
 	for(int i=0; i<subscriptions.size();i++)
 	{
-		if(subscriptions[i] == topic)
+		if(subscriptions[i].topic == topic)
 		{
 			subscriptions.erase(subscriptions.begin()+i);
 			return;
@@ -17,6 +17,13 @@
 	USING_CORS_FEATURE (default true)
 	USE_AVAILABLE_PAGES (shows available pages in AP mode, default true)
 	USE_ESP_WIFIMANAGER_NTP (using NTP server, default true)
+	WU_STATIC_MEMORY (fixed capacity buffers, no heap use by the library after begin(), String APIs are removed, default false, set as build flag.
+		Not covered: the config portal, the network stack (WiFi, lwIP, TLS), the file handle of every FileFS.open (config saves, DNS cache,
+		DHCP lease, credential store, QoS1 journal, TLS session) and the SSID Strings of the scans for roaming)
+	WU_HEAP_GUARD (debug check that reports allocations of the loop task after begin(), default false, set as build flag. operator new is always
+		seen, malloc/calloc/realloc (String) only when linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc)
+	WU_HEAP_TRACKING (accounting of every operator new/delete overload per library subsystem, default false, set as build flag)
+	WU_PROFILING (cycle counter timing of the loop() phases, begin(), connectMqtt() and publish(), default false, set as build flag)
 	
 	
 	Built by Michael Doppler https://github.com/mdop
@@ -33,6 +40,18 @@
 #define USE_AVAILABLE_PAGES     	true
 #define USING_CORS_FEATURE			true
 #define USE_ESP_WIFIMANAGER_NTP     true
+#ifndef WU_STATIC_MEMORY
+	#define WU_STATIC_MEMORY		false
+#endif
+#ifndef WU_HEAP_GUARD
+	#define WU_HEAP_GUARD			false
+#endif
+#ifndef WU_HEAP_TRACKING
+	#define WU_HEAP_TRACKING		false
+#endif
+#ifndef WU_PROFILING
+	#define WU_PROFILING			false
+#endif
 
 //-----------------------------------------include some stuff--------------
 
@@ -54,6 +73,9 @@
 	#include <WiFi.h>
 	#include <WiFiClient.h>
 	#include <WiFiMulti.h>
+	#include <WiFiClientSecure.h>
+	#include <AsyncTCP.h>		//dependency of ESPAsync_WiFiManager, used for non-blocking broker probes
+	#include <mbedtls/sha256.h>	//hash of firmware images received over MQTT
 
 	// LittleFS has higher priority than SPIFFS
 	#if ( ARDUINO_ESP32C3_DEV )
@@ -93,6 +115,9 @@
 
 	// From v1.1.0
 	#include <ESP8266WiFiMulti.h>
+	#include <WiFiClientSecure.h>	//BearSSL
+	#include <ESPAsyncTCP.h>	//dependency of ESPAsync_WiFiManager, used for non-blocking broker probes
+	#include <bearssl/bearssl.h>	//hash of firmware images received over MQTT
 
 	#define USE_LITTLEFS      true
   
@@ -110,6 +135,26 @@
 #endif
 
 
+//-----------------------------------------memory settings--------------
+
+//capacities in static memory mode, longer values are rejected or truncated
+#define WU_PARAM_VALUE_MAX			64
+#define WU_MAX_PARAMETERS			16
+#define WU_MAX_SUBSCRIPTIONS		8
+#define WU_TOPIC_MAX				64
+#define WU_PAYLOAD_MAX				128		//queued outbound messages
+#define WU_REMOTE_CONFIG_MAX		256
+#define WU_JSON_DOC_SIZE			1024	//also the maximum config file size in static memory mode
+
+//Heap snapshots (free heap, largest block) and the optional per subsystem report
+#define HEAP_SNAPSHOT_INTERVAL_MS	10000
+#define HEAP_REPORT_MAX_LEN			400		//JSON report incl. all subsystems
+
+//Latency profiler (WU_PROFILING), histogram buckets are decades starting below 10us
+#define PROFILE_HISTOGRAM_BUCKETS	8		//<10us ... <10s, >=10s
+#define PROFILE_REPORT_INTERVAL_MS	10000	//minimum time between two budget reports
+#define PROFILE_CYCLE_WRAP_MS		10000	//longer phases are timed with millis(), the cycle counter wraps after 17s at 240MHz
+
 //-----------------------------------------WIFI settings--------------
 
 #define SSID_MAX_LEN            32
@@ -117,7 +162,30 @@
 #define PASS_MAX_LEN            64
 #define MIN_AP_PASSWORD_SIZE    8
 
-#define NUM_WIFI_CREDENTIALS      2
+#define NUM_WIFI_CREDENTIALS      2		//credential slots in the config portal
+
+#define MAX_WIFI_CREDENTIALS      10	//capacity of the credential store, the file holds a variable number of networks
+#define WIFI_CONNECT_TIMEOUT_MS   10000	//per network
+#define WIFI_CONNECT_POLL_MS      50
+
+//Background scan while connected, reconnects use the cached results instead of a blocking scan
+#define SCAN_CACHE_SIZE           16
+#define SCAN_INTERVAL_MS          60000
+#define SCAN_POLL_MS              100
+#define SCAN_CACHE_MAX_AGE_MS     300000	//older entries are not used for reconnects
+
+//Roaming: RSSI is checked periodically, a roam needs a scan result younger than ROAM_SCAN_MAX_AGE_MS
+#define ROAM_CHECK_INTERVAL_MS    5000
+#define ROAM_SCAN_MAX_AGE_MS      30000
+
+//Modem power save: DTIM is set by the AP, the station chooses how many beacons it may sleep through (listen interval)
+#define POWER_BEACON_INTERVAL_MS	102		//typical beacon interval of 100 TU
+#define POWER_LISTEN_INTERVAL_MAX	10		//most APs drop stations sleeping longer
+#define POWER_WAKES_PER_INTERVAL	4		//radio wakes per traffic interval (keepalive/probe period)
+#define POWER_AWAKE_HOLD_MS			200		//full power after a queued or QoS1 publish to receive the responses
+#define POWER_BEACON_WAKE_MS		3		//estimated radio on time per beacon wake
+#define POWER_CURRENT_AWAKE_MA		95		//estimates for the current report, adjust to the module
+#define POWER_CURRENT_SLEEP_MA		20
 
 // Assuming max 49 chars
 #define TZNAME_MAX_LEN            50
@@ -127,6 +195,118 @@
 
 #define CONFIG_FILENAME 	"/ConfigService.json"
 #define WIFI_CONFIG_FILENAME 	"/wifi_cred.dat"
+#define WIFI_CONFIG_TEMP_FILENAME 	"/wifi_cred.tmp"
+#define WIFI_CONFIG_MAGIC		0x53435557UL	//"WUCS", files without it are in the original WM_Config layout
+#define WIFI_CONFIG_VERSION		3		//versions 1 and 2 are converted when loaded
+#define WIFI_CONFIG_MAX_SIZE	(sizeof(WiFi_StoreHeader) + sizeof(WM_Config) + sizeof(WiFi_STA_IPConfig) + MAX_WIFI_CREDENTIALS*sizeof(WiFi_StoredNetwork))	//largest accepted file, fits all versions
+#define DHCP_LEASE_FILENAME		"/dhcp_lease.dat"
+#define WIFI_HISTORY_SAVE_MS	86400000UL	//connection history that does not change the ranking is saved at most once a day
+
+//Cached DHCP lease: reused with an ARP conflict check on reconnect, renewed in the background afterwards
+#define DHCP_LEASE_DEFAULT_S	3600	//if the lease time cannot be read from the DHCP client
+#define DHCP_ARP_CHECK_MS		300
+#define DHCP_RENEW_DELAY_MS		5000
+#define DHCP_RENEW_WAIT_MS		5000
+
+//Trigger pin: edges closer than the debounce time are ignored, the pin has to be held low for the long press time to open the portal
+#define TRIGGER_DEBOUNCE_MS			50
+#define TRIGGER_LONGPRESS_MS		2000
+
+//Timer wheel: fixed job pool, tick resolution and number of buckets (power of 2)
+#define TIMER_WHEEL_MAX_JOBS		16
+#define TIMER_WHEEL_SLOTS			32
+#define TIMER_WHEEL_TICK_MS			10
+
+//Failed automatic reconnects are retried with exponential backoff between these limits
+#define RECONNECT_BACKOFF_MIN_MS	1000
+#define RECONNECT_BACKOFF_MAX_MS	60000
+
+#define MQTT_KEEPALIVE_S			10		//initial keepalive, adapted to the observed link stability
+#define MQTT_KEEPALIVE_MIN_S		5
+#define MQTT_KEEPALIVE_MAX_S		120
+#define MQTT_KEEPALIVE_STEP_S		5
+#define MQTT_KEEPALIVE_STABLE_PROBES 20	//answered probes in a row before the keepalive is increased
+
+//Link probe: echo on the own probe topic, smoothed RTT and retransmission timeout as in RFC 6298
+#define MQTT_PROBE_TOPIC_PREFIX		"wu/probe/"	//followed by the client ID
+#define MQTT_PROBE_RTO_INITIAL_MS	1000
+#define MQTT_PROBE_RTO_MIN_MS		200
+#define MQTT_PROBE_RTO_MAX_MS		10000
+#define MQTT_PROBE_MAX_MISSED		3		//consecutive timeouts (with doubled RTO) before the link is dead
+
+//Outbound traffic classes, queue per class drained by priority in loop()
+#define OUTBOUND_QUEUE_SIZE			8		//messages per class, the oldest is dropped when full
+#define OUTBOUND_CONTROL_RATE		20		//default rate in messages per second
+#define OUTBOUND_CONTROL_BURST		10
+#define OUTBOUND_TELEMETRY_RATE		5
+#define OUTBOUND_TELEMETRY_BURST	5
+#define OUTBOUND_BULK_RATE			1
+#define OUTBOUND_BULK_BURST			2
+
+//Resolved broker address is cached (and persisted), reconnects use it right away and re-resolve in the background
+#define MQTT_DNS_FILENAME			"/mqtt_dns.dat"
+#define MQTT_HOST_MAX_LEN			64
+#define MQTT_DNS_TTL_S				3600	//the Arduino resolver does not expose the record TTL
+#define MQTT_DNS_CHECK_MS			60000
+#define MQTT_DNS_IDLE				0		//states of the background lookup
+#define MQTT_DNS_PENDING			1
+#define MQTT_DNS_DONE				2
+
+//Broker failover: primary from MQTT_S/MQTT_P plus fallbacks from MQTT_F ("host[:port],host[:port]")
+//fallbacks are connected one after the other, a failover takes up to MQTT_FAILOVER_DNS_MS plus one connect timeout per unreachable broker
+#define MQTT_MAX_BROKERS			4
+#define MQTT_FAILOVER_DNS_MS		3000	//bound for the concurrent lookups of the fallback names
+#define MQTT_PRIMARY_CHECK_MS		30000	//health check of the primary while connected to a fallback or to no broker
+#define MQTT_PRIMARY_HEALTHY_CHECKS	3		//consecutive successful checks before moving back
+
+//Retained state shadow: payloads the broker replays unchanged after a reconnect do not reach the handler
+#define MQTT_SHADOW_REPLAY_MS		3000	//window after the resubscribe, arduino-mqtt does not pass the retained flag
+#define MQTT_SHADOW_WILDCARD_SLOTS	16		//topics received through wildcard subscriptions, least recently used is replaced
+
+//Persistent QoS1 session: unacknowledged messages are journaled in FileFS and replayed with DUP after reconnecting
+#define MQTT_SESSION_FILENAME		"/mqtt_session.dat"
+#define MQTT_SESSION_TEMP_FILENAME	"/mqtt_session.tmp"
+#define MQTT_SESSION_WINDOW			4		//unacknowledged messages kept, the oldest is dropped when full
+#define MQTT_SESSION_COMPACT_BYTES	2048	//journal is rewritten with only the messages in flight above this size
+#define MQTT_JOURNAL_ADD			'A'		//record types: message with topic and payload
+#define MQTT_JOURNAL_DONE			'D'		//acknowledged or given up
+#define MQTT_JOURNAL_ID				'I'		//packet ID actually used differs from the journaled one
+
+//Deep sleep cycle state, in RTC user memory on ESP8266 (offset in 4 byte blocks), RTC slow memory on ESP32
+#define SLEEP_STATE_MAGIC			0x504C5357UL
+#define SLEEP_STATE_RTC_OFFSET		0
+#ifdef ESP8266
+	#define SLEEP_PARAM_BLOB_SIZE	140		//packed parameter values, a larger set falls back to the full start
+#else
+	#define SLEEP_PARAM_BLOB_SIZE	512
+#endif
+
+//TLS session cache in RTC user memory (ESP8266), offset in 4 byte blocks of the 512 byte area
+#define TLS_SESSION_RTC_OFFSET		80
+#define TLS_SESSION_MAGIC			0x534C5455UL
+
+#define MAX_EVENT_HANDLERS			8
+
+//Subsystems affected by a parameter, used to restart only what is necessary after a live update
+#define WU_SUBSYSTEM_APP			0x01	//application parameters, nothing to restart
+#define WU_SUBSYSTEM_MQTT			0x02
+
+#define REMOTE_CONFIG_ACK_SUFFIX	"/ack"
+
+//Firmware update over MQTT: <topic>/begin {"size":bytes,"md5":"hex","sha256":"hex","sig":"hex"}, <topic>/chunk/<n> raw data from n = 0, <topic>/end
+//every message is answered on <topic>/ack with the next expected chunk, chunks have to fit the MQTT message buffer.
+//sig is the HMAC-SHA256 of "<size>:<sha256>" (lower case hex) keyed with the signing key given to enableOTA(), images without a valid one
+//are refused. On ESP8266 a failed update restarts the node since the updater cannot be reset, begin has to be sent again afterwards
+#define OTA_BEGIN_SUFFIX			"/begin"
+#define OTA_CHUNK_SUFFIX			"/chunk/"
+#define OTA_END_SUFFIX				"/end"
+#define OTA_ACK_SUFFIX				"/ack"
+#define OTA_REQUEST_MAX_LEN			256		//begin payload
+#define OTA_HASH_LEN				32		//SHA-256
+#define OTA_KEY_MIN_LEN				16
+#define OTA_KEY_MAX_LEN				64
+#define OTA_ACK_MAX_LEN				96
+#define OTA_RESTART_DELAY_MS		1000	//after the final ack
 
 
 // Use false above if you don't like to display Available Pages in Information Page of Config Portal
@@ -171,18 +351,245 @@ typedef struct
 
 typedef struct
 {
-  WiFi_Credentials  WiFi_Creds [NUM_WIFI_CREDENTIALS];
+  WiFi_Credentials  WiFi_Creds [NUM_WIFI_CREDENTIALS];	//only used for the portal and to read files of version 1
   char TZ_Name[TZNAME_MAX_LEN];
   char TZ[TIMEZONE_MAX_LEN];
   uint16_t checksum;
 } WM_Config;
 
+//entry of the credential store with connection history used to rank networks
+typedef struct
+{
+  char wifi_ssid[SSID_MAX_LEN];
+  char wifi_pw  [PASS_MAX_LEN];
+  uint16_t attempts;
+  uint16_t successes;
+  uint16_t avgConnectMs;		//moving average of successful connects
+  uint32_t lastConnectTime;		//unix time, 0 if unknown (no NTP)
+} WiFi_StoredNetwork;
+
+static_assert(MAX_WIFI_CREDENTIALS <= 16, "failed networks are tracked in a 16 bit mask");
+
+typedef struct
+{
+  char ssid[SSID_MAX_LEN + 1];
+  uint8_t bssid[6];
+  int32_t rssi;
+  int32_t channel;
+  ulong seenMs;		//millis() of the scan that last saw this access point
+} WiFi_ScanEntry;
+
+typedef struct
+{
+  uint16_t roams;
+  uint16_t failedRoams;
+  int32_t lastGainDb;		//RSSI after minus RSSI before the last roam
+  int32_t totalGainDb;
+  ulong lastRoamMs;
+  ulong lastRoamDurationMs;	//time without WiFi during the last roam
+} WiFi_RoamStats;
+
+typedef enum
+{
+	WU_POWER_DEFAULT = 0,	//platform setting is not touched
+	WU_POWER_NONE,			//radio always on, lowest latency
+	WU_POWER_BALANCED,		//modem sleep, wake every DTIM
+	WU_POWER_LOW			//modem sleep with a listen interval aligned to the traffic schedule
+} WU_PowerPolicy;
+
+typedef struct
+{
+  WU_PowerPolicy policy;
+  uint8_t listenInterval;	//beacons
+  ulong awakeMs;			//time with power save off (policy NONE or held awake)
+  ulong powerSaveMs;
+  ulong estRadioOnMs;		//awake time plus estimated beacon wakes
+  float estCurrentMa;		//estimated average current since boot
+  uint32_t holds;			//radio held awake for pending traffic
+} WU_PowerStats;
+
+typedef enum
+{
+	WU_HEAP_APPLICATION = 0,	//everything outside a library scope
+	WU_HEAP_PORTAL,
+	WU_HEAP_CONFIG,			//config file load/save
+	WU_HEAP_MQTT,			//MQTT reset and connect
+	WU_HEAP_SUBSCRIPTIONS,
+	WU_HEAP_LOGGING,		//Serial debug output
+	WU_HEAP_SUBSYSTEMS
+} WU_HeapSubsystem;
+
+typedef struct
+{
+  uint32_t allocations;		//operator new calls, WU_HEAP_TRACKING only
+  uint32_t bytes;			//requested in total, WU_HEAP_TRACKING only
+  int32_t liveBytes;		//allocated in the subsystem and not freed yet (wherever freed), WU_HEAP_TRACKING only
+  int32_t peakBytes;
+  uint32_t scopes;			//times the subsystem was entered
+  int32_t heapDelta;		//free heap consumed across its scopes, includes String and malloc
+} WU_HeapStats;
+
+typedef struct
+{
+  uint32_t freeHeap;
+  uint32_t largestBlock;
+  uint8_t fragmentation;	//percent, 100 - largest block / free heap
+  uint32_t minFreeHeap;		//since boot
+  uint32_t minLargestBlock;
+  uint8_t maxFragmentation;
+  ulong takenMs;
+} WU_HeapSnapshot;
+
+//time spent in the begin() phases, association overlaps config parsing and NTP setup on the fast path
+typedef struct
+{
+  ulong fsMountMs;
+  ulong credentialsMs;		//credential store and DHCP lease
+  ulong configParseMs;
+  ulong ntpSetupMs;
+  ulong associationMs;		//WiFi.begin() until connected or given up
+  ulong associationWaitMs;	//part of the association left after the overlapped phases
+  ulong connectedMs;		//millis() when WiFi was up, 0 if begin() did not connect
+  bool fastPath;			//association started right after the credentials were read
+  bool keptConnection;		//connection survived the restart and was reused
+} WU_BootStats;
+
+typedef enum
+{
+	WU_PHASE_LOOP = 0,		//complete loop()
+	WU_PHASE_TIMERS,
+	WU_PHASE_TRIGGER,
+	WU_PHASE_OUTBOUND,
+	WU_PHASE_TIMEOUT_CHECK,
+	WU_PHASE_WIFI_CHECK,
+	WU_PHASE_MQTT_LOOP,
+	WU_PHASE_RECONNECT,
+	WU_PHASE_BEGIN,
+	WU_PHASE_CONNECT_MQTT,
+	WU_PHASE_PUBLISH,
+	WU_PHASE_COUNT
+} WU_ProfilePhase;
+
+typedef struct
+{
+  uint32_t count;
+  uint32_t minUs;
+  uint32_t maxUs;
+  uint64_t totalUs;		//mean = totalUs / count
+  uint32_t histogram[PROFILE_HISTOGRAM_BUCKETS];
+} WU_PhaseStats;
+
+typedef struct
+{
+  char ssid[SSID_MAX_LEN];	//lease is only valid for this network
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns1;
+  uint32_t dns2;
+  uint32_t obtainedTime;	//unix time, 0 if unknown
+  uint32_t leaseSeconds;
+  uint16_t checksum;
+} WiFi_DhcpLease;
+
+//WIFI_CONFIG_FILENAME version 3: header, TZ_Name, TZ, WiFi_STA_IPConfig, count x WiFi_StoredNetwork
+//version 2 had only magic, version and count in the header and a 16 bit byte sum at the end
+typedef struct
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t count;
+  uint32_t length;	//bytes following the header
+  uint32_t crc;		//CRC32 over the header (with crc 0) and the following bytes
+} WiFi_StoreHeader;
+
+#define WIFI_CONFIG_V2_HEADER_SIZE	8	//magic, version, count
+
+typedef enum
+{
+	WM_PARAM_STRING = 0,	//untyped, value is only checked for its length
+	WM_PARAM_INT,
+	WM_PARAM_FLOAT,
+	WM_PARAM_BOOL,			//1/0, true/false, on/off
+	WM_PARAM_IP
+} WM_ParamType;
+
+typedef union
+{
+	long i;
+	float f;
+	bool b;
+	uint32_t ip;
+} WM_ParamValue;
+
+//Compile-time parameter declaration, e.g. constexpr WM_ParamSpec portSpec = WM_IntParam("port", "Port", 1, 65535, "1883");
+typedef struct WM_ParamSpec
+{
+	constexpr WM_ParamSpec(const char* ID, const char* Label, WM_ParamType Type, int Length, double MinValue, double MaxValue, const char* DefaultValue) 
+			: id(ID), label(Label), type(Type), length(Length), minValue(MinValue), maxValue(MaxValue), defaultValue(DefaultValue) {}
+	
+	const char* id;
+	const char* label;
+	WM_ParamType type;
+	int length;
+	double minValue;	//bounds for int and float parameters
+	double maxValue;
+	const char* defaultValue;
+} WM_ParamSpec;
+
+constexpr WM_ParamSpec WM_StringParam(const char* id, const char* label, int length, const char* defaultValue = "") { return WM_ParamSpec(id, label, WM_PARAM_STRING, length, 0, 0, defaultValue); }
+constexpr WM_ParamSpec WM_IntParam(const char* id, const char* label, long minValue, long maxValue, const char* defaultValue = "0") { return WM_ParamSpec(id, label, WM_PARAM_INT, 11, minValue, maxValue, defaultValue); }
+constexpr WM_ParamSpec WM_FloatParam(const char* id, const char* label, double minValue, double maxValue, const char* defaultValue = "0") { return WM_ParamSpec(id, label, WM_PARAM_FLOAT, 16, minValue, maxValue, defaultValue); }
+constexpr WM_ParamSpec WM_BoolParam(const char* id, const char* label, const char* defaultValue = "0") { return WM_ParamSpec(id, label, WM_PARAM_BOOL, 5, 0, 1, defaultValue); }
+constexpr WM_ParamSpec WM_IPParam(const char* id, const char* label, const char* defaultValue = "0.0.0.0") { return WM_ParamSpec(id, label, WM_PARAM_IP, 15, 0, 0, defaultValue); }
+
+/*	Fixed capacity replacement for String in the static memory mode, truncates instead of growing. */
+template <size_t N>
+class FixedString
+{
+	public:
+	FixedString() { buffer_[0] = 0; }
+	FixedString(const char* text) { *this = text; }
+	FixedString& operator=(const char* text) { strncpy(buffer_, text ? text : "", N); buffer_[N] = 0; return *this; }
+	FixedString& operator=(const String &text) { return *this = text.c_str(); }
+	bool operator==(const char* text) const { return strcmp(buffer_, text ? text : "") == 0; }
+	bool operator==(const String &text) const { return text == buffer_; }
+	bool operator!=(const char* text) const { return !(*this == text); }
+	operator const char*() const { return buffer_; }
+	const char* c_str() const { return buffer_; }
+	size_t length() const { return strlen(buffer_); }
+	
+	private:
+	char buffer_[N + 1];
+};
+
+#if WU_STATIC_MEMORY
+	typedef FixedString<WU_PARAM_VALUE_MAX>		WU_ParamString;
+	typedef FixedString<WU_TOPIC_MAX>			WU_TopicString;
+	typedef FixedString<WU_PAYLOAD_MAX>			WU_PayloadString;
+	typedef FixedString<WU_REMOTE_CONFIG_MAX>	WU_ConfigString;
+#else
+	typedef String	WU_ParamString;
+	typedef String	WU_TopicString;
+	typedef String	WU_PayloadString;
+	typedef String	WU_ConfigString;
+#endif
+
+typedef void (*WU_MessageCallback)(const char topic[], const char payload[], int length);	//payload is terminated
+
 typedef struct WM_Param	//struct name twice to define constructor inside here
 {
-	WM_Param() : id(""), label(""), defaultValue(""), length(0), customHTML(""), labelPlacement(WFM_LABEL_BEFORE), value(String()) { }
+	WM_Param() : id(""), label(""), defaultValue(""), length(0), customHTML(""), labelPlacement(WFM_LABEL_BEFORE), value(), type(WM_PARAM_STRING), minValue(0), maxValue(0) { parsed.i = 0; }
 	WM_Param(const char* ID, const char* Label, int Length, const char* DefaultValue = "", bool PreferStoredDefault = true, const char* CustomHTML = "", int LabelPlacement = WFM_LABEL_BEFORE) 
-			: id(ID), label(Label), length(Length), defaultValue(DefaultValue), preferStoredDefault(PreferStoredDefault), customHTML(CustomHTML), labelPlacement(LabelPlacement), value(String()) {}
+			: id(ID), label(Label), defaultValue(DefaultValue), length(Length), customHTML(CustomHTML), labelPlacement(LabelPlacement), value(), preferStoredDefault(PreferStoredDefault), 
+			type(WM_PARAM_STRING), minValue(0), maxValue(0) { parsed.i = 0; }
+	WM_Param(const WM_ParamSpec &spec) 
+			: id(spec.id), label(spec.label), defaultValue(spec.defaultValue), length(spec.length), customHTML(""), labelPlacement(WFM_LABEL_BEFORE), value(), preferStoredDefault(true), 
+			type(spec.type), minValue(spec.minValue), maxValue(spec.maxValue) { parsed.i = 0; setValue(spec.defaultValue); }
 	const char* preferedDefault();
+	bool parseValue(const char* text, WM_ParamValue &result) const;	//validates text against type and bounds
+	bool setValue(const char* text);	//parses once and stores text and parsed value, malformed values are rejected and the old value is kept
+	double numericValue() const;
 	
 	const char* id;
 	const char* label;
@@ -190,15 +597,154 @@ typedef struct WM_Param	//struct name twice to define constructor inside here
 	int length;
 	const char* customHTML;
 	int labelPlacement;
-	String value;
+	WU_ParamString value;
 	bool preferStoredDefault;
+	WM_ParamType type;
+	double minValue;
+	double maxValue;
+	WM_ParamValue parsed;	//valid for typed parameters
 } WM_Param;
 
 
+typedef void (*TimerCallback)(void* arg);
+
+/*	Hashed timer wheel without heap allocation. Jobs live in a fixed pool and are linked into the bucket of their expiry tick,
+	so each tick only looks at the jobs of one bucket. Handles of one-shot jobs become invalid once the job has run. */
+class TimerWheel
+{
+	public:
+	TimerWheel();
+	
+	int schedule(ulong delayMs, TimerCallback callback, void* arg = NULL, ulong periodMs = 0);	//periodMs 0 -> one-shot, returns handle or -1 if the pool is exhausted. Handles carry a generation, a stale handle never matches a reused job
+	bool reschedule(int handle, ulong delayMs);		//moves the next execution, period is kept
+	bool cancel(int handle);
+	bool isScheduled(int handle);
+	void run(ulong nowMs);	//executes all jobs due until nowMs
+	
+	protected:
+	struct Job
+	{
+		TimerCallback callback;
+		void* arg;
+		ulong expireTick;
+		ulong periodTicks;
+		int8_t next;
+		int8_t prev;
+		bool active;
+		uint16_t generation;	//bumped on every schedule, part of the handle
+	};
+	
+	int jobIndex(int handle);	//index of the scheduled job the handle refers to, -1 if stale or invalid
+	static ulong msToTicks(ulong ms) { return (ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS; }
+	void link(int handle);
+	void unlink(int handle);
+	bool runSlot(ulong tick);	//returns true if a job was executed
+	
+	Job jobs_[TIMER_WHEEL_MAX_JOBS];
+	int8_t slots_[TIMER_WHEEL_SLOTS];	//head of the job list per bucket
+	ulong currentTick_;
+	ulong lastMs_;
+	bool started_;
+};
+
+static_assert(TIMER_WHEEL_MAX_JOBS <= 127, "job links are int8_t");
+static_assert((TIMER_WHEEL_SLOTS & (TIMER_WHEEL_SLOTS - 1)) == 0, "TIMER_WHEEL_SLOTS has to be a power of two");
 
 
 
 
+typedef enum
+{
+	WU_EVENT_WIFI_UP = 0,
+	WU_EVENT_WIFI_DOWN,
+	WU_EVENT_IP_ACQUIRED,
+	WU_EVENT_MQTT_CONNECTED,
+	WU_EVENT_MQTT_DISCONNECTED,
+	WU_EVENT_PORTAL_OPENED,
+	WU_EVENT_PORTAL_CLOSED,
+	WU_EVENT_CONFIG_CHANGED,
+	WU_EVENT_ROAMED,
+	WU_EVENT_COUNT
+} WifiUtilityEventType;
+
+#define WU_EVENT_MASK(type)		(1UL << (type))
+#define WU_EVENT_MASK_ALL		0xFFFFFFFFUL
+
+typedef struct
+{
+	WifiUtilityEventType type;
+	ulong timestampMs;
+	IPAddress ip;		//local IP for WU_EVENT_IP_ACQUIRED
+} WifiUtilityEvent;
+
+typedef void (*EventCallback)(const WifiUtilityEvent &event, void* arg);
+
+/*	Fixed size list of event handlers. Handlers are called synchronously from the library code that detected the transition,
+	so they should be short and must not call blocking library methods like begin() or wifiConfigPortal(). */
+class EventBus
+{
+	public:
+	EventBus();
+	
+	bool subscribe(EventCallback callback, void* arg = NULL, uint32_t mask = WU_EVENT_MASK_ALL);	//false if no free slot
+	bool unsubscribe(EventCallback callback, void* arg = NULL);
+	void emit(const WifiUtilityEvent &event);
+	
+	protected:
+	struct Handler
+	{
+		EventCallback callback;
+		void* arg;
+		uint32_t mask;
+	};
+	Handler handlers_[MAX_EVENT_HANDLERS];
+};
+
+
+
+/*	Attributes heap use to a subsystem while in scope. Nested scopes count in both. */
+class WU_HeapScope
+{
+	public:
+	WU_HeapScope(WU_HeapSubsystem subsystem);
+	~WU_HeapScope();
+	
+	private:
+	uint8_t subsystem_;
+	uint8_t previous_;
+	uint32_t freeBefore_;
+};
+
+#if WU_HEAP_TRACKING
+	#define WU_HEAP_SCOPE(subsystem)	WU_HeapScope heapScope_(subsystem)
+#else
+	#define WU_HEAP_SCOPE(subsystem)
+#endif
+
+class WifiUtility;
+
+/*	Times a phase from construction to destruction, see WU_PROFILE. */
+class WU_ProfileScope
+{
+	public:
+	WU_ProfileScope(WifiUtility* owner, WU_ProfilePhase phase) : owner_(owner), phase_(phase), startCycles_(ESP.getCycleCount()), startMs_(millis()) {}
+	~WU_ProfileScope();
+	
+	private:
+	WifiUtility* owner_;
+	uint8_t phase_;
+	uint32_t startCycles_;
+	ulong startMs_;
+};
+
+#if WU_PROFILING
+	#define WU_PROFILE(phase)	WU_ProfileScope profileScope_(this, phase)
+#else
+	#define WU_PROFILE(phase)
+#endif
+
+
+
 class WifiUtility
 {
 	public:
@@ -207,23 +753,63 @@ class WifiUtility
 	void defaultConfig();
 	void configStationIP(bool useDHCP = true);	//true -> dynamic IP, false -> fixed IP (set in AP)
 	void configAP(char* hostname = "WiFi Utility", int APTimeoutS = 120, bool useCustomAPIP = false, IPAddress *APStaticIP = NULL, IPAddress *APStaticGateway = NULL, IPAddress *APStaticSubnet = NULL, String apSSID = ""); //all settings but APTimeoutS irrelevant if useCustomAPIP = false
-	void configService(int configPin = -1, int debuglevel = 1, ulong connectionCheckIntervalMs = 10, bool autoReconnect = false, bool actionReconnect = true);
+	void configService(int configPin = -1, int debuglevel = 1, ulong connectionCheckIntervalMs = 10, bool autoReconnect = false, bool actionReconnect = true, WU_PowerPolicy powerPolicy = WU_POWER_DEFAULT);
 	//debuglevel 0 nothing sent via Serial, 1 no sensitive data printed, 2 custom parameters printed (may include sensitive data) 3 everything (including passwords) printed
+	void configRoaming(bool enabled = false, int marginDb = 8, int triggerRssi = -70, ulong minDwellMs = 60000);	//switch to a stored network stronger by marginDb once the (smoothed) RSSI is below triggerRssi and the current AP was used for minDwellMs
+	void configTrigger(ulong debounceMs = TRIGGER_DEBOUNCE_MS, ulong longPressMs = TRIGGER_LONGPRESS_MS);	//config portal opens only if the trigger pin is held low for longPressMs
 	
 	bool addParameter(const char* ID, const char* Label, int Length, const char* DefaultValue = "", bool PreferStoredDefault = true, const char* CustomHTML = "", int LabelPlacement = WFM_LABEL_BEFORE);
+	int addParameter(const WM_ParamSpec &spec);	//typed parameter, value is validated and parsed once whenever it is loaded or changed. Returns a handle for get<T>() or -1, removeParameter() of an earlier parameter invalidates it
 	bool removeParameter(const char* id);
+#if !WU_STATIC_MEMORY
 	String getParameter(const char* id); //if you prefer a String, empty string if id not found
+#endif
 	bool getParameter(const char* id, char* buffer, int bufferLength); //if you prefer a cstring, return value is if id was found and complete copy, if not no action is taken on buffer/incomplete \0 terminated copy made.
 	int getParameterBufferLength(const char* id);	//provides minimum length for buffer in getParameter (with termination), returns 0 if id not found
+	template<typename T> T get(int handle);		//typed access to the parsed value (int, long, float, bool, IPAddress, const char*) without lookup or parsing. Logs and returns 0 on a bad handle or type mismatch. Handles shift when a parameter is removed
+	template<typename T> T get(const char* id) { return get<T>(findParameterIndex(id)); }	//same with a lookup by id
+#if WU_STATIC_MEMORY
+	int updateParameters(const char* json, char* error = NULL, size_t errorSize = 0);	//live update from a JSON object {"id":"value",...}; all or nothing, saves and restarts affected subsystems. Returns number of changed parameters or -1 on error
+#else
+	int updateParameters(const char* json, String* error = NULL);	//live update from a JSON object {"id":"value",...}; all or nothing, saves and restarts affected subsystems. Returns number of changed parameters or -1 on error
+#endif
+	
+	int addTimer(ulong intervalMs, TimerCallback callback, void* arg = NULL, bool periodic = true);	//runs callback(arg) from loop(), returns handle or -1 if no timer is available
+	bool removeTimer(int handle);
+	
+	bool addWifiCredentials(const char* ssid, const char* pw);	//adds or updates a network in the credential store and saves it
+	bool removeWifiCredentials(const char* ssid);
+	int wifiCredentialsCount() { return networkCount_; }
+	const WiFi_RoamStats& getRoamStats() { return roamStats_; }
+	const WU_PowerStats& getPowerStats() { accountPower(); return powerStats_; }
+	void holdRadioAwake(ulong durationMs);	//power save off for durationMs, e.g. while responses are expected
+	
+	static uint32_t heapGuardViolations();	//loop task allocations after begin() outside the config portal, always 0 without WU_HEAP_GUARD
+	static const WU_HeapStats& getHeapStats(WU_HeapSubsystem subsystem);	//all 0 without WU_HEAP_TRACKING
+	const WU_HeapSnapshot& getHeapSnapshot() { return heapSnapshot_; }	//taken every HEAP_SNAPSHOT_INTERVAL_MS
+	int heapReport(char* buffer, int bufferLength);	//JSON with the snapshot and per subsystem stats, returns length or -1 if the buffer is too small
+	
+	void configProfiling(ulong budgetUs = 0);	//prints the profile when a phase takes longer than budgetUs, 0 disables. Needs WU_PROFILING
+	const WU_PhaseStats& getPhaseStats(WU_ProfilePhase phase);	//all 0 without WU_PROFILING
+	uint32_t profileBudgetExceeded() { return budgetExceeded_; }
+	void printProfile();	//min/mean/max and histogram per phase via Serial
+	void resetProfile();
+	const WiFi_ScanEntry* getScanCache(int &count) { count = scanCacheCount_; return scanCache_; }	//access points seen by the last scans, check seenMs for the age
+	
+	bool onEvent(EventCallback callback, void* arg = NULL, uint32_t mask = WU_EVENT_MASK_ALL);	//callback fires once per state transition, mask built from WU_EVENT_MASK(type)
+	bool removeEventHandler(EventCallback callback, void* arg = NULL);
+	bool wifiConnected() { return wifiUp_; }	//state as of the last check, no polling of the radio
+	const WU_BootStats& getBootStats() { return bootStats_; }
 	
 	void begin();
 	bool loop();
+	void loopTimers();
 	void loopTriggerPin();
 	bool loopConnectionTimeout();
 	bool loopWifiConnection();
 	
 	void wifiConfigPortal();
-	bool loadConfigFile();
+	bool loadConfigFile() { return parseConfigFile(); }
 	bool saveConfigFile();
 	
 #if USE_ESP_WIFIMANAGER_NTP
@@ -237,17 +823,88 @@ class WifiUtility
 	void initSTAIPConfigStruct(WiFi_STA_IPConfig &in_WM_STA_IPconfig);
 	void displayIPConfigStruct(WiFi_STA_IPConfig in_WM_STA_IPconfig);
 	void configWiFi(WiFi_STA_IPConfig in_WM_STA_IPconfig);
-	uint8_t connectMultiWiFi();
+	uint8_t connectMultiWiFi();	//tries the stored networks in order of expected time to connect
+	bool connectNetwork(int index, int32_t channel = 0, const uint8_t* bssid = NULL);	//blocks up to WIFI_CONNECT_TIMEOUT_MS, updates the history of the network
+	bool beginNetwork(int index, int32_t channel = 0, const uint8_t* bssid = NULL);	//starts the association without waiting, returns if the cached lease is used
+	bool finishNetwork(int index, ulong start, bool fromLease);	//waits for the association started at start, updates the history
+	int bootCandidate();	//network to associate with before any scan, -1 if none is known to work
+	int storedNetwork(const char* ssid);	//index in the credential store, -1 if not stored
+	void setupNtp();
+	ulong expectedConnectMs(const WiFi_StoredNetwork &network, int32_t rssi);
+	void mergeScanResults(int16_t found);	//copies the results of the last scan into the cache and frees them
+	bool scanCacheFresh();
+	static void backgroundScanJob(void* arg);
+	static void scanPollJob(void* arg);
+	
+	static void roamCheckJob(void* arg);
+	void checkRoaming();
+	virtual void onRoamStart() {}	//subclasses pause services using the link
+	virtual void onRoamEnd(bool connected) {}
+	virtual void onAddressChanged() {}	//local address changed while connected, e.g. by a lease renewal
+	
+	static void heapSnapshotJob(void* arg);
+	void takeHeapSnapshot();
+	
+	friend class WU_ProfileScope;
+	void recordPhase(uint8_t phase, uint32_t us);	//adds the sample, reports if over budget
+	
+	virtual ulong trafficIntervalMs() { return 0; }	//period of regular traffic the radio has to be awake for, 0 if unknown
+	void applyPowerPolicy();	//on association and when the traffic schedule changes
+	void setPowerSave(bool enabled);
+	
+	static void armHeapGuard(bool armed);
+	void checkHeapGuard();	//reports violations since the last check
+	void accountPower();
+	static void radioReleaseJob(void* arg);
+	int addNetwork(const char* ssid, const char* pw);	//returns index, evicts the least useful network if the store is full
 	int calcChecksum(uint8_t* address, uint16_t sizeToCalc);
 	
 	bool loadWifiConfigData();
+	bool loadLegacyWifiConfigData(const uint8_t* data, size_t size);	//version 1 file: raw WM_Config + WiFi_STA_IPConfig
+	bool parseWifiConfigRecords(const uint8_t* data, size_t size, uint16_t count);	//TZ, IP config and networks as in version 2 and 3
 	void saveWifiConfigData();
+	void saveConnectionHistory();	//saves only if the ranking or the failure state changed, or after WIFI_HISTORY_SAVE_MS
+	uint32_t historyState();
+	static uint32_t crc32Update(uint32_t crc, const void* data, size_t length);	//CRC-32 (reflected, as crc32_le), start with 0. ROM table on ESP32, 16 entry table on ESP8266
+	
+	void loadDhcpLease();
+	void storeDhcpLease();		//saves the current DHCP lease if it changed
+	bool cachedLeaseValid(const char* ssid);	//false if there is no unexpired lease for ssid
+	bool claimCachedLease(ulong start);	//probes the lease address on the associated link, configures it or falls back to DHCP
+	void stopDhcp();
+	bool stationLinkUp();	//associated, independent of an address
+	bool dhcpLeaseState(uint32_t &leaseSeconds, uint32_t &ageS);	//lease time and age from the running DHCP client, false without a lease
+	bool leaseAddressInUse(IPAddress address);	//RFC 5227 ARP probe, run before the address is configured
+	static void leaseRenewJob(void* arg);
+	void renewCachedLease();	//starts the DHCP client on the cached address without removing it
+	static void leaseStoreJob(void* arg);
 	
 	int findParameterIndex(const char* id); //returns -1 if nothing found
+	const WM_Param* typedParameter(int handle, uint8_t typeMask);	//NULL and logged if the handle is invalid or the type is not in typeMask
+	int applyParameters(const char* json, char* error, size_t errorSize, uint8_t &subsystems);	//validates, applies and saves an update, returns the affected subsystems
+	bool parseConfigFile();	//reads the parameters from the config file without restarting anything
+	void mountFilesystem();	//no-op once mounted
+	virtual uint8_t parameterSubsystem(const char* id) { return WU_SUBSYSTEM_APP; }
+	virtual void reloadSubsystems(uint8_t subsystems) {}	//restart what is affected by changed parameters (WU_SUBSYSTEM_* mask)
+	
+	void attachTriggerPin();	//(re)attaches the trigger interrupt, only after begin() so the pin is not touched before the core is set up
+	static void triggerPinISR(void* arg);
+	
+	void emitEvent(WifiUtilityEventType type);
+	void updateWifiState(bool connected);	//emits events on transitions only
+	
+	static void connectionCheckJob(void* arg);
+	void backoffConnectionCheck(bool failed);	//spaces out reconnect attempts after failures, resets after success
 	
 	bool initializing_;
 	bool initialConfig_;
 	int triggerPin_;
+	int attachedTriggerPin_;	//pin the interrupt is currently attached to, -1 if none
+	ulong triggerDebounceMs_;
+	ulong triggerLongPressMs_;
+	volatile bool triggerPressed_;		//set/cleared by the ISR, loop only checks this flag
+	volatile ulong triggerEdgeMs_;		//last accepted edge
+	volatile ulong triggerPressStartMs_;
 	bool autoReconnect_;
 	bool actionReconnect_;
 	FS* filesystem_;
@@ -259,13 +916,31 @@ class WifiUtility
 	//SSID and PW for stored AP
 	String routerSSID_;
 	String routerPass_;
-#ifdef ESP32
-	WiFiMulti wifiMulti_;
-#else
-	ESP8266WiFiMulti wifiMulti_;
-#endif
-	
 	WM_Config WMConfig_;
+	WiFi_StoredNetwork networks_[MAX_WIFI_CREDENTIALS];
+	uint8_t networkCount_;
+	uint16_t failedNetworks_;		//bit per network whose last attempt failed
+	uint32_t savedHistoryState_;	//historyState() of the stored file
+	ulong historySavedMs_;
+	WiFi_ScanEntry scanCache_[SCAN_CACHE_SIZE];
+	uint8_t scanCacheCount_;
+	bool scanRunning_;
+	
+	bool roamEnabled_;
+	int roamMarginDb_;
+	int roamTriggerRssi_;
+	ulong roamMinDwellMs_;
+	int32_t smoothedRssi_;		//0 if no sample since the last association
+	ulong associatedSinceMs_;
+	WiFi_RoamStats roamStats_;
+	
+	WU_PowerPolicy powerPolicy_;
+	bool powerSaveActive_;
+	bool radioHeld_;
+	int radioHoldTimer_;
+	ulong wakePeriodMs_;		//radio wake period in power save
+	ulong powerAccountMs_;
+	WU_PowerStats powerStats_;
 	std::vector<WM_Param> configParameters_;
 
 	bool useDHCP_;
@@ -279,17 +954,37 @@ class WifiUtility
 	WiFi_AP_IPConfig  WM_AP_IPconfig_;
 	WiFi_STA_IPConfig WM_STA_IPconfig_;
 	
+	WiFi_DhcpLease dhcpLease_;
+	bool usingCachedLease_;		//static config from the cache is active, DHCP renewal pending
+	
+	EventBus events_;
+	bool wifiUp_;
+	IPAddress lastIP_;
+	
+	WU_HeapSnapshot heapSnapshot_;
+	
+#if WU_PROFILING
+	WU_PhaseStats phaseStats_[WU_PHASE_COUNT];
+#endif
+	ulong profileBudgetUs_;
+	uint32_t budgetExceeded_;
+	ulong lastProfileReportMs_;
+	
+	WU_BootStats bootStats_;
+	
+	TimerWheel timers_;
+	int connectionCheckTimer_;
+	bool connectionCheckDue_;
 	ulong connectionCheckIntervalMs_;
-	ulong checkWifiTimeout_;
-	ulong lastloop_;
+	ulong reconnectBackoffMs_;
 	int APTimeoutS_;
 	
-	#define D1PRINT(x) 		if(debuglevel_ >= 1 && !quiet_) 	{Serial.print(x);}
-	#define D1PRINTLN(x) 	if(debuglevel_ >= 1 && !quiet_) 	{Serial.println(x);}
-	#define D2PRINT(x) 		if(debuglevel_ >= 2 && !quiet_) 	{Serial.print(x);}
-	#define D2PRINTLN(x) 	if(debuglevel_ >= 2 && !quiet_) 	{Serial.println(x);}
-	#define D3PRINT(x) 		if(debuglevel_ >= 3 && !quiet_) 	{Serial.print(x);}
-	#define D3PRINTLN(x) 	if(debuglevel_ >= 3 && !quiet_) 	{Serial.println(x);}
+	#define D1PRINT(x) 		if(debuglevel_ >= 1 && !quiet_) 	{WU_HEAP_SCOPE(WU_HEAP_LOGGING); Serial.print(x);}
+	#define D1PRINTLN(x) 	if(debuglevel_ >= 1 && !quiet_) 	{WU_HEAP_SCOPE(WU_HEAP_LOGGING); Serial.println(x);}
+	#define D2PRINT(x) 		if(debuglevel_ >= 2 && !quiet_) 	{WU_HEAP_SCOPE(WU_HEAP_LOGGING); Serial.print(x);}
+	#define D2PRINTLN(x) 	if(debuglevel_ >= 2 && !quiet_) 	{WU_HEAP_SCOPE(WU_HEAP_LOGGING); Serial.println(x);}
+	#define D3PRINT(x) 		if(debuglevel_ >= 3 && !quiet_) 	{WU_HEAP_SCOPE(WU_HEAP_LOGGING); Serial.print(x);}
+	#define D3PRINTLN(x) 	if(debuglevel_ >= 3 && !quiet_) 	{WU_HEAP_SCOPE(WU_HEAP_LOGGING); Serial.println(x);}
 	int debuglevel_;
 	bool quiet_;
 };
@@ -298,41 +993,439 @@ class WifiUtility
 
 
 
+template<> long WifiUtility::get<long>(int handle);
+template<> int WifiUtility::get<int>(int handle);
+template<> float WifiUtility::get<float>(int handle);
+template<> bool WifiUtility::get<bool>(int handle);
+template<> IPAddress WifiUtility::get<IPAddress>(int handle);
+template<> const char* WifiUtility::get<const char*>(int handle);
+
+
+
+
+
+typedef struct
+{
+  char host[MQTT_HOST_MAX_LEN];
+  uint32_t ip;
+  uint32_t resolvedTime;	//unix time, 0 if unknown
+  uint32_t ttlSeconds;
+  uint16_t checksum;
+} MQTT_DnsCache;
+
+//background refresh through the lwIP resolver, completed from the lwIP context and applied in loop()
+typedef struct
+{
+  char host[MQTT_HOST_MAX_LEN];
+  volatile uint8_t state;	//MQTT_DNS_*
+  volatile uint32_t ip;		//0 if the lookup failed
+  ulong startMs;
+} MQTT_DnsLookup;
+
+typedef struct
+{
+  char host[MQTT_HOST_MAX_LEN];
+  uint16_t port;
+} MQTT_Broker;
+
+typedef struct
+{
+  uint32_t connects;		//transport connects incl. TLS handshake
+  uint32_t resumed;			//TLS sessions resumed from the cache
+  ulong lastConnectMs;
+  ulong maxConnectMs;
+} MQTT_TransportStats;
+
+typedef enum
+{
+	WU_CLASS_CONTROL = 0,	//highest priority, e.g. acknowledgements
+	WU_CLASS_TELEMETRY,
+	WU_CLASS_BULK,
+	WU_CLASS_COUNT
+} WU_TrafficClass;
+
+typedef struct
+{
+  uint32_t sent;
+  uint32_t dropped;			//overwritten in a full queue or failed to publish
+  uint16_t queued;			//current queue depth
+  uint16_t maxQueued;
+  ulong avgLatencyMs;		//queueing delay, exponential average
+  ulong maxLatencyMs;
+} WU_ClassStats;
+
+typedef struct
+{
+  WU_TopicString topic;
+  WU_PayloadString payload;
+  bool retained;
+  int qos;
+  ulong queuedMs;
+} WU_OutboundMessage;
+
+typedef struct
+{
+  uint32_t ratePerS;
+  uint32_t burst;
+  uint32_t tokensMilli;		//token bucket in 1/1000 messages
+  ulong refillMs;
+  WU_OutboundMessage queue[OUTBOUND_QUEUE_SIZE];
+  uint8_t head;
+  uint8_t count;
+  WU_ClassStats stats;
+} WU_OutboundClass;
+
+//state kept over deep sleep, connect without filesystem, JSON, scan and DHCP
+typedef struct
+{
+  uint32_t magic;
+  uint16_t checksum;		//over everything after this field
+  uint16_t paramLayout;		//checksum of the parameter ids, detects a different firmware
+  char ssid[33];
+  char pw[65];
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint32_t ip;				//lease or static configuration
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns1;
+  uint32_t dns2;
+  uint32_t leaseSeconds;	//0 for static configuration
+  uint32_t leaseAgeS;		//awake and sleep time since the lease was obtained
+  uint32_t brokerIP;
+  uint32_t wakeCount;
+  uint32_t fastWakes;
+  uint32_t lastWakeToSleepMs;
+  uint16_t paramCount;
+  char params[SLEEP_PARAM_BLOB_SIZE];	//parameter values in registration order, each terminated
+} WU_SleepState;
+
+#ifdef ESP8266
+static_assert(sizeof(WU_SleepState) <= (TLS_SESSION_RTC_OFFSET - SLEEP_STATE_RTC_OFFSET)*4, "sleep state overlaps the TLS session in RTC memory");
+#endif
+
+typedef struct
+{
+  uint32_t wakeCount;
+  uint32_t fastWakes;		//wakes that used the RTC state
+  ulong lastWakeToSleepMs;	//previous cycle, from boot to entering deep sleep
+  ulong wakeToConnectMs;	//this cycle, from boot to MQTT connected
+} WU_SleepStats;
+
+typedef struct
+{
+  ulong srttMs;				//smoothed round trip time
+  ulong rttvarMs;			//round trip time variation
+  ulong rtoMs;				//current probe timeout
+  ulong minRttMs;
+  ulong maxRttMs;
+  uint32_t probesSent;
+  uint32_t probesAnswered;
+  uint32_t deadLinks;		//links closed because probes were not answered
+  uint16_t keepAliveS;		//current keepalive
+  uint16_t longestIdleS;		//longest idle gap before a probe that was still answered
+  uint16_t shortestLostIdleS;	//shortest idle gap before a probe after which the link was lost, 0 if never observed. A NAT timeout lies in between
+} MQTT_LinkStats;
+
+typedef struct
+{
+  uint32_t lookups;
+  uint32_t failures;
+  uint32_t cacheHits;		//reconnects that did not wait for DNS
+  ulong lastLookupMs;		//duration of the last lookup
+  ulong maxLookupMs;
+} MQTT_DnsStats;
+
+//entry of the subscription registry, with the shadow of the last payload for exact topics
+typedef struct
+{
+  WU_TopicString topic;
+  uint32_t payloadHash;
+  bool seen;			//payloadHash is valid
+} MQTT_Subscription;
+
+typedef struct
+{
+  uint32_t topicHash;	//0 marks a free slot
+  uint32_t payloadHash;
+  ulong usedMs;
+} MQTT_ShadowEntry;
+
+typedef struct
+{
+  uint32_t passed;
+  uint32_t suppressed;	//unchanged payloads within the replay window
+} MQTT_ShadowStats;
+
+typedef struct
+{
+  bool active;			//image being written, resumable with the same begin request
+  uint32_t size;
+  uint32_t written;
+  uint32_t nextChunk;
+  uint32_t duplicates;	//chunks received again, e.g. after a reconnect
+  uint32_t outOfOrder;	//chunks ahead of nextChunk, the sender rewinds to the acked chunk
+  uint8_t updateError;	//Update.getError() of the last failure
+} WU_OtaStatus;
+
+typedef struct
+{
+  uint16_t packetId;	//0 marks a free slot
+  bool retained;
+  uint32_t sequence;	//replay order
+  char topic[WU_TOPIC_MAX + 1];
+  char payload[WU_PAYLOAD_MAX + 1];
+} MQTT_InflightMessage;
+
+//append-only journal, topic and payload follow an add record
+typedef struct
+{
+  uint8_t type;
+  uint8_t retained;
+  uint16_t packetId;
+  uint32_t sequence;
+  uint16_t topicLength;
+  uint16_t payloadLength;
+  uint32_t crc;	//over the record with crc 0 and the strings
+} MQTT_JournalRecord;
+
+typedef struct
+{
+  uint16_t lastPacketId;
+  uint32_t sequence;
+  uint32_t journalBytes;	//size of MQTT_SESSION_FILENAME
+  MQTT_InflightMessage window[MQTT_SESSION_WINDOW];
+} MQTT_SessionJournal;
+
+typedef struct
+{
+  uint32_t journaled;
+  uint32_t acked;
+  uint32_t replayed;		//sent again with DUP after a reconnect or reboot
+  uint32_t dropped;			//window full or message too large for a slot, delivered at most once
+} MQTT_SessionStats;
+
 class WifiMqttUtility : public WifiUtility
 {
 	public:
 	WifiMqttUtility(int msgBufferSize = 128);
 	
 	bool begin();	//complete reset of WiFi and Mqtt service, returns if successful
+	bool beginSleepCycle();	//start for deep sleep nodes, connects from the RTC state of the last cycle (persistent MQTT session) or falls back to begin()
+	void sleep(ulong durationMs);	//stores the state in RTC memory, closes the MQTT session and enters deep sleep, does not return
+	const WU_SleepStats& getSleepStats() { return sleepStats_; }
 	bool connectMqtt();	//if connected does nothing, if mqtt can't connect reset, if WiFi not connected try to reconnect and reset
 	bool resetMqtt();
 	void wifiConfigPortal();
 	
 	bool loop();
 	bool checkMqttConnected();
+	bool mqttConnected() { return mqttUp_; }	//state as of the last check
 	
-	bool publish(const char topic[], const char payload[]) { if(actionReconnect_) connectMqtt(); return mqtt_.publish(topic, payload); }
-	bool publish(String topic, String payload) { if(actionReconnect_) connectMqtt(); return mqtt_.publish(topic, payload); }
+	bool publish(const char topic[], const char payload[]) { return publish(topic, payload, WU_CLASS_TELEMETRY); }	//rate limited as telemetry
+	bool publish(const char topic[], const char payload[], WU_TrafficClass cls, bool retained = false, int qos = 0);	//rate limited, queued if the class has no token left or older messages of it wait. False if MQTT is down, the message stays queued
 	bool subscribe(const char topic[]);
-	bool subscribe(String topic);
 	bool unsubscribe(const char topic[]);
-	bool unsubscribe(String topic);
 	//callback when data available
-	void onMessage(MQTTClientCallbackSimple cb) { mqtt_.onMessage(cb); }
+	void onMessage(WU_MessageCallback cb) { rawCallback_ = cb; }	//without String copies
+#if !WU_STATIC_MEMORY
+	bool publish(String topic, String payload) { return publish(topic.c_str(), payload.c_str(), WU_CLASS_TELEMETRY); }
+	bool publish(String topic, String payload, WU_TrafficClass cls, bool retained = false, int qos = 0) { return publish(topic.c_str(), payload.c_str(), cls, retained, qos); }
+	bool subscribe(String topic) { removeSubscription(topic.c_str()); return subscribe(topic.c_str()); }	//resets the retained state of the topic
+	bool unsubscribe(String topic) { return unsubscribe(topic.c_str()); }
+	void onMessage(MQTTClientCallbackSimple cb) { userCallback_ = cb; }
+#endif
+	
+	void configRetainedShadow(bool enable) { retainedShadow_ = enable; }	//drop unchanged payloads the broker replays after a reconnect, off by default
+	const MQTT_ShadowStats& getShadowStats() { return shadowStats_; }
+	
+	bool enableOTA(String topic, const char* signingKey);	//signed firmware updates on topic (see OTA_BEGIN_SUFFIX), restarts after a verified image. The key is compiled in, not the MQTT password. Empty topic disables
+	const WU_OtaStatus& getOtaStatus() { return otaStatus_; }
 	
-	MQTTClient* getHandler() {return &mqtt_; }	//to do more advanced configuration, be careful when using as lifetime of the pointer is contingent on the existance of the object!
+	bool enableRemoteConfig(String topic);	//accept parameter updates (see updateParameters) on topic, the result is published to topic + REMOTE_CONFIG_ACK_SUFFIX. Empty topic disables
+	
+	const MQTT_DnsStats& getDnsStats() { return dnsStats_; }
+	int activeBroker() { return activeBroker_; }	//0 primary, >0 index in the fallback list, -1 not connected
+	
+	void setTransport(Client &client) { transport_ = &client; tlsEnabled_ = false; }	//custom network client, call before begin()
+	void configTLS(const char* caCert = NULL);	//TLS with the CA in PEM format (must stay valid), NULL disables verification for testing. Call before begin()
+	const MQTT_TransportStats& getTransportStats() { return transportStats_; }
+	
+	void configLinkProbe(bool enable) { linkProbe_ = enable; }	//RTT probing via an echo on MQTT_PROBE_TOPIC_PREFIX + client ID, needed for the adaptive keepalive. Disabled by default, costs one publish and one echo per keepalive/2. Set before begin()
+	const MQTT_LinkStats& getLinkStats() { return linkStats_; }
+	
+	void configHeapTelemetry(String topic, ulong intervalMs = 60000);	//publishes heapReport() on topic (telemetry class), empty topic disables
+	
+	void configPersistentSession(bool enable);	//QoS1 messages survive reboots until acknowledged, needs a fixed client ID. Call before begin()
+	const MQTT_SessionStats& getSessionStats() { return sessionStats_; }
+	
+	void configRateLimit(WU_TrafficClass cls, uint32_t ratePerS, uint32_t burst);
+	const WU_ClassStats& getClassStats(WU_TrafficClass cls) { return outbound_[cls].stats; }
+	
+	MQTTClient* getHandler() {return &mqtt_; }	//to do more advanced configuration, be careful when using as lifetime of the pointer is contingent on the existance of the object! Do not replace the message callback, use onMessage()
 	
 	bool loadConfigFile();	//update mqtt data everytime config file is touched (ie at the end of config portal or reset); adds mqtt reset
 	
 	protected:
-	void addSubscription(String topic);
-	void removeSubscription(String topic);
+	bool addSubscription(const char* topic);	//false if the subscription table is full
+	void removeSubscription(const char* topic);
+	void updateMqttState(bool connected);	//emits events on transitions only
+	
+	uint8_t parameterSubsystem(const char* id);
+	void reloadSubsystems(uint8_t subsystems);
+	void onRoamStart();
+	void onRoamEnd(bool connected);
+	void onAddressChanged();
+	ulong trafficIntervalMs() { return linkStats_.keepAliveS*1000UL/2; }	//keepalive service and probe period
+	
+	static void messageReceived(MQTTClient *client, char topic[], char bytes[], int length);
+	bool shadowPass(const char* topic, const char* payload, int length);	//false if the message is an unchanged replay
+	static uint32_t fnvHash(const char* data, size_t length);
+	void loopRemoteConfig();	//processes a received config update outside of the MQTT callback
+	
+	bool otaMessage(const char* topic, const char* bytes, int length);	//true if the message belonged to the update, called from the MQTT callback
+	void otaBegin(const char* request);
+	void otaChunk(uint32_t chunk, const uint8_t* data, int length);
+	void otaEnd();
+	void otaAck(const char* error = NULL);	//next expected chunk or the error, sent from loop()
+	void otaAbort();
+	bool otaSignatureValid(uint32_t size, const char* sha256, const char* signature);	//HMAC keyed with otaKey_
+	static bool parseHex(const char* hex, uint8_t* out, size_t length);	//exactly 2*length hex digits
+	void loopOta();
+	static void otaRestartJob(void* arg);
+	
+	static void keepAliveJob(void* arg);
+	static void heapTelemetryJob(void* arg);
+	void publishHeapReport();
+	
+	void sendProbe();
+	void probeEchoed(const char* payload);	//RTT sample, called from the message callback
+	static void probeTimeoutJob(void* arg);
+	void probeTimedOut();
+	void setKeepAlive(uint16_t seconds);	//probe period now, MQTT keepalive with the next connect
+	
+	bool fastWake();	//connect from sleepState_
+	void captureSleepState(ulong sleepMs);
+	bool readSleepState();
+	void writeSleepState();
+	uint16_t parameterLayout();
+	bool packParameters();
+	bool unpackParameters();
+	
+	void loadSessionJournal();	//replays the journal records into session_
+	static size_t writeJournalRecord(File &file, uint8_t type, const MQTT_InflightMessage &inflight);	//bytes written, 0 on a short write
+	bool appendJournalRecord(uint8_t type, const MQTT_InflightMessage &inflight);	//compacts when the journal grew too large
+	void compactSessionJournal();	//rewrites the journal with the messages in flight, removes it if there are none
+	void finishInflight(int slot);	//frees the slot and records it as done
+	int sessionSlot();	//free slot or the oldest one
+	int journalMessage(const char* topic, const char* payload, bool retained);	//slot or -1 if it cannot be journaled
+	void replaySession();	//re-sends the journaled messages with their packet IDs and DUP
+	
+	bool takeToken(WU_OutboundClass &oc);	//refills the bucket, consumes a token if available
+	bool sendOutbound(WU_OutboundClass &oc, WU_OutboundMessage &msg);
+	void loopOutbound();	//drains the queues in priority order
+	
+	bool brokerAddress(const char* host, IPAddress &ip);	//cached address for host, resolves only if nothing is cached
+	bool resolveBroker(const char* host);	//blocking timed lookup, only if nothing is cached yet
+	bool updateDnsCache(const char* host, IPAddress ip, ulong lookupMs);	//records a lookup, persists changed addresses. false if ip is 0
+	void loadDnsCache();
+	bool dnsCacheExpired();
+	static void dnsRefreshJob(void* arg);
+	void refreshBrokerAddress();	//starts a non-blocking lookup for an expired cache entry
+	void loopDns();		//applies a finished lookup, reconnects if the address changed
+	
+	int loadBrokerList();	//primary and fallbacks from the parameters, returns count
+	bool connectBroker(int index, const char* clientID, const char* user, const char* pw, IPAddress resolved = IPAddress(0u));	//resolved address of a fallback, 0 if not known
+	bool failoverBrokers(const char* clientID, const char* user, const char* pw);	//resolves all fallbacks concurrently, then connects them in list order
+	static void primaryCheckJob(void* arg);
+	void checkPrimaryBroker();
+	
+	bool connectTransport(const MQTT_Broker &broker, bool useAddress, IPAddress ip);	//timed connect incl. TLS handshake
+	void loadTlsSession();
+	void storeTlsSession();
 	
 	/**add client id, potentially randomly generated?**/
 	const char* const mqttDataID[5] = {"MQTT_S", "MQTT_P", "MQTT_C", "MQTT_U", "MQTT_K"}; //parameter ids for [0] server address, [1] server port, [2] client ID, [3] username, [4] password
-	std::vector<String> subscriptions;
+	const char* const mqttFallbackID = "MQTT_F";	//comma separated fallback brokers
+	std::vector<MQTT_Subscription> subscriptions;	//capacity reserved up front in static memory mode
+	bool retainedShadow_;
+	ulong shadowReplayStartMs_;
+	MQTT_ShadowEntry wildcardShadow_[MQTT_SHADOW_WILDCARD_SLOTS];
+	MQTT_ShadowStats shadowStats_;
+	int keepAliveTimer_;
+	
+	bool linkProbe_;
+	WU_TopicString probeTopic_;
+	uint32_t probeSeq_;
+	ulong probeSentMs_;
+	ulong probeFirstSentMs_;	//first transmission of the current probe
+	int probeTimeoutTimer_;
+	uint8_t probeMissed_;
+	bool probeVerified_;	//an echo was received in this session, the broker allows the probe topic
+	uint16_t stableProbes_;
+	ulong lastTrafficMs_;	//last echo, received message or queued publish sent, the idle gap of a probe starts here
+	MQTT_LinkStats linkStats_;
+	
+	WU_OutboundClass outbound_[WU_CLASS_COUNT];
+	
+	bool persistentSession_;
+	bool sessionLoaded_;
+	MQTT_SessionJournal session_;
+	MQTT_SessionStats sessionStats_;
+	WU_TopicString heapTopic_;
+	int heapTelemetryTimer_;
+	
+	bool sleepCycle_;
+	WU_SleepState sleepState_;
+	WU_SleepStats sleepStats_;
+	bool mqttUp_;
+	
+	MQTT_DnsCache dnsCache_;
+	ulong dnsResolvedMs_;	//millis() of the last lookup in this session
+	bool dnsCacheLoaded_;
+	MQTT_DnsStats dnsStats_;
+	MQTT_DnsLookup dnsLookup_;
+	
+	MQTT_Broker brokers_[MQTT_MAX_BROKERS];
+	int brokerCount_;
+	int activeBroker_;
+	bool primaryHealthy_;
+	AsyncClient primaryProbe_;	//non-blocking health check of the primary
+	MQTT_DnsLookup fallbackLookups_[MQTT_MAX_BROKERS - 1];
+	volatile int primaryChecks_;	//consecutive successful health checks
+	
+	MQTTClientCallbackSimple userCallback_;
+	WU_MessageCallback rawCallback_;
+	int payloadBufferSize_;
+	char* payloadBuffer_;	//terminated copy of the incoming payload, sized like the client buffer
+	WU_TopicString remoteConfigTopic_;
+	WU_ConfigString pendingRemoteConfig_;
+	bool remoteConfigPending_;
+	
+	WU_TopicString otaTopic_;
+	WU_OtaStatus otaStatus_;
+	char otaMd5_[33];
+	uint8_t otaSha256_[OTA_HASH_LEN];	//announced in begin, authenticated by the signature
+	char otaKey_[OTA_KEY_MAX_LEN + 1];
+#ifdef ESP32
+	mbedtls_sha256_context otaHash_;	//over the chunks written
+#else
+	br_sha256_context otaHash_;
+#endif
+	char otaAck_[OTA_ACK_MAX_LEN];
+	bool otaAckPending_;
+	bool otaRestartPending_;
 	
 	WiFiClient client_;
+	WiFiClientSecure secureClient_;
+	Client* transport_;
+	bool tlsEnabled_;
+	MQTT_TransportStats transportStats_;
+	#ifdef ESP8266
+	BearSSL::X509List* tlsTrust_;
+	BearSSL::Session tlsSession_;	//reused on reconnect, copied to RTC memory to survive resets
+	bool tlsSessionValid_;
+	#endif
 	MQTTClient mqtt_;
 };
 